@@ -48,6 +48,11 @@
 
 ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "asterisk/module.h"
 #include "asterisk/lock.h"
 #include "asterisk/channel.h"
@@ -57,6 +62,21 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 #include "asterisk/config.h"
 #include "asterisk/app.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/cli.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/manager.h"
+#include "asterisk/features.h"
+#include "asterisk/causes.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+#include "asterisk/rtp_engine.h"
+#include "asterisk/datastore.h"
+#include "asterisk/indications.h"
+#include "asterisk/devicestate.h"
+#include "asterisk/paths.h"
+#include "asterisk/http.h"
+
+#include "app_cpa.h"
 
 /*** DOCUMENTATION
 	<application name="CPA" language="en_US">
@@ -73,6 +93,59 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 				<para>Is the maximum time allowed for the algorithm</para>
 				<para>Default is 5000ms</para>
 			</parameter>
+			<parameter name="dtmfWait" required="false">
+				<para>Reserved, ms to wait for DTMF before analysis</para>
+			</parameter>
+			<parameter name="profile" required="false">
+				<para>Name of a <literal>type=profile</literal> section of cpa.conf holding the tone thresholds</para>
+				<para>Default is the <literal>default</literal> profile</para>
+				<para><literal>auto</literal> picks one of the <literal>auto_profiles</literal> of cpa.conf
+				for the call's trunk, the fastest one that is accurate enough on it going by the
+				dispositions reported with <literal>CPA_DISPOSITION</literal> or the
+				<literal>CPADisposition</literal> manager action. The trunk is <variable>CPATRUNK</variable>,
+				or the channel name without its unique suffix.</para>
+			</parameter>
+			<parameter name="options" required="false">
+				<optionlist>
+					<option name="E">
+						<para>End of greeting for voicemail systems that do not beep. After a
+						<literal>Talking</literal> or <literal>Machine</literal> verdict, keep listening
+						until the far end's speech is followed by the profile's <literal>eog_silence</literal>
+						of silence, measured against the line's own noise floor, and set
+						<variable>CPAEOG</variable>. Returns as soon as recording has likely started, at
+						most <literal>eog_max_wait</literal> ms after the verdict.</para>
+					</option>
+					<option name="H">
+						<argument name="maxhold" />
+						<para>Hold mode for calls the far end has put on hold. Instead of tone analysis,
+						wait for hold music or announcements, raise <literal>CPAHold</literal>, and return
+						<literal>HumanReturned</literal> once live speech follows the hold, or <literal>Hold</literal>
+						if still on hold after <replaceable>maxhold</replaceable> seconds (default is the
+						profile's <literal>hold_max_time</literal>).</para>
+					</option>
+					<option name="I">
+						<argument name="impairment" required="true" />
+						<para>Run the audio through the named <literal>type=impairment</literal> chain of
+						cpa.conf before analysis, to see how a profile copes with noise, loss, level
+						offsets, clipping and G.711 round trips. For testing only.</para>
+					</option>
+					<option name="P">
+						<para>Probe mode for answering machine detection. When the first burst of speech
+						pauses, a short tone (the profile's <literal>probe_tone</literal>) is played to
+						the far end. A recording talks on over it, a person stops or answers it after a
+						human reaction time. Together with the length of the first burst this returns
+						<literal>Human</literal> or <literal>Machine</literal>, usually within a second of
+						the pause.</para>
+					</option>
+					<option name="R">
+						<para>Keep the analysis on the channel and carry on from it on the next
+						<literal>CPA(...,R)</literal>, so tone history, levels and timing survive between
+						calls (e.g. around a <literal>Playback</literal>). A <replaceable>profile</replaceable>
+						given on a later call replaces the thresholds, the analysis window starts again
+						from where the earlier call stopped.</para>
+					</option>
+				</optionlist>
+			</parameter>
 		</syntax>
 		<description>
 			<para>
@@ -87,6 +160,20 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 				This app uses the ast_dsp_call_progress function in dsp.c to get an AST_FRAME_CONTROL type response and return this result to the dialplan or AGI application.
 				Also, if the channel connects but plays a busy tone over the channel, the application will never know this on technologies that rely on signalling for call progress.
 			</para>
+			<para>When the profile lists several tone zones, the zone that decides is learned for the
+			destination taken from the <variable>CPADESTINATION</variable> channel variable, or the
+			connected line number if it is not set.</para>
+			<para>With <literal>feature_file</literal> set in cpa.conf, the features of every call
+			are appended to that feature store. Set <variable>CPALABEL</variable> to the status the
+			call really is (e.g. when replaying a labeled corpus) to store it as the call's
+			label.</para>
+			<para>With <literal>record_dir</literal> set in cpa.conf, a sample of calls is recorded
+			to that directory: every frame the analysis read, in order, with the settings it ran
+			with. <literal>cpa replay</literal> runs a recording through the current profile and
+			shows whether the verdict is still the same.</para>
+			<para>A profile can list <literal>keyword</literal> phrases voicemail greetings use,
+			each with a recording of it. They are spotted in the audio as it is analysed and
+			hearing one ends the analysis with Machine.</para>
 			<para>This application sets the following channel variables:</para>
 			<variablelist>
 				<variable name="CPASTATUS">
@@ -96,9 +183,60 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 					<value name="Hungup" />
 					<value name="Congestion" />
 					<value name="Talking" />
+					<value name="Silence" />
+					<value name="Timeout" />
 					<value name="Unknown" />
 					<value name="NoFrames" />
 					<value name="FoundDTMF" />
+					<value name="Hold" />
+					<value name="HumanReturned" />
+					<value name="NoMedia">
+						<para>The channel's RTP instance received nothing for <literal>no_media_grace</literal>
+						ms, see cpa.conf.</para>
+					</value>
+					<value name="Screening">
+						<para>A call screening assistant answered, a synthetic prompt asking who is calling
+						followed by silence waiting for an answer. Only with a profile that sets
+						<literal>screening</literal>.</para>
+					</value>
+					<value name="Human">
+						<para>Probe mode only, a live person answered.</para>
+					</value>
+					<value name="Machine">
+						<para>A recording (voicemail, IVR) answered. Returned in probe mode, or when the
+						profile's keyword spotter heard one of its <literal>keyword</literal> phrases, see
+						<variable>CPAKEYWORD</variable>.</para>
+					</value>
+				</variable>
+				<variable name="CPARINGPERIOD">
+					<para>Set when the profile has <literal>cadence</literal> on. The ringback period
+					(ms) measured when the cadence detector returned Ringing, empty otherwise.</para>
+				</variable>
+				<variable name="CPASHADOW">
+					<para>Set on calls sampled for shadow evaluation. A comma separated list of
+					<replaceable>profile</replaceable>:<replaceable>status</replaceable>:<replaceable>ms</replaceable>
+					entries giving the status each shadow profile reached and when, or <literal>None</literal>
+					if it had not decided when the active profile did.</para>
+				</variable>
+				<variable name="CPAEOG">
+					<para>Set with the <literal>E</literal> option. The ms into the analysis at which a
+					greeting of at least <literal>eog_min_speech</literal> ended, empty if no such
+					greeting ended in time. Pauses before that much speech do not end it.</para>
+				</variable>
+				<variable name="CPAKEYWORD">
+					<para>Set when the profile lists <literal>keyword</literal> phrases. The phrase
+					that was heard, which makes the status Machine, empty if none was.</para>
+				</variable>
+				<variable name="CPAPROFILE">
+					<para>Set with profile <literal>auto</literal>, the profile that was picked.</para>
+				</variable>
+				<variable name="CPARECORDING">
+					<para>Set when the call was sampled for <literal>record_dir</literal>. The session
+					recording, replay it with <literal>cpa replay</literal>.</para>
+				</variable>
+				<variable name="CPAZONE">
+					<para>Set when the profile lists <literal>zones</literal>. The tone zone whose tones
+					produced the status, empty if the status did not come from a tone (e.g. Talking).</para>
 				</variable>
 			</variablelist>
 		</description>
@@ -109,339 +247,7269 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
 			<ref type="application">WaitForNoise</ref>
 		</see-also>
 	</application>
-
+	<function name="CPA_DISPOSITION" language="en_US">
+		<synopsis>
+			Report what a call analysed with profile auto really was.
+		</synopsis>
+		<syntax>
+			<parameter name="uniqueid" required="false">
+				<para>Uniqueid of the analysed channel, default is the current channel.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Write only. Set it to the status the call should have got, e.g.
+			<literal>Talking</literal> when an agent got a person or <literal>Machine</literal>
+			for voicemail. The verdict of the profile that ran is scored against it for the
+			call's trunk, see <literal>cpa show selection</literal>. Human and Talking count as
+			the same. Verdicts are kept for an hour.</para>
+		</description>
+		<see-also>
+			<ref type="application">CPA</ref>
+			<ref type="manager">CPADisposition</ref>
+		</see-also>
+	</function>
+	<manager name="CPADisposition" language="en_US">
+		<synopsis>
+			Report what a call analysed with profile auto really was.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="UniqueID" required="true">
+				<para>Uniqueid of the analysed channel.</para>
+			</parameter>
+			<parameter name="Disposition" required="true">
+				<para>The status the call should have got, see <literal>CPA_DISPOSITION</literal>.</para>
+			</parameter>
+		</syntax>
+		<see-also>
+			<ref type="function">CPA_DISPOSITION</ref>
+		</see-also>
+	</manager>
+	<manager name="CPASessions" language="en_US">
+		<synopsis>
+			List the sessions CPA is analysing.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Returns a <literal>CPASession</literal> event for every session in one
+			response, ended by <literal>CPASessionsComplete</literal>. Each event gives the
+			<literal>Channel</literal>, <literal>Uniqueid</literal> and <literal>Profile</literal>,
+			the <literal>State</literal> (<literal>Analysing</literal> or the verdict), the
+			<literal>Provisional</literal> status reported on Timeout, the <literal>Rings</literal>
+			heard so far, and the ms of audio <literal>Analysed</literal> and <literal>Elapsed</literal>
+			since the session started. The list is read without locking any channel, each
+			session's entry is consistent in itself.</para>
+		</description>
+	</manager>
+	<function name="CPA_TRUNK_STATUS" language="en_US">
+		<synopsis>
+			Whether one failure status dominates the recent calls on a trunk.
+		</synopsis>
+		<syntax>
+			<parameter name="trunk" required="false">
+				<para>Trunk name, default is the current channel's trunk: <variable>CPATRUNK</variable>
+				if set, otherwise the channel name without its unique suffix
+				(e.g. <literal>PJSIP/carrier1</literal>).</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Read only. Returns <literal>OK</literal>, or the status (e.g.
+			<literal>Congestion</literal>) that at least <literal>trunk_dominance</literal> percent of
+			at least <literal>trunk_min_calls</literal> calls analysed on the trunk in the last
+			<literal>trunk_window</literal> seconds returned, when it is one of
+			<literal>trunk_failures</literal>. A trunk is OK again once its window holds too few
+			calls. The same state is the device state of <literal>CPA:trunk</literal>,
+			<literal>UNAVAILABLE</literal> while degraded and <literal>NOT_INUSE</literal> otherwise.</para>
+		</description>
+		<see-also>
+			<ref type="application">CPA</ref>
+			<ref type="managerEvent">CPATrunkStatus</ref>
+		</see-also>
+	</function>
+	<application name="CPADial" language="en_US">
+		<synopsis>
+			Fork a call to several destinations and bridge the first one where a human answers.
+		</synopsis>
+		<syntax>
+			<parameter name="Technology/Resource" required="true" argsep="&amp;">
+				<argument name="Technology/Resource" required="true" />
+				<argument name="Technology2/Resource2" multiple="true" />
+			</parameter>
+			<parameter name="timeout" required="false">
+				<para>Seconds to wait for a human on any leg, default is 30</para>
+			</parameter>
+			<parameter name="profile" required="false">
+				<para>CPA profile used on every answered leg</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>All destinations are dialed at once with the caller's identity, as Dial() would, and the
+			caller hears ringing as soon as the first leg rings. Every leg that answers is analysed with its own
+			CPA session, all from the calling channel's thread. The first leg to return <literal>Talking</literal>
+			is bridged to the caller and the other legs are hung up with cause ANSWERED_ELSEWHERE.
+			A leg that returns <literal>Ringing</literal> after answering is analysed again, any other
+			status drops that leg.</para>
+			<para>This application sets the following channel variables:</para>
+			<variablelist>
+				<variable name="CPADIALSTATUS">
+					<value name="ANSWER" />
+					<value name="NOANSWER" />
+					<value name="BUSY" />
+					<value name="CHANUNAVAIL" />
+					<value name="CANCEL" />
+				</variable>
+				<variable name="CPADIALLEG">
+					<para>The Technology/Resource of the leg that was bridged.</para>
+				</variable>
+			</variablelist>
+		</description>
+		<see-also>
+			<ref type="application">CPA</ref>
+			<ref type="application">Dial</ref>
+		</see-also>
+	</application>
+	<application name="CPAMonitor" language="en_US">
+		<synopsis>
+			Watch a conference participant for hold music, dead line tones and hiss.
+		</synopsis>
+		<syntax>
+			<parameter name="action" required="false">
+				<enumlist>
+					<enum name="events"><para>Only raise <literal>CPAMonitor</literal> events (default).</para></enum>
+					<enum name="mute"><para>Mute the participant for as long as it offends.</para></enum>
+					<enum name="drop"><para>Hang the participant up.</para></enum>
+				</enumlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Attaches to the channel's read path and returns straight away, e.g. from a
+			ConfBridge join subroutine or just before <literal>ConfBridge</literal>. One frame in
+			<literal>monitor_duty</literal> is handed to a monitor thread shared by all monitored
+			channels, which looks for hold music, busy/reorder/dial tone/SIT and steady hiss
+			(North American tones) and raises <literal>CPAMonitor</literal> when a participant
+			starts or stops offending. Timings are in the [general] section of cpa.conf.</para>
+		</description>
+		<see-also>
+			<ref type="application">ConfBridge</ref>
+			<ref type="managerEvent">CPAMonitor</ref>
+		</see-also>
+	</application>
+	<managerEvent language="en_US" name="CPAMonitor">
+		<managerEventInstance class="EVENT_FLAG_CALL">
+			<synopsis>Raised when a channel watched by CPAMonitor starts or stops offending.</synopsis>
+			<syntax>
+				<parameter name="Channel" />
+				<parameter name="Uniqueid" />
+				<parameter name="Reason">
+					<enumlist>
+						<enum name="Music" />
+						<enum name="Tone" />
+						<enum name="Hiss" />
+						<enum name="Cleared" />
+					</enumlist>
+				</parameter>
+				<parameter name="Action">
+					<enumlist>
+						<enum name="None" />
+						<enum name="Muted" />
+						<enum name="Unmuted" />
+						<enum name="Dropped" />
+					</enumlist>
+				</parameter>
+			</syntax>
+			<see-also>
+				<ref type="application">CPAMonitor</ref>
+			</see-also>
+		</managerEventInstance>
+	</managerEvent>
+	<managerEvent language="en_US" name="CPATrunkStatus">
+		<managerEventInstance class="EVENT_FLAG_SYSTEM">
+			<synopsis>Raised when a trunk becomes degraded or recovers, see <literal>CPA_TRUNK_STATUS</literal>.</synopsis>
+			<syntax>
+				<parameter name="Trunk" />
+				<parameter name="Status">
+					<para><literal>OK</literal>, or the status dominating the trunk's calls.</para>
+				</parameter>
+				<parameter name="Calls">
+					<para>Calls analysed on the trunk within <literal>trunk_window</literal>.</para>
+				</parameter>
+				<parameter name="Percent">
+					<para>Share of them that returned the status.</para>
+				</parameter>
+			</syntax>
+			<see-also>
+				<ref type="function">CPA_TRUNK_STATUS</ref>
+			</see-also>
+		</managerEventInstance>
+	</managerEvent>
+	<managerEvent language="en_US" name="CPAHold">
+		<managerEventInstance class="EVENT_FLAG_CALL">
+			<synopsis>Raised when CPA in hold mode recognizes that the far end put the call on hold.</synopsis>
+			<syntax>
+				<parameter name="Channel" />
+				<parameter name="Uniqueid" />
+			</syntax>
+			<see-also>
+				<ref type="application">CPA</ref>
+			</see-also>
+		</managerEventInstance>
+	</managerEvent>
+	<managerEvent language="en_US" name="CPAHoldSpeech">
+		<managerEventInstance class="EVENT_FLAG_CALL">
+			<synopsis>Raised when speech interrupts the hold music, before it is known to be a human.</synopsis>
+			<syntax>
+				<parameter name="Channel" />
+				<parameter name="Uniqueid" />
+				<parameter name="HoldTime">
+					<para>ms since hold was recognized</para>
+				</parameter>
+			</syntax>
+		</managerEventInstance>
+	</managerEvent>
+	<managerEvent language="en_US" name="CPAHumanReturned">
+		<managerEventInstance class="EVENT_FLAG_CALL">
+			<synopsis>Raised when a human comes back on a call that was on hold.</synopsis>
+			<syntax>
+				<parameter name="Channel" />
+				<parameter name="Uniqueid" />
+				<parameter name="HoldTime">
+					<para>ms since hold was recognized</para>
+				</parameter>
+			</syntax>
+		</managerEventInstance>
+	</managerEvent>
  ***/
 
-static const char app[] = "CPA";
+static const char app[] = "CPA";
+static const char dial_app[] = "CPADial";
+static const char monitor_app[] = "CPAMonitor";
+
+/* Set to the lowest ms value provided in cpa.conf or application parameters */
+
+static int dfltMaxWaitTimeForFrame  = 50;
+static int dfltSilenceThreshold     = 100;
+static int dfltTotalAnalysisTime    = 1000;
+static int dfltDTMFWait				= 0;
+
+/*! Maximum number of shadow profiles evaluated alongside the active one */
+#define CPA_MAX_SHADOWS 4
+
+/*! Most candidate profiles CPA(,,,auto) chooses between */
+#define CPA_MAX_AUTO 4
+
+/*! Maximum number of tone zones a profile can evaluate in parallel */
+#define CPA_MAX_ZONES 5
+
+/*! \brief Verdicts reported back to the dialplan in CPASTATUS */
+enum cpa_result {
+	CPA_RESULT_NONE = 0,
+	CPA_RESULT_RINGING,
+	CPA_RESULT_BUSY,
+	CPA_RESULT_CONGESTION,
+	CPA_RESULT_TALKING,
+	CPA_RESULT_HUNGUP,
+	CPA_RESULT_SILENCE,
+	CPA_RESULT_TIMEOUT,
+	CPA_RESULT_NOFRAMES,
+	CPA_RESULT_FOUNDDTMF,
+	CPA_RESULT_HOLD,
+	CPA_RESULT_HUMANRETURNED,
+	CPA_RESULT_NOMEDIA,
+	CPA_RESULT_SCREENING,
+	CPA_RESULT_HUMAN,
+	CPA_RESULT_MACHINE,
+	CPA_RESULT_MAX,
+};
+
+static const char * const cpa_result_names[CPA_RESULT_MAX] = {
+	[CPA_RESULT_NONE] = "",
+	[CPA_RESULT_RINGING] = "Ringing",
+	[CPA_RESULT_BUSY] = "Busy",
+	[CPA_RESULT_CONGESTION] = "Congestion",
+	[CPA_RESULT_TALKING] = "Talking",
+	[CPA_RESULT_HUNGUP] = "Hungup",
+	[CPA_RESULT_SILENCE] = "Silence",
+	[CPA_RESULT_TIMEOUT] = "Timeout",
+	[CPA_RESULT_NOFRAMES] = "NoFrames",
+	[CPA_RESULT_FOUNDDTMF] = "FoundDTMF",
+	[CPA_RESULT_HOLD] = "Hold",
+	[CPA_RESULT_HUMANRETURNED] = "HumanReturned",
+	[CPA_RESULT_NOMEDIA] = "NoMedia",
+	[CPA_RESULT_SCREENING] = "Screening",
+	[CPA_RESULT_HUMAN] = "Human",
+	[CPA_RESULT_MACHINE] = "Machine",
+};
+
+enum cpa_option_flags {
+	OPT_HOLD = (1 << 0),
+	OPT_IMPAIR = (1 << 1),
+	OPT_RESUME = (1 << 2),
+	OPT_PROBE = (1 << 3),
+	OPT_EOG = (1 << 4),
+};
+
+enum cpa_option_args {
+	OPT_ARG_HOLD = 0,
+	OPT_ARG_IMPAIR,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(cpa_opts, BEGIN_OPTIONS
+	AST_APP_OPTION_ARG('H', OPT_HOLD, OPT_ARG_HOLD),
+	AST_APP_OPTION_ARG('I', OPT_IMPAIR, OPT_ARG_IMPAIR),
+	AST_APP_OPTION('R', OPT_RESUME),
+	AST_APP_OPTION('P', OPT_PROBE),
+	AST_APP_OPTION('E', OPT_EOG),
+END_OPTIONS);
+
+/*! Mean absolute sample value above which a frame counts as audio, from dsp.conf */
+static int cpaEnergyThreshold = 256;
+
+/*! Most frames in the envelope window used to tell speech from music */
+#define CPA_WINDOW_FRAMES 50
+
+/*! Length of the envelope window in ms */
+#define CPA_WINDOW_TIME 1000
+
+/*! A gap in the audio this long (ms) means the hold music was interrupted */
+#define CPA_HOLD_GAP 500
+
+/*! A screening assistant starts its prompt within this many ms of answering */
+#define CPA_SCREEN_ONSET 1500
+
+/*! A pause this long (ms) in the first burst of speech triggers the probe */
+#define CPA_PROBE_PAUSE 300
+
+/*! Nobody reacts to a sound faster than this (ms), speech sooner went on over the probe */
+#define CPA_PROBE_REACTION 250
+
+/*! Silence shorter than this (ms) is part of the burst, e.g. the break in a double ring */
+#define CPA_CADENCE_MERGE 300
+
+/*! Shortest and longest burst (ms) of a ringback cadence */
+#define CPA_CADENCE_MIN_ON 200
+#define CPA_CADENCE_MAX_ON 3000
+
+/*! Ringback period range (ms), burst start to burst start */
+#define CPA_CADENCE_MIN_PERIOD 1500
+#define CPA_CADENCE_MAX_PERIOD 8000
+
+/*! Least order 2 prediction gain (power ratio, 20dB) of a narrow band frame */
+#define CPA_CADENCE_GAIN 100
+
+/*! \brief How a shadow profile fared against the active one */
+struct cpa_shadow_stats {
+	int runs;		/*!< Sampled calls this profile was shadowed on */
+	int agree;		/*!< Same verdict as the active profile */
+	int disagree;		/*!< Different verdict than the active profile */
+	int undecided;		/*!< No verdict before the active profile finished */
+	int earlier;		/*!< Agreed and decided before the active profile */
+	int savedTime;		/*!< Total ms decided earlier on agreeing calls */
+};
+
+/*! \brief Tone detector a profile runs its zones on */
+enum cpa_engine {
+	CPA_ENGINE_DSP = 0,	/*!< ast_dsp, any zone from indications.conf */
+	CPA_ENGINE_NATIVE,	/*!< Built in tone bank for the North American plan, DSP for other zones */
+};
+
+/*! Mel bands of the keyword spotter's features */
+#define CPA_KWS_BANDS 16
+
+/*! Analysis window of the keyword spotter (samples), 32ms at 8kHz */
+#define CPA_KWS_WINDOW 256
+
+/*! Hop between feature frames (samples), 10ms at 8kHz */
+#define CPA_KWS_HOP 80
+
+/*! Most keywords per profile */
+#define CPA_KWS_MAX 8
+
+/*! Most template frames of all keywords of a profile, bounds the work per 10ms of a session */
+#define CPA_KWS_BUDGET 1000
+
+/*! \brief A phrase the keyword spotter listens for, quantized log mel frames */
+struct cpa_keyword {
+	char phrase[64];
+	int numFrames;
+	int8_t (*frames)[CPA_KWS_BANDS];
+};
+
+/*! \brief A named set of tone thresholds from cpa.conf */
+struct cpa_profile {
+	char name[AST_MAX_CONTEXT];
+	int silenceThreshold;	/*!< ms of silence before we report Silence, -1 follows [general] */
+	int threshRing;		/*!< All thresh values are in DSP blocks (us = 22ms) */
+	int threshTalk;
+	int threshBusy;
+	int threshCongestion;
+	int threshHangup;
+	char zones[CPA_MAX_ZONES][8];	/*!< Tone zones tried in parallel, none for the DSP default */
+	int numZones;
+	int holdMinTime;	/*!< ms of music before we call it hold */
+	int holdHumanSilence;	/*!< ms of silence after speech that says a human is waiting for us */
+	int holdMaxTime;	/*!< Seconds we are willing to wait on hold */
+	int holdDuty;		/*!< Analyse one in this many frames of steady music */
+	enum cpa_engine engine;
+	int decimate;		/*!< Native tone bank runs at 4kHz */
+	int screening;		/*!< Tell call screening assistants from humans, Talking waits for the first utterance */
+	int screenMinSpeech;	/*!< ms of speech a screening prompt lasts at least */
+	int screenWaitSilence;	/*!< ms of silence that ends an utterance */
+	int screenMaxVariation;	/*!< Most level variation (percent) of a synthetic voice */
+	int cadence;		/*!< Find ringback of any frequency by its cadence, Talking waits while it may be one */
+	char probeTone[64];	/*!< Indication played as the probe, see indications.conf */
+	int probeWindow;	/*!< ms after the probe we listen for the reaction */
+	int probeHumanBurst;	/*!< Longest first burst of speech (ms) a human answers with */
+	int eogMinSpeech;	/*!< ms of speech a greeting lasts at least */
+	int eogSilence;		/*!< ms of silence after the greeting before recording is assumed */
+	int eogMargin;		/*!< Level over the noise floor that counts as speech, in 1/256 */
+	int eogMaxWait;		/*!< ms we wait after the verdict for the greeting to end */
+	struct cpa_keyword keywords[CPA_KWS_MAX];	/*!< Phrases that mean Machine */
+	int numKeywords;
+	int keywordFrames;	/*!< Template frames of all keywords, at most CPA_KWS_BUDGET */
+	int keywordThreshold;	/*!< Mean distance (dB per band) a keyword matches within */
+	struct cpa_shadow_stats shadowStats;
+};
+
+/*! Most stages in one impairment chain */
+#define CPA_MAX_IMPAIRMENTS 8
+
+enum cpa_impairment_type {
+	CPA_IMPAIR_GAIN,	/*!< Level offset, value is the gain in 1/256 */
+	CPA_IMPAIR_NOISE,	/*!< White noise, value is its peak amplitude */
+	CPA_IMPAIR_LOSS,	/*!< Lost packets played out as silence, value is percent */
+	CPA_IMPAIR_CLIP,	/*!< Clipping, value is the largest sample magnitude */
+	CPA_IMPAIR_ULAW,	/*!< G.711 mu-law round trip */
+	CPA_IMPAIR_ALAW,	/*!< G.711 A-law round trip */
+};
+
+struct cpa_impairment_stage {
+	enum cpa_impairment_type type;
+	int value;
+	int burst;		/*!< Frames lost per loss event */
+};
+
+/*!
+ * \brief A chain of line impairments from a type=impairment section
+ *
+ * The stages run in the order they are listed in cpa.conf. With a non zero
+ * seed every call sees the same noise and loss pattern.
+ */
+struct cpa_impairment {
+	char name[AST_MAX_CONTEXT];
+	unsigned int seed;
+	int numStages;
+	struct cpa_impairment_stage stages[CPA_MAX_IMPAIRMENTS];
+};
+
+/*! \brief Settings swapped in as a whole on reload */
+struct cpa_config {
+	struct ao2_container *profiles;
+	struct ao2_container *impairments;
+	char shadowProfiles[CPA_MAX_SHADOWS][AST_MAX_CONTEXT];
+	int numShadowProfiles;
+	int shadowSamplePercent;	/*!< Percentage of calls that run the shadow profiles */
+	int learnPrefixLength;		/*!< Digits of the destination zones are learned for, 0 disables */
+	int learnMinHits;		/*!< Verdicts needed before only the learned zone is run */
+	char snapshotFile[PATH_MAX];	/*!< Learned state imported at load and exported at unload */
+	char featureFile[PATH_MAX];	/*!< Feature store every CPA() call is appended to, empty disables */
+	char recordDir[PATH_MAX];	/*!< Directory sampled sessions are recorded to, empty disables */
+	int recordSamplePercent;	/*!< Percentage of CPA() calls recorded */
+	int noMediaGrace;		/*!< ms without inbound RTP before we report NoMedia, 0 disables */
+	int maxBatchMs;			/*!< Most queued audio (ms) CPA() takes in one wakeup, 0 disables batching */
+	int monitorDuty;		/*!< CPAMonitor() analyses one frame in this many */
+	int monitorMusicTime;		/*!< ms of music before a participant is acted on */
+	int monitorToneTime;		/*!< ms of busy, reorder, dial tone or SIT */
+	int monitorHissTime;		/*!< ms of steady noise */
+	char autoProfiles[CPA_MAX_AUTO][AST_MAX_CONTEXT];	/*!< Candidates for profile auto, the first is the fallback */
+	int numAutoProfiles;
+	int autoMinAccuracy;		/*!< Percent of scored calls a candidate must get right */
+	int autoMinSamples;		/*!< Scored calls before a candidate's accuracy is trusted */
+	int autoExplorePercent;		/*!< Percentage of calls that try a random candidate */
+	unsigned int trunkFailures;	/*!< Verdicts (1 << enum cpa_result) that can degrade a trunk */
+	int trunkWindow;		/*!< Seconds of verdicts a trunk is judged on */
+	int trunkMinCalls;		/*!< Calls in the window before a trunk can be degraded, 0 disables */
+	int trunkDominance;		/*!< Percent of them one failure must make up */
+	char metricsFile[PATH_MAX];	/*!< Metrics rewritten here every metricsInterval, empty disables */
+	int metricsInterval;		/*!< Seconds between metrics_file rewrites */
+	int metricsHttp;		/*!< Serve the metrics at cpa/metrics on the built in HTTP server */
+};
+
+static AO2_GLOBAL_OBJ_STATIC(cpa_globals);
+
+/*! \brief Module wide counters, updated with ast_atomic_fetchadd_int() */
+static struct {
+	int calls;
+	int shadowCalls;
+	int results[CPA_RESULT_MAX];
+} cpaStats;
+
+/*! Finite buckets of a metrics histogram */
+#define CPA_HISTOGRAM_BUCKETS 10
+
+/*! \brief Histogram for the metrics, updated with atomic adds like cpaStats */
+struct cpa_histogram {
+	const char *name;
+	const char *help;
+	int bounds[CPA_HISTOGRAM_BUCKETS];	/*!< Bucket upper bounds, in units */
+	double unit;				/*!< Seconds per unit */
+	uint64_t counts[CPA_HISTOGRAM_BUCKETS + 1];	/*!< Per bucket, not cumulative, the last has no bound */
+	uint64_t sum;
+};
+
+/*! ms of audio analysed when the verdict was reached */
+static struct cpa_histogram cpaDecisionTime = {
+	"cpa_decision_seconds", "Audio analysed before the verdict was reached.",
+	{ 250, 500, 1000, 2000, 3000, 5000, 8000, 13000, 21000, 34000 }, 0.001,
+};
+
+/*! us spent analysing a frame, or a batch of them, of a live session */
+static struct cpa_histogram cpaFrameCost = {
+	"cpa_frame_seconds", "Time spent analysing one frame or batch of frames.",
+	{ 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 10000 }, 0.000001,
+};
+
+static void cpa_histogram_observe(struct cpa_histogram *histogram, int value)
+{
+	int i;
+
+	for (i = 0; i < CPA_HISTOGRAM_BUCKETS && value > histogram->bounds[i]; i++) {
+	}
+	__atomic_fetch_add(&histogram->counts[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, MAX(value, 0), __ATOMIC_RELAXED);
+}
+
+/*! \brief Count a verdict and when it was reached */
+static void cpa_stats_verdict(enum cpa_result result, int ms)
+{
+	ast_atomic_fetchadd_int(&cpaStats.calls, 1);
+	ast_atomic_fetchadd_int(&cpaStats.results[result], 1);
+	cpa_histogram_observe(&cpaDecisionTime, ms);
+}
+
+/*! \brief A shadow profile riding along on the active session */
+struct cpa_shadow {
+	struct cpa_profile *profile;
+	int threshSilence;
+	enum cpa_result result;
+	int resultTime;
+};
+
+/*!
+ * Samples per block of the native tone bank, ast_dsp's GSAMP_SIZE_NA
+ * (22.9ms at 8kHz), so tone counts and the profile thresholds mean the
+ * same as with the DSP
+ */
+#define CPA_TONEBANK_BLOCK 183
+
+/*! Length of the half-band filter in front of the decimated tone bank */
+#define CPA_HALFBAND_TAPS 7
+
+/*! \brief Tones of the North American plan, dial/ring/busy pairs and the SIT sequence */
+enum cpa_tonebank_tone {
+	CPA_HZ_350 = 0,
+	CPA_HZ_440,
+	CPA_HZ_480,
+	CPA_HZ_620,
+	CPA_HZ_950,
+	CPA_HZ_1400,
+	CPA_HZ_1800,
+	CPA_HZ_MAX,
+};
+
+/*!
+ * Tones below this one are decimated to 4kHz. The half-band filter passes
+ * 2200Hz at only 4dB under 1800Hz, and 2200Hz folds onto 1800Hz, so that
+ * bin stays at the full rate.
+ */
+#define CPA_HZ_DECIMATED CPA_HZ_1800
+
+/*!
+ * \brief Goertzel state of the native tone bank
+ *
+ * The frequencies, sample rate and block size are fixed so the inner loop
+ * has constant bounds and coefficients. Tone states and counts follow
+ * ast_dsp_get_tstate() and ast_dsp_get_tcount() so profiles work unchanged.
+ */
+struct cpa_tonebank {
+	float s1[CPA_HZ_MAX];
+	float s2[CPA_HZ_MAX];
+	float energy;
+	int pos;
+	int tstate;
+	int tcount;
+	int sit;		/*!< SIT tones heard so far in sequence, 0 to 3 */
+	int decimate;		/*!< Run the Goertzel filters at 4kHz behind a half-band filter */
+	int phase;		/*!< Input samples to skip before the next 4kHz output */
+	float history[CPA_HALFBAND_TAPS - 1];
+};
+
+/*! \brief Tone state of one zone hypothesis */
+struct cpa_zone {
+	struct ast_dsp *dsp;
+	int native;		/*!< Runs on bank instead of dsp */
+	struct cpa_tonebank bank;
+	char name[8];
+	int lastTone;
+	int tcount;
+	int repeated;		/*!< Tone state unchanged since the previous frame */
+	int rings;		/*!< Ring tone bursts heard so far */
+};
+
+/*! \brief Cheap per-frame level features shared by the envelope based detectors */
+struct cpa_envelope {
+	int energy;		/*!< Mean absolute sample value of the last frame */
+	int voiced;		/*!< Last frame was above the energy threshold */
+	int voicedRun;		/*!< ms of consecutive voiced audio */
+	int gapRun;		/*!< ms of consecutive unvoiced audio */
+	int lastGap;		/*!< ms of the gap that ended with the last voiced frame */
+	int window[CPA_WINDOW_FRAMES];
+	int windowFrames;
+	int windowTime;
+	int windowReady;	/*!< A window completed with this frame */
+	int speechLike;		/*!< Last window had the deep level dips of syllables */
+};
+
+enum cpa_hold_state {
+	CPA_HOLD_WAITING = 0,	/*!< Not on hold yet */
+	CPA_HOLD_MUSIC,		/*!< Music or announcements */
+	CPA_HOLD_SPEECH,	/*!< Speech after the music, announcement or human */
+};
+
+/*!
+ * \brief Features of the first utterance, used to spot screening assistants
+ *
+ * Synthetic prompts start right after answer, run for several seconds and
+ * come out of a level normalized voice, so the level of their voiced frames
+ * varies far less than a human's.
+ */
+struct cpa_screen {
+	int onset;		/*!< iTotalTime of the first voiced frame, -1 before it */
+	int voicedTime;		/*!< ms of voiced audio in the utterance */
+	int voicedFrames;
+	double levelSum;	/*!< Sum and sum of squares of the voiced frame levels */
+	double levelSquares;
+};
+
+/*!
+ * \brief Ringback found by its on/off cadence instead of its frequencies
+ *
+ * A burst is a run of narrow band frames, a tone of any frequency or a
+ * close pair of them. Two bursts of the same tone whose starts are a
+ * ringback period apart make Ringing.
+ */
+struct cpa_cadence {
+	int inBurst;
+	int onset;		/*!< iTotalTime the current burst started at */
+	int onTime;		/*!< ms of the current burst, short breaks included */
+	int offTime;		/*!< ms since the last narrow band frame */
+	int tonalFrames;
+	int otherRun;		/*!< Consecutive frames of audio that is not narrow band */
+	float freqSum;		/*!< Sum of the tonal frames' frequencies */
+	int lastOnset;		/*!< Start of the previous valid burst, -1 if none */
+	float lastFreq;
+	int rejected;		/*!< Heard audio no ringback makes, the cadence is not tried further */
+	int period;		/*!< Measured ringback period (ms) once found */
+};
+
+enum cpa_probe_state {
+	CPA_PROBE_LISTENING = 0,	/*!< Waiting for the first burst of speech to pause */
+	CPA_PROBE_PLAYING,		/*!< Probe sent, waiting for the reaction */
+};
+
+struct cpa_probe {
+	enum cpa_probe_state state;
+	int burst;		/*!< ms of voiced audio in the first burst */
+	int start;		/*!< iTotalTime the probe was started at */
+};
+
+/*!
+ * \brief End of a voicemail greeting that has no beep
+ *
+ * The greeting is a long monologue, recording starts once it is followed by
+ * eogSilence of silence. What counts as silence follows the line's own
+ * noise floor rather than the fixed energy threshold.
+ */
+struct cpa_eog {
+	int floor;		/*!< Noise floor, mean absolute sample value */
+	int speechTime;		/*!< ms of speech since the first word */
+	int silenceTime;	/*!< ms of silence since the last word */
+	int done;		/*!< Speech was followed by eogSilence */
+	int end;		/*!< iTotalTime the greeting ended, -1 if it was not a greeting */
+};
+
+/*! \brief Per block features of a session, recorded for the feature store */
+struct cpa_features {
+	int32_t *time;
+	int32_t *energy;
+	int32_t *tcount;
+	int8_t *tone;
+	uint8_t *repeated;
+	int num;
+	int max;
+};
+
+/*!
+ * \brief Streaming keyword spotter of a session
+ *
+ * One subsequence DTW column per keyword, laid out back to back in the
+ * order of the profile's keywords.
+ */
+struct cpa_kws {
+	int16_t window[CPA_KWS_WINDOW];
+	int fill;		/*!< Samples in window */
+	int frame;		/*!< Feature frames so far */
+	int32_t cost[CPA_KWS_BUDGET];	/*!< Distance along the best path ending at each template frame */
+	int16_t length[CPA_KWS_BUDGET];	/*!< Steps of that path */
+	int32_t begin[CPA_KWS_BUDGET];	/*!< Input frame that path started at */
+	float best[CPA_KWS_MAX];	/*!< Lowest mean distance (dB per band) of a whole keyword so far */
+};
+
+struct cpa_hold {
+	enum cpa_hold_state state;
+	int audioTime;		/*!< ms of audio since the last long gap */
+	int holdStart;		/*!< iTotalTime when hold was recognized */
+	int skip;		/*!< Frames left before the next analysed one */
+};
+
+/*! \brief State of one call progress analysis */
+struct cpa_session {
+	struct ast_channel *chan;
+	struct cpa_zone zones[CPA_MAX_ZONES];
+	int numZones;
+	int zone;		/*!< Zone that produced the verdict, -1 if none did */
+	struct cpa_profile *profile;
+	int threshSilence;
+	int totalAnalysisTime;
+	int iTotalTime;
+	int framelength;
+	enum cpa_result result;
+	enum cpa_result provisional;	/*!< Reported on Timeout, e.g. Silence */
+	int resultTime;			/*!< ms of audio analysed when result was reached */
+	int numShadows;
+	struct cpa_shadow shadows[CPA_MAX_SHADOWS];
+	char learnKey[32];	/*!< Destination prefix the zone is learned for */
+	int learnedZone;	/*!< Only the learned zone is being run */
+	struct cpa_impairment *impairment;	/*!< Applied to every frame before analysis */
+	unsigned int impairRand;
+	int impairLoss;		/*!< Frames left in the current loss burst */
+	int holdMode;		/*!< Wait on hold for a human instead of tone analysis */
+	struct cpa_hold hold;
+	struct cpa_envelope envelope;
+	struct cpa_screen screen;
+	int probeMode;		/*!< Play a probe after the first burst of speech and classify the reaction */
+	struct cpa_probe probe;
+	int eogMode;		/*!< Follow the greeting to its end after the verdict */
+	struct cpa_eog eog;
+	struct cpa_features *features;	/*!< Recorded for the feature store, NULL if it is off */
+	struct cpa_kws *kws;	/*!< Keyword spotter, NULL if the profile has no keywords */
+	int keyword;		/*!< Keyword that produced the verdict, -1 if none did */
+	int registrySlot;	/*!< Slot in the session registry plus one, 0 if not registered, -1 if it was full */
+	struct cpa_cadence cadence;
+};
+
+void cpa2str(char cpaString[256], int cpa);
+void tone2str(char toneString[256], int tone);
+
+static int cpa_profile_cmp(void *obj, void *arg, int flags)
+{
+	const struct cpa_profile *profile = obj;
+	const char *name = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		name = ((const struct cpa_profile *) arg)->name;
+		break;
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+
+	return strcasecmp(profile->name, name) ? 0 : CMP_MATCH;
+}
+
+static int cpa_impairment_cmp(void *obj, void *arg, int flags)
+{
+	const struct cpa_impairment *impairment = obj;
+	const char *name = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		name = ((const struct cpa_impairment *) arg)->name;
+		break;
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+
+	return strcasecmp(impairment->name, name) ? 0 : CMP_MATCH;
+}
+
+static void cpa_profile_destructor(void *obj)
+{
+	struct cpa_profile *profile = obj;
+	int i;
+
+	for (i = 0; i < profile->numKeywords; i++) {
+		ast_free(profile->keywords[i].frames);
+	}
+}
+
+static struct cpa_profile *cpa_profile_alloc(const char *name)
+{
+	struct cpa_profile *profile;
+
+	if (!(profile = ao2_alloc(sizeof(*profile), cpa_profile_destructor))) {
+		return NULL;
+	}
+
+	ast_copy_string(profile->name, name, sizeof(profile->name));
+	profile->silenceThreshold = -1;
+	profile->threshRing = 8;		/*!< Need at least 150ms ring to accept */
+	profile->threshTalk = 2;		/*!< Talk detection does not work continuously */
+	profile->threshBusy = 4;		/*!< Need at least 80ms to accept */
+	profile->threshCongestion = 4;	/*!< Need at least 80ms to accept */
+	profile->threshHangup = 60;		/*!< Need at least 1300ms to accept hangup */
+	profile->holdMinTime = 4000;
+	profile->holdHumanSilence = 800;
+	profile->holdMaxTime = 3600;
+	profile->holdDuty = 4;
+	profile->screenMinSpeech = 2500;
+	profile->screenWaitSilence = 1200;
+	profile->screenMaxVariation = 45;
+	ast_copy_string(profile->probeTone, "!1000/150", sizeof(profile->probeTone));
+	profile->probeWindow = 1000;
+	profile->probeHumanBurst = 1200;
+	profile->eogMinSpeech = 3000;
+	profile->keywordThreshold = 4;
+	profile->eogSilence = 1200;
+	profile->eogMargin = 256 * 2.8;		/*!< 9dB */
+	profile->eogMaxWait = 20000;
+
+	return profile;
+}
+
+static void cpa_config_destructor(void *obj)
+{
+	struct cpa_config *cfg = obj;
+
+	ao2_cleanup(cfg->profiles);
+	ao2_cleanup(cfg->impairments);
+}
+
+static struct cpa_config *cpa_config_alloc(void)
+{
+	struct cpa_config *cfg;
+
+	if (!(cfg = ao2_alloc(sizeof(*cfg), cpa_config_destructor))) {
+		return NULL;
+	}
+
+	if (!(cfg->profiles = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, cpa_profile_cmp))
+		|| !(cfg->impairments = ao2_container_alloc_list(AO2_ALLOC_OPT_LOCK_MUTEX, 0, NULL, cpa_impairment_cmp))) {
+		ao2_ref(cfg, -1);
+		return NULL;
+	}
+
+	cfg->learnPrefixLength = 6;
+	cfg->learnMinHits = 3;
+	cfg->maxBatchMs = 60;
+	cfg->autoMinAccuracy = 95;
+	cfg->autoMinSamples = 20;
+	cfg->autoExplorePercent = 5;
+	cfg->trunkFailures = (1 << CPA_RESULT_BUSY) | (1 << CPA_RESULT_CONGESTION) | (1 << CPA_RESULT_NOMEDIA)
+		| (1 << CPA_RESULT_NOFRAMES);
+	cfg->trunkWindow = 60;
+	cfg->trunkMinCalls = 10;
+	cfg->trunkDominance = 80;
+	cfg->monitorDuty = 4;
+	cfg->monitorMusicTime = 8000;
+	cfg->monitorToneTime = 2000;
+	cfg->monitorHissTime = 10000;
+	cfg->metricsInterval = 15;
+
+	return cfg;
+}
+
+/*! \brief Tone zone learned for a destination prefix */
+struct cpa_learned_dest {
+	char key[32];
+	char zone[8];
+	int hits;		/*!< Verdicts the zone produced, decremented on Timeout */
+	time_t updated;
+};
+
+/*! \brief Learned state, survives reloads and is shared through snapshots */
+static struct ao2_container *learned_dests;
+
+#define CPA_SNAPSHOT_MAGIC "CPASNAP"
+#define CPA_SNAPSHOT_VERSION 1
+
+/*! \brief Record types stored in a snapshot file */
+enum cpa_snapshot_record_type {
+	CPA_SNAPSHOT_DEST_ZONE = 1,
+};
+
+/*!
+ * \brief On disk snapshot header
+ *
+ * The header is followed by numRecords records of recordSize bytes, all in
+ * host byte order.
+ */
+struct cpa_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t numRecords;
+	uint32_t checksum;	/*!< CRC-32 of the records */
+};
+
+struct cpa_snapshot_record {
+	uint32_t type;
+	uint32_t hits;
+	int64_t updated;
+	char key[32];
+	char zone[8];
+};
+
+static int cpa_learned_dest_hash(const void *obj, int flags)
+{
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct cpa_learned_dest *) obj)->key;
+		break;
+	default:
+		return 0;
+	}
+
+	return ast_str_hash(key);
+}
+
+static int cpa_learned_dest_cmp(void *obj, void *arg, int flags)
+{
+	const struct cpa_learned_dest *dest = obj;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct cpa_learned_dest *) arg)->key;
+		break;
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+
+	return strcmp(dest->key, key) ? 0 : CMP_MATCH;
+}
+
+static uint32_t cpa_crc32(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t crc = 0xFFFFFFFF;
+	int bit;
+
+	while (len--) {
+		crc ^= *p++;
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+/*! \brief Build the learned state key for a destination number */
+static void cpa_learned_key(char *key, size_t size, const char *destination, int prefixLength)
+{
+	size_t len = strlen(destination);
+
+	if (prefixLength > 0 && len > (size_t) prefixLength) {
+		len = prefixLength;
+	}
+	if (len >= size) {
+		len = size - 1;
+	}
+	memcpy(key, destination, len);
+	key[len] = '\0';
+}
+
+/*!
+ * \brief Add evidence for a destination's tone zone
+ *
+ * A different zone replaces the learned one only once the old one has lost
+ * all its hits, so a single odd call cannot flip a well known destination.
+ *
+ * \param merge the hits come from a snapshot, keep whichever side saw more
+ */
+static void cpa_learn_zone(const char *key, const char *zone, int hits, time_t updated, int merge)
+{
+	struct cpa_learned_dest *dest;
+
+	if (!learned_dests || ast_strlen_zero(key) || ast_strlen_zero(zone)) {
+		return;
+	}
+
+	ao2_lock(learned_dests);
+	if (!(dest = ao2_find(learned_dests, key, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		if (hits <= 0 || !(dest = ao2_alloc(sizeof(*dest), NULL))) {
+			ao2_unlock(learned_dests);
+			return;
+		}
+		ast_copy_string(dest->key, key, sizeof(dest->key));
+		ast_copy_string(dest->zone, zone, sizeof(dest->zone));
+		ao2_link_flags(learned_dests, dest, OBJ_NOLOCK);
+	}
+	ao2_unlock(learned_dests);
+
+	ao2_lock(dest);
+	if (merge) {
+		if (!strcmp(dest->zone, zone) || hits > dest->hits) {
+			ast_copy_string(dest->zone, zone, sizeof(dest->zone));
+			dest->hits = MAX(dest->hits, hits);
+		}
+	} else if (!strcmp(dest->zone, zone)) {
+		dest->hits = MAX(dest->hits + hits, 0);
+	} else if (hits > 0 && --dest->hits <= 0) {
+		ast_copy_string(dest->zone, zone, sizeof(dest->zone));
+		dest->hits = hits;
+	}
+	if (updated > dest->updated) {
+		dest->updated = updated;
+	}
+	ao2_unlock(dest);
+
+	ao2_ref(dest, -1);
+}
+
+/*!
+ * \brief Look up the learned zone of a destination
+ *
+ * \retval 0 and zone filled in if the zone has at least minHits
+ * \retval -1 otherwise
+ */
+static int cpa_learned_zone(const char *key, int minHits, char *zone, size_t size)
+{
+	struct cpa_learned_dest *dest;
+	int res = -1;
+
+	if (!learned_dests || ast_strlen_zero(key) || !(dest = ao2_find(learned_dests, key, OBJ_SEARCH_KEY))) {
+		return -1;
+	}
+
+	ao2_lock(dest);
+	if (dest->hits >= minHits) {
+		ast_copy_string(zone, dest->zone, size);
+		res = 0;
+	}
+	ao2_unlock(dest);
+	ao2_ref(dest, -1);
+
+	return res;
+}
+
+/*!
+ * \brief Write the learned state to a snapshot file
+ *
+ * The snapshot is written next to the target and renamed into place so
+ * readers never see a partial file.
+ *
+ * \return number of records written, -1 on error
+ */
+static int cpa_snapshot_export(const char *filename)
+{
+	struct cpa_snapshot_header header = { CPA_SNAPSHOT_MAGIC, };
+	struct cpa_snapshot_record *records;
+	struct cpa_learned_dest *dest;
+	struct ao2_iterator i;
+	char tmpname[PATH_MAX];
+	int count = 0, max;
+	FILE *fp;
+
+	if (!learned_dests) {
+		return -1;
+	}
+
+	max = ao2_container_count(learned_dests);
+	if (!(records = ast_calloc(MAX(max, 1), sizeof(*records)))) {
+		return -1;
+	}
+
+	i = ao2_iterator_init(learned_dests, 0);
+	while ((dest = ao2_iterator_next(&i))) {
+		if (count < max) {
+			struct cpa_snapshot_record *record = &records[count++];
+
+			ao2_lock(dest);
+			record->type = CPA_SNAPSHOT_DEST_ZONE;
+			record->hits = dest->hits;
+			record->updated = dest->updated;
+			ast_copy_string(record->key, dest->key, sizeof(record->key));
+			ast_copy_string(record->zone, dest->zone, sizeof(record->zone));
+			ao2_unlock(dest);
+		}
+		ao2_ref(dest, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	header.version = CPA_SNAPSHOT_VERSION;
+	header.recordSize = sizeof(*records);
+	header.numRecords = count;
+	header.checksum = cpa_crc32(records, count * sizeof(*records));
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (!(fp = fopen(tmpname, "w"))) {
+		ast_log(LOG_WARNING, "CPA: Unable to write snapshot '%s': %s\n", tmpname, strerror(errno));
+		ast_free(records);
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, fp) != 1
+		|| (count && fwrite(records, sizeof(*records), count, fp) != (size_t) count)
+		|| fclose(fp)) {
+		ast_log(LOG_WARNING, "CPA: Unable to write snapshot '%s': %s\n", tmpname, strerror(errno));
+		unlink(tmpname);
+		ast_free(records);
+		return -1;
+	}
+	ast_free(records);
+
+	if (rename(tmpname, filename)) {
+		ast_log(LOG_WARNING, "CPA: Unable to move snapshot into place as '%s': %s\n", filename, strerror(errno));
+		unlink(tmpname);
+		return -1;
+	}
+
+	return count;
+}
+
+/*!
+ * \brief Merge a snapshot file into the learned state
+ *
+ * \return number of records merged, -1 if the file is missing or invalid
+ */
+static int cpa_snapshot_import(const char *filename)
+{
+	const struct cpa_snapshot_header *header;
+	const struct cpa_snapshot_record *records;
+	struct stat st;
+	void *map;
+	uint32_t n;
+	int fd, res = -1;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		ast_log(LOG_WARNING, "CPA: Unable to open snapshot '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*header)) {
+		ast_log(LOG_WARNING, "CPA: Snapshot '%s' is truncated\n", filename);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ast_log(LOG_WARNING, "CPA: Unable to map snapshot '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	header = map;
+	records = (const struct cpa_snapshot_record *) (header + 1);
+	if (memcmp(header->magic, CPA_SNAPSHOT_MAGIC, sizeof(header->magic))) {
+		ast_log(LOG_WARNING, "CPA: '%s' is not a CPA snapshot\n", filename);
+	} else if (header->version != CPA_SNAPSHOT_VERSION || header->recordSize != sizeof(*records)) {
+		ast_log(LOG_WARNING, "CPA: Snapshot '%s' has unsupported version %u\n", filename, header->version);
+	} else if (st.st_size != (off_t) (sizeof(*header) + (size_t) header->numRecords * sizeof(*records))) {
+		ast_log(LOG_WARNING, "CPA: Snapshot '%s' is truncated\n", filename);
+	} else if (cpa_crc32(records, header->numRecords * sizeof(*records)) != header->checksum) {
+		ast_log(LOG_WARNING, "CPA: Snapshot '%s' failed its checksum\n", filename);
+	} else {
+		for (n = 0, res = 0; n < header->numRecords; n++) {
+			char key[sizeof(records[n].key) + 1] = "";
+			char zone[sizeof(records[n].zone) + 1] = "";
+
+			if (records[n].type != CPA_SNAPSHOT_DEST_ZONE) {
+				continue;
+			}
+			memcpy(key, records[n].key, sizeof(records[n].key));
+			memcpy(zone, records[n].zone, sizeof(records[n].zone));
+			cpa_learn_zone(key, zone, records[n].hits, records[n].updated, 1);
+			res++;
+		}
+	}
+
+	munmap(map, st.st_size);
+
+	return res;
+}
+
+#define CPA_FEATURE_MAGIC "CPAFEAT"
+
+/*!
+ * Version of the features recorded per block. Bump it whenever a column
+ * is added or changes meaning, tools refuse stores of another schema.
+ */
+#define CPA_FEATURE_SCHEMA 1
+
+/*! \brief Feature store file header */
+struct cpa_feature_header {
+	char magic[8];
+	uint32_t schema;
+	uint32_t callSize;	/*!< sizeof(struct cpa_feature_call) */
+};
+
+/*!
+ * \brief One call in a feature store
+ *
+ * Followed by its columns, numBlocks entries each, in this order:
+ * int32 time (ms at the end of the block), int32 energy (mean absolute
+ * sample value), int32 tcount, int8 tone (DSP_TONE_STATE_*), uint8
+ * repeated. The call is padded to 8 bytes, size gives the offset of the
+ * next one. Tone features are those of the first zone the call ran.
+ */
+struct cpa_feature_call {
+	uint32_t size;		/*!< Bytes of the call including its columns */
+	uint32_t numBlocks;
+	int32_t resultTime;	/*!< ms of audio when the verdict was reached */
+	uint8_t result;		/*!< enum cpa_result of the profile that ran */
+	uint8_t label;		/*!< enum cpa_result from CPALABEL, CPA_RESULT_NONE if unlabeled */
+	uint8_t pad[2];
+	int64_t created;
+	char uniqueid[64];
+	char profile[32];
+	char zone[8];
+	char destination[32];
+};
+
+/*! \brief Column pointers into a mapped call */
+struct cpa_feature_columns {
+	const int32_t *time;
+	const int32_t *energy;
+	const int32_t *tcount;
+	const int8_t *tone;
+	const uint8_t *repeated;
+};
+
+/*! \brief Bytes a call with numBlocks blocks takes in the store */
+static size_t cpa_feature_call_size(uint32_t numBlocks)
+{
+	size_t size = sizeof(struct cpa_feature_call) + (size_t) numBlocks * (3 * sizeof(int32_t) + 2);
+
+	return (size + 7) & ~(size_t) 7;
+}
+
+/*! \brief Find the columns of a call, numBlocks must already fit in its size */
+static void cpa_feature_columns(const struct cpa_feature_call *call, struct cpa_feature_columns *columns)
+{
+	const char *data = (const char *) (call + 1);
+
+	columns->time = (const int32_t *) data;
+	columns->energy = columns->time + call->numBlocks;
+	columns->tcount = columns->energy + call->numBlocks;
+	columns->tone = (const int8_t *) (columns->tcount + call->numBlocks);
+	columns->repeated = (const uint8_t *) (columns->tone + call->numBlocks);
+}
+
+/*! Calls waiting for the feature writer before new ones are dropped */
+#define CPA_FEATURE_QUEUE 1000
+
+/*! \brief A finished call waiting for the feature writer */
+struct cpa_feature_row {
+	struct cpa_feature_row *next;
+	struct cpa_feature_call *call;	/*!< Followed by its columns, call->size bytes */
+	char filename[0];
+};
+
+/*! \brief Protects the feature queue */
+AST_MUTEX_DEFINE_STATIC(cpaFeatureLock);
+static ast_cond_t cpaFeatureCond;
+static pthread_t cpaFeatureThread = AST_PTHREADT_NULL;
+static int cpaFeatureStop;
+static struct cpa_feature_row *cpaFeatureHead;
+static struct cpa_feature_row **cpaFeatureTail = &cpaFeatureHead;
+static int cpaFeatureQueued;
+
+/*! \brief Append a call to the feature store, only the writer thread does */
+static void cpa_features_write(const char *filename, const struct cpa_feature_call *call)
+{
+	struct cpa_feature_header header = { CPA_FEATURE_MAGIC, };
+	struct stat st;
+	int fd;
+
+	header.schema = CPA_FEATURE_SCHEMA;
+	header.callSize = sizeof(*call);
+
+	if ((fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+		ast_log(LOG_WARNING, "CPA: Unable to open feature store '%s': %s\n", filename, strerror(errno));
+	} else if (fstat(fd, &st)) {
+		ast_log(LOG_WARNING, "CPA: Unable to stat feature store '%s': %s\n", filename, strerror(errno));
+	} else if (!st.st_size && write(fd, &header, sizeof(header)) != sizeof(header)) {
+		ast_log(LOG_WARNING, "CPA: Unable to write feature store '%s': %s\n", filename, strerror(errno));
+	} else if (st.st_size && (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+		|| memcmp(header.magic, CPA_FEATURE_MAGIC, sizeof(header.magic))
+		|| header.schema != CPA_FEATURE_SCHEMA || header.callSize != sizeof(*call))) {
+		ast_log(LOG_WARNING, "CPA: '%s' is not a feature store of schema %d, not appending\n", filename, CPA_FEATURE_SCHEMA);
+	} else if (write(fd, call, call->size) != (ssize_t) call->size) {
+		ast_log(LOG_WARNING, "CPA: Unable to write feature store '%s': %s\n", filename, strerror(errno));
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+/*! \brief Write queued calls as they come, on unload the ones still queued first */
+static void *cpa_features_run(void *data)
+{
+	struct cpa_feature_row *rows, *row;
+
+	ast_mutex_lock(&cpaFeatureLock);
+	for (;;) {
+		while (!cpaFeatureHead && !cpaFeatureStop) {
+			ast_cond_wait(&cpaFeatureCond, &cpaFeatureLock);
+		}
+		if (!cpaFeatureHead) {
+			break;
+		}
+		rows = cpaFeatureHead;
+		cpaFeatureHead = NULL;
+		cpaFeatureTail = &cpaFeatureHead;
+		cpaFeatureQueued = 0;
+		ast_mutex_unlock(&cpaFeatureLock);
+
+		while ((row = rows)) {
+			rows = row->next;
+			cpa_features_write(row->filename, row->call);
+			ast_free(row->call);
+			ast_free(row);
+		}
+
+		ast_mutex_lock(&cpaFeatureLock);
+	}
+	ast_mutex_unlock(&cpaFeatureLock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Queue a finished session for the feature store
+ *
+ * The file is written by the feature writer, started on the first call,
+ * so the channel thread only copies the columns.
+ *
+ * \retval 0 on success
+ * \retval -1 on error or if the queue is full
+ */
+static int cpa_features_append(const char *filename, const struct cpa_session *session, const char *uniqueid,
+	const char *label)
+{
+	const struct cpa_features *features = session->features;
+	struct cpa_feature_call *call;
+	struct cpa_feature_row *row;
+	size_t size = cpa_feature_call_size(features->num);
+	char *column;
+	int i;
+
+	if (!(call = ast_calloc(1, size))) {
+		return -1;
+	}
+	if (!(row = ast_calloc(1, sizeof(*row) + strlen(filename) + 1))) {
+		ast_free(call);
+		return -1;
+	}
+	strcpy(row->filename, filename); /* SAFE */
+	row->call = call;
+
+	call->size = size;
+	call->numBlocks = features->num;
+	call->resultTime = session->resultTime;
+	call->result = session->result;
+	call->label = CPA_RESULT_NONE;
+	for (i = CPA_RESULT_NONE + 1; !ast_strlen_zero(label) && i < CPA_RESULT_MAX; i++) {
+		if (!strcasecmp(cpa_result_names[i], label)) {
+			call->label = i;
+		}
+	}
+	call->created = time(NULL);
+	ast_copy_string(call->uniqueid, uniqueid, sizeof(call->uniqueid));
+	ast_copy_string(call->profile, session->profile->name, sizeof(call->profile));
+	if (session->numZones) {
+		ast_copy_string(call->zone, session->zones[0].name, sizeof(call->zone));
+	}
+	ast_copy_string(call->destination, session->learnKey, sizeof(call->destination));
+
+	column = (char *) (call + 1);
+	memcpy(column, features->time, features->num * sizeof(int32_t));
+	column += features->num * sizeof(int32_t);
+	memcpy(column, features->energy, features->num * sizeof(int32_t));
+	column += features->num * sizeof(int32_t);
+	memcpy(column, features->tcount, features->num * sizeof(int32_t));
+	column += features->num * sizeof(int32_t);
+	memcpy(column, features->tone, features->num);
+	column += features->num;
+	memcpy(column, features->repeated, features->num);
+
+	ast_mutex_lock(&cpaFeatureLock);
+	if (cpaFeatureQueued >= CPA_FEATURE_QUEUE) {
+		ast_log(LOG_WARNING, "CPA: %d calls waiting for feature store '%s', dropping [%s]\n",
+			cpaFeatureQueued, filename, uniqueid);
+	} else if (cpaFeatureThread == AST_PTHREADT_NULL
+		&& ast_pthread_create_background(&cpaFeatureThread, NULL, cpa_features_run, NULL)) {
+		cpaFeatureThread = AST_PTHREADT_NULL;
+		ast_log(LOG_WARNING, "CPA: Unable to start the feature writer, dropping [%s]\n", uniqueid);
+	} else {
+		*cpaFeatureTail = row;
+		cpaFeatureTail = &row->next;
+		cpaFeatureQueued++;
+		ast_cond_signal(&cpaFeatureCond);
+		row = NULL;
+	}
+	ast_mutex_unlock(&cpaFeatureLock);
+
+	if (row) {
+		ast_free(call);
+		ast_free(row);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! Verdicts waiting for a disposition before the old ones are pruned */
+#define CPA_MAX_PENDING 10000
+
+/*! Seconds a verdict waits for its disposition */
+#define CPA_PENDING_TTL 3600
+
+/*! Trunk/profile statistics kept, new trunks are not measured beyond it */
+#define CPA_MAX_ARMS 1000
+
+/*! Seconds without a call before a trunk/profile's statistics may be pruned */
+#define CPA_ARM_TTL 86400
+
+/*! \brief How one candidate profile has done on one trunk */
+struct cpa_arm {
+	char key[AST_MAX_CONTEXT * 2];	/*!< trunk/profile */
+	int calls;
+	int64_t totalTime;	/*!< ms to the verdict, summed over all calls */
+	int scored;		/*!< Calls that got a disposition */
+	int correct;		/*!< Scored calls whose verdict matched it */
+	time_t used;		/*!< Last call counted */
+};
+
+/*! \brief A verdict of an auto selected profile waiting for its disposition */
+struct cpa_pending {
+	char uniqueid[AST_MAX_UNIQUEID];
+	char arm[AST_MAX_CONTEXT * 2];
+	enum cpa_result result;
+	time_t created;
+};
+
+/*! \brief Per trunk profile statistics, survive reloads */
+static struct ao2_container *cpa_arms;
+
+/*! \brief Verdicts by uniqueid, until their disposition comes in */
+static struct ao2_container *cpa_pendings;
+
+static int cpa_arm_hash(const void *obj, int flags)
+{
+	const char *key;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		key = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct cpa_arm *) obj)->key;
+		break;
+	default:
+		return 0;
+	}
+
+	return ast_str_hash(key);
+}
+
+static int cpa_arm_cmp(void *obj, void *arg, int flags)
+{
+	const struct cpa_arm *arm = obj;
+	const char *key = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		key = ((const struct cpa_arm *) arg)->key;
+		break;
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+
+	return strcmp(arm->key, key) ? 0 : CMP_MATCH;
+}
+
+static int cpa_pending_hash(const void *obj, int flags)
+{
+	const char *uniqueid;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		uniqueid = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		uniqueid = ((const struct cpa_pending *) obj)->uniqueid;
+		break;
+	default:
+		return 0;
+	}
+
+	return ast_str_hash(uniqueid);
+}
+
+static int cpa_pending_cmp(void *obj, void *arg, int flags)
+{
+	const struct cpa_pending *pending = obj;
+	const char *uniqueid = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		uniqueid = ((const struct cpa_pending *) arg)->uniqueid;
+		break;
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+
+	return strcmp(pending->uniqueid, uniqueid) ? 0 : CMP_MATCH;
+}
+
+static int cpa_pending_expired(void *obj, void *arg, int flags)
+{
+	const struct cpa_pending *pending = obj;
+
+	return pending->created < *(const time_t *) arg ? CMP_MATCH : 0;
+}
+
+static int cpa_arm_expired(void *obj, void *arg, int flags)
+{
+	struct cpa_arm *arm = obj;
+	int expired;
+
+	ao2_lock(arm);
+	expired = arm->used < *(const time_t *) arg;
+	ao2_unlock(arm);
+
+	return expired ? CMP_MATCH : 0;
+}
+
+/*!
+ * \brief Find the statistics of a profile on a trunk, creating them if asked to
+ *
+ * Trunk names derived from Local or dynamic channels can be unbounded, so
+ * at CPA_MAX_ARMS the ones idle for CPA_ARM_TTL are pruned and, if that
+ * frees nothing, no new ones are created.
+ */
+static struct cpa_arm *cpa_arm_find(const char *trunk, const char *profile, int create)
+{
+	char key[AST_MAX_CONTEXT * 2];
+	struct cpa_arm *arm;
+	time_t now, expiry;
+
+	if (!cpa_arms) {
+		return NULL;
+	}
+
+	snprintf(key, sizeof(key), "%s/%s", trunk, profile);
+	ao2_lock(cpa_arms);
+	if (!(arm = ao2_find(cpa_arms, key, OBJ_SEARCH_KEY | OBJ_NOLOCK)) && create) {
+		now = time(NULL);
+		if (ao2_container_count(cpa_arms) >= CPA_MAX_ARMS) {
+			expiry = now - CPA_ARM_TTL;
+			ao2_callback(cpa_arms, OBJ_MULTIPLE | OBJ_NODATA | OBJ_UNLINK | OBJ_NOLOCK, cpa_arm_expired, &expiry);
+		}
+		if (ao2_container_count(cpa_arms) >= CPA_MAX_ARMS) {
+			ast_debug(1, "CPA: [%d] trunk/profile statistics, not measuring [%s]\n", CPA_MAX_ARMS, key);
+		} else if ((arm = ao2_alloc(sizeof(*arm), NULL))) {
+			ast_copy_string(arm->key, key, sizeof(arm->key));
+			arm->used = now;
+			ao2_link_flags(cpa_arms, arm, OBJ_NOLOCK);
+		}
+	}
+	ao2_unlock(cpa_arms);
+
+	return arm;
+}
+
+/*!
+ * \brief Name the trunk a channel was placed on
+ *
+ * CPATRUNK wins, otherwise the channel name without its unique suffix, so
+ * PJSIP/carrier1-0000002a is trunk PJSIP/carrier1.
+ */
+static void cpa_channel_trunk(struct ast_channel *chan, char *trunk, size_t size)
+{
+	const char *name;
+	char *dash;
+
+	ast_channel_lock(chan);
+	if ((name = pbx_builtin_getvar_helper(chan, "CPATRUNK")) && !ast_strlen_zero(name)) {
+		ast_copy_string(trunk, name, size);
+	} else {
+		ast_copy_string(trunk, ast_channel_name(chan), size);
+		if ((dash = strrchr(trunk, '-'))) {
+			*dash = '\0';
+		}
+	}
+	ast_channel_unlock(chan);
+}
+
+/*!
+ * \brief Choose the profile for a call on a trunk
+ *
+ * The fastest candidate whose accuracy on the trunk is at least
+ * autoMinAccuracy over autoMinSamples scored calls wins. On
+ * autoExplorePercent of the calls a random candidate runs instead, one
+ * still short of samples if there is any, so every candidate keeps being
+ * measured as carriers change. Until one qualifies, the first candidate
+ * runs.
+ */
+static void cpa_auto_select(const struct cpa_config *cfg, const char *trunk, char *profile, size_t size)
+{
+	int untried[CPA_MAX_AUTO];
+	int numUntried = 0, best = -1, i;
+	int64_t bestTime = 0;
+
+	for (i = 0; i < cfg->numAutoProfiles; i++) {
+		struct cpa_arm *arm = cpa_arm_find(trunk, cfg->autoProfiles[i], 0);
+		int calls = 0, scored = 0, correct = 0;
+		int64_t totalTime = 0;
+
+		if (arm) {
+			ao2_lock(arm);
+			calls = arm->calls;
+			scored = arm->scored;
+			correct = arm->correct;
+			totalTime = arm->totalTime;
+			ao2_unlock(arm);
+			ao2_ref(arm, -1);
+		}
+
+		if (scored < cfg->autoMinSamples) {
+			untried[numUntried++] = i;
+		} else if (calls > 0 && correct * 100 >= cfg->autoMinAccuracy * scored
+			&& (best < 0 || totalTime / calls < bestTime)) {
+			best = i;
+			bestTime = totalTime / calls;
+		}
+	}
+
+	if ((ast_random() % 100) < cfg->autoExplorePercent) {
+		best = numUntried ? untried[ast_random() % numUntried] : ast_random() % cfg->numAutoProfiles;
+	} else if (best < 0) {
+		best = 0;
+	}
+
+	ast_copy_string(profile, cfg->autoProfiles[best], size);
+}
+
+/*! \brief Count an auto selected call and keep its verdict for the disposition */
+static void cpa_auto_record(const char *trunk, const char *profile, const char *uniqueid,
+	enum cpa_result result, int ms)
+{
+	struct cpa_arm *arm;
+	struct cpa_pending *pending;
+	time_t expiry;
+
+	if (!(arm = cpa_arm_find(trunk, profile, 1))) {
+		return;
+	}
+	ao2_lock(arm);
+	arm->calls++;
+	arm->totalTime += ms;
+	arm->used = time(NULL);
+	ao2_unlock(arm);
+
+	if (cpa_pendings && (pending = ao2_alloc(sizeof(*pending), NULL))) {
+		ast_copy_string(pending->uniqueid, uniqueid, sizeof(pending->uniqueid));
+		ast_copy_string(pending->arm, arm->key, sizeof(pending->arm));
+		pending->result = result;
+		pending->created = time(NULL);
+
+		if (ao2_container_count(cpa_pendings) >= CPA_MAX_PENDING) {
+			/* Calls nobody reports on must not pile up */
+			expiry = pending->created - CPA_PENDING_TTL;
+			ao2_callback(cpa_pendings, OBJ_MULTIPLE | OBJ_NODATA | OBJ_UNLINK, cpa_pending_expired, &expiry);
+		}
+		ao2_link(cpa_pendings, pending);
+		ao2_ref(pending, -1);
+	}
+
+	ao2_ref(arm, -1);
+}
+
+/*!
+ * \brief Score the verdict of a call against what it really was
+ *
+ * Human and Talking both mean a person answered.
+ *
+ * \retval 0 on success
+ * \retval -1 if the disposition is not a status or the call is unknown
+ */
+static int cpa_auto_disposition(const char *uniqueid, const char *disposition)
+{
+	struct cpa_pending *pending;
+	struct cpa_arm *arm;
+	enum cpa_result result;
+	int correct;
+
+	for (result = CPA_RESULT_NONE + 1; result < CPA_RESULT_MAX; result++) {
+		if (!strcasecmp(cpa_result_names[result], disposition)) {
+			break;
+		}
+	}
+	if (result == CPA_RESULT_MAX || !cpa_pendings
+		|| !(pending = ao2_find(cpa_pendings, uniqueid, OBJ_SEARCH_KEY | OBJ_UNLINK))) {
+		return -1;
+	}
+
+	correct = pending->result == result
+		|| ((pending->result == CPA_RESULT_TALKING || pending->result == CPA_RESULT_HUMAN)
+			&& (result == CPA_RESULT_TALKING || result == CPA_RESULT_HUMAN));
+	if (cpa_arms && (arm = ao2_find(cpa_arms, pending->arm, OBJ_SEARCH_KEY))) {
+		ao2_lock(arm);
+		arm->scored++;
+		arm->correct += correct;
+		ao2_unlock(arm);
+		ao2_ref(arm, -1);
+	}
+	ast_debug(1, "CPA: Call [%s] on [%s] was [%s], verdict [%s] %s\n", uniqueid, pending->arm,
+		cpa_result_names[result], cpa_result_names[pending->result], correct ? "correct" : "wrong");
+	ao2_ref(pending, -1);
+
+	return 0;
+}
+
+static int cpa_disposition_write(struct ast_channel *chan, const char *cmd, char *data, const char *value)
+{
+	const char *uniqueid = data;
+
+	if (ast_strlen_zero(uniqueid)) {
+		if (!chan) {
+			ast_log(LOG_WARNING, "%s requires a uniqueid without a channel\n", cmd);
+			return -1;
+		}
+		uniqueid = ast_channel_uniqueid(chan);
+	}
+	if (cpa_auto_disposition(uniqueid, S_OR(value, ""))) {
+		ast_log(LOG_NOTICE, "%s: No auto selected verdict waiting for '%s', or '%s' is not a status\n",
+			cmd, uniqueid, S_OR(value, ""));
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct ast_custom_function cpa_disposition_function = {
+	.name = "CPA_DISPOSITION",
+	.write = cpa_disposition_write,
+};
+
+static int manager_cpa_disposition(struct mansession *s, const struct message *m)
+{
+	const char *uniqueid = astman_get_header(m, "UniqueID");
+	const char *disposition = astman_get_header(m, "Disposition");
+
+	if (ast_strlen_zero(uniqueid) || ast_strlen_zero(disposition)) {
+		astman_send_error(s, m, "UniqueID and Disposition are required");
+		return 0;
+	}
+	if (cpa_auto_disposition(uniqueid, disposition)) {
+		astman_send_error(s, m, "No verdict waiting for this call, or unknown disposition");
+		return 0;
+	}
+	astman_send_ack(s, m, "Disposition recorded");
+
+	return 0;
+}
+
+/*! Verdicts a trunk's health is judged on, the oldest is replaced first */
+#define CPA_TRUNK_HISTORY 64
+
+/*! \brief Recent verdicts on a trunk and whether one failure dominates them */
+struct cpa_trunk {
+	char name[AST_MAX_CONTEXT];
+	time_t times[CPA_TRUNK_HISTORY];
+	unsigned char results[CPA_TRUNK_HISTORY];
+	int next;		/*!< Slot the next verdict goes to */
+	int count;
+	enum cpa_result degraded;	/*!< Dominating failure, CPA_RESULT_NONE while healthy */
+	time_t since;		/*!< When degraded last changed */
+	int totals[CPA_RESULT_MAX];	/*!< Verdicts since load, updated atomically for the metrics */
+};
+
+/*! \brief Trunk health by trunk name, survives reloads */
+static struct ao2_container *cpa_trunks;
+
+static int cpa_trunk_hash(const void *obj, int flags)
+{
+	const char *name;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		name = obj;
+		break;
+	case OBJ_SEARCH_OBJECT:
+		name = ((const struct cpa_trunk *) obj)->name;
+		break;
+	default:
+		return 0;
+	}
+
+	return ast_str_hash(name);
+}
+
+static int cpa_trunk_cmp(void *obj, void *arg, int flags)
+{
+	const struct cpa_trunk *trunk = obj;
+	const char *name = arg;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_OBJECT:
+		name = ((const struct cpa_trunk *) arg)->name;
+		break;
+	case OBJ_SEARCH_KEY:
+		break;
+	default:
+		return 0;
+	}
+
+	return strcmp(trunk->name, name) ? 0 : CMP_MATCH;
+}
+
+/*!
+ * \brief Judge a trunk on the verdicts inside the window
+ *
+ * A trunk is degraded while one of the trunkFailures verdicts makes up at
+ * least trunkDominance percent of at least trunkMinCalls calls in the last
+ * trunkWindow seconds. Once the window holds too few calls it is healthy
+ * again, so a dialer that stopped using it tries it again.
+ *
+ * Raises CPATrunkStatus and updates the CPA:<trunk> device state when the
+ * state changes. Must be called with the trunk unlocked.
+ *
+ * \return the dominating failure, CPA_RESULT_NONE if the trunk is healthy
+ */
+static enum cpa_result cpa_trunk_assess(const struct cpa_config *cfg, struct cpa_trunk *trunk, time_t now)
+{
+	int counts[CPA_RESULT_MAX] = { 0, };
+	enum cpa_result dominant = CPA_RESULT_NONE, was;
+	int calls = 0, i;
+
+	ao2_lock(trunk);
+	for (i = 0; i < trunk->count; i++) {
+		if (now - trunk->times[i] < cfg->trunkWindow) {
+			counts[trunk->results[i]]++;
+			calls++;
+		}
+	}
+	for (i = CPA_RESULT_NONE + 1; i < CPA_RESULT_MAX; i++) {
+		if ((cfg->trunkFailures & (1 << i)) && counts[i] > counts[dominant]) {
+			dominant = i;
+		}
+	}
+	if (calls < cfg->trunkMinCalls || counts[dominant] * 100 < cfg->trunkDominance * calls) {
+		dominant = CPA_RESULT_NONE;
+	}
+	was = trunk->degraded;
+	if (dominant != was) {
+		trunk->degraded = dominant;
+		trunk->since = now;
+	}
+	ao2_unlock(trunk);
+
+	if (dominant == was) {
+		return dominant;
+	}
+
+	if (dominant != CPA_RESULT_NONE) {
+		ast_log(LOG_WARNING, "CPA: Trunk [%s] degraded, [%d] of [%d] calls in [%d]s returned [%s]\n",
+			trunk->name, counts[dominant], calls, cfg->trunkWindow, cpa_result_names[dominant]);
+	} else {
+		ast_log(LOG_NOTICE, "CPA: Trunk [%s] no longer degraded by [%s]\n", trunk->name, cpa_result_names[was]);
+	}
+	manager_event(EVENT_FLAG_SYSTEM, "CPATrunkStatus",
+		"Trunk: %s\r\n"
+		"Status: %s\r\n"
+		"Calls: %d\r\n"
+		"Percent: %d\r\n",
+		trunk->name, dominant != CPA_RESULT_NONE ? cpa_result_names[dominant] : "OK",
+		calls, calls ? 100 * counts[dominant] / calls : 0);
+	/* Not cached, the provider notices a window that emptied out */
+	ast_devstate_changed(dominant != CPA_RESULT_NONE ? AST_DEVICE_UNAVAILABLE : AST_DEVICE_NOT_INUSE,
+		AST_DEVSTATE_NOT_CACHABLE, "CPA:%s", trunk->name);
+
+	return dominant;
+}
+
+/*! \brief When the trunks were last pruned, claimed atomically by the channel that prunes */
+static time_t cpaTrunksPruned;
+
+/*!
+ * \brief ao2_callback() match for trunks without a call in trunk_window
+ *
+ * A degraded trunk is reported healthy before it goes, its window is empty.
+ */
+static int cpa_trunk_idle(void *obj, void *arg, int flags)
+{
+	struct cpa_trunk *trunk = obj;
+	const struct cpa_config *cfg = arg;
+	time_t now = time(NULL);
+	int idle;
+
+	ao2_lock(trunk);
+	idle = !trunk->count || now - trunk->times[(trunk->next + CPA_TRUNK_HISTORY - 1) % CPA_TRUNK_HISTORY] >= cfg->trunkWindow;
+	ao2_unlock(trunk);
+	if (!idle) {
+		return 0;
+	}
+	cpa_trunk_assess(cfg, trunk, now);
+
+	return CMP_MATCH;
+}
+
+/*! \brief Count a verdict against the trunk the channel was placed on */
+static void cpa_trunk_verdict(struct ast_channel *chan, enum cpa_result result)
+{
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	char name[AST_MAX_CONTEXT];
+	struct cpa_trunk *trunk;
+	time_t now = time(NULL), pruned;
+
+	if (!cfg || cfg->trunkMinCalls <= 0 || !cpa_trunks) {
+		return;
+	}
+	cpa_channel_trunk(chan, name, sizeof(name));
+
+	ao2_lock(cpa_trunks);
+	if (!(trunk = ao2_find(cpa_trunks, name, OBJ_SEARCH_KEY | OBJ_NOLOCK))
+		&& (trunk = ao2_alloc(sizeof(*trunk), NULL))) {
+		ast_copy_string(trunk->name, name, sizeof(trunk->name));
+		ao2_link_flags(cpa_trunks, trunk, OBJ_NOLOCK);
+	}
+	ao2_unlock(cpa_trunks);
+	if (!trunk) {
+		return;
+	}
+
+	ast_atomic_fetchadd_int(&trunk->totals[result], 1);
+
+	ao2_lock(trunk);
+	trunk->times[trunk->next] = now;
+	trunk->results[trunk->next] = result;
+	trunk->next = (trunk->next + 1) % CPA_TRUNK_HISTORY;
+	trunk->count = MIN(trunk->count + 1, CPA_TRUNK_HISTORY);
+	ao2_unlock(trunk);
+
+	cpa_trunk_assess(cfg, trunk, now);
+	ao2_ref(trunk, -1);
+
+	/* Trunk names come and go with dynamic peers, forget the quiet ones once a window */
+	pruned = __atomic_load_n(&cpaTrunksPruned, __ATOMIC_RELAXED);
+	if (now - pruned >= cfg->trunkWindow
+		&& __atomic_compare_exchange_n(&cpaTrunksPruned, &pruned, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		ao2_callback(cpa_trunks, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, cpa_trunk_idle, cfg);
+	}
+}
+
+/*! \brief Current health of a trunk, CPA_RESULT_NONE if healthy or never seen */
+static enum cpa_result cpa_trunk_status(const char *name)
+{
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	struct cpa_trunk *trunk;
+	enum cpa_result result;
+
+	if (!cfg || !cpa_trunks || !(trunk = ao2_find(cpa_trunks, name, OBJ_SEARCH_KEY))) {
+		return CPA_RESULT_NONE;
+	}
+	result = cpa_trunk_assess(cfg, trunk, time(NULL));
+	ao2_ref(trunk, -1);
+
+	return result;
+}
+
+static int cpa_trunk_status_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+	char name[AST_MAX_CONTEXT];
+	enum cpa_result result;
+
+	if (!ast_strlen_zero(data)) {
+		ast_copy_string(name, data, sizeof(name));
+	} else if (chan) {
+		cpa_channel_trunk(chan, name, sizeof(name));
+	} else {
+		ast_log(LOG_WARNING, "%s requires a trunk without a channel\n", cmd);
+		return -1;
+	}
+
+	result = cpa_trunk_status(name);
+	ast_copy_string(buf, result != CPA_RESULT_NONE ? cpa_result_names[result] : "OK", len);
+
+	return 0;
+}
+
+static struct ast_custom_function cpa_trunk_status_function = {
+	.name = "CPA_TRUNK_STATUS",
+	.read = cpa_trunk_status_read,
+};
+
+/*! \brief Device state of CPA:<trunk>, unavailable while the trunk is degraded */
+static enum ast_device_state cpa_trunk_devstate(const char *data)
+{
+	return cpa_trunk_status(data) != CPA_RESULT_NONE ? AST_DEVICE_UNAVAILABLE : AST_DEVICE_NOT_INUSE;
+}
+
+/*!
+ * \brief Check the tone state of the current block against a profile
+ *
+ * \return the verdict the profile reaches, CPA_RESULT_NONE if it needs more audio
+ */
+static enum cpa_result cpa_profile_evaluate(const struct cpa_profile *profile, int threshSilence, int toneState, int tcount)
+{
+	switch (toneState) {
+	case DSP_TONE_STATE_RINGING:
+		return tcount >= profile->threshRing ? CPA_RESULT_RINGING : CPA_RESULT_NONE;
+	case DSP_TONE_STATE_SILENCE:
+		return tcount > threshSilence ? CPA_RESULT_SILENCE : CPA_RESULT_NONE;
+	case DSP_TONE_STATE_BUSY:
+		return tcount >= profile->threshBusy ? CPA_RESULT_BUSY : CPA_RESULT_NONE;
+	case DSP_TONE_STATE_TALKING:
+		return tcount >= profile->threshTalk ? CPA_RESULT_TALKING : CPA_RESULT_NONE;
+	case DSP_TONE_STATE_SPECIAL3:
+		return tcount >= profile->threshCongestion ? CPA_RESULT_CONGESTION : CPA_RESULT_NONE;
+	case DSP_TONE_STATE_HUNGUP:
+		return tcount >= profile->threshHangup ? CPA_RESULT_HUNGUP : CPA_RESULT_NONE;
+	}
+
+	return CPA_RESULT_NONE;
+}
+
+/*!
+ * \brief Replay a stored call through a profile's thresholds
+ *
+ * Same decision as cpa_session_evaluate() on the first zone, without
+ * running the DSP again.
+ *
+ * \return the verdict, time is set to when it was reached
+ */
+static enum cpa_result cpa_features_replay(const struct cpa_profile *profile, int threshSilence,
+	const struct cpa_feature_call *call, const struct cpa_feature_columns *columns, int *time)
+{
+	enum cpa_result result, provisional = CPA_RESULT_NONE;
+	uint32_t n;
+
+	for (n = 0; n < call->numBlocks; n++) {
+		if (!columns->repeated[n]) {
+			continue;
+		}
+		result = cpa_profile_evaluate(profile, threshSilence, columns->tone[n], columns->tcount[n]);
+		if (result == CPA_RESULT_SILENCE) {
+			provisional = result;
+		} else if (result != CPA_RESULT_NONE) {
+			*time = columns->time[n];
+			return result;
+		}
+	}
+
+	*time = call->numBlocks ? columns->time[call->numBlocks - 1] : 0;
+
+	return provisional != CPA_RESULT_NONE ? provisional : CPA_RESULT_TIMEOUT;
+}
+
+/*! Goertzel coefficients, 2 * cos(2 * pi * f / 8000), in cpa_tonebank_tone order */
+static const float cpa_tonebank_coefs[CPA_HZ_MAX] = {
+	1.924910f,	/* 350 */
+	1.881762f,	/* 440 */
+	1.859553f,	/* 480 */
+	1.767531f,	/* 620 */
+	1.468645f,	/* 950 */
+	0.907981f,	/* 1400 */
+	0.312869f,	/* 1800 */
+};
+
+/*! Goertzel coefficients for the decimated tone bank, 2 * cos(2 * pi * f / 4000) */
+static const float cpa_tonebank_coefs4k[CPA_HZ_DECIMATED] = {
+	1.705280f,	/* 350 */
+	1.541026f,	/* 440 */
+	1.457937f,	/* 480 */
+	1.124167f,	/* 620 */
+	0.156918f,	/* 950 */
+	-1.175571f,	/* 1400 */
+};
+
+/*!
+ * Power correction for the roll off of the half-band filter at each tone,
+ * 1 / |H(f)|^2, so the 1400Hz SIT tone still passes the purity test.
+ */
+static const float cpa_tonebank_gains4k[CPA_HZ_DECIMATED] = {
+	1.0021f,	/* 350 */
+	1.0052f,	/* 440 */
+	1.0073f,	/* 480 */
+	1.0198f,	/* 620 */
+	1.1040f,	/* 950 */
+	1.4978f,	/* 1400 */
+};
+
+/*! Most a tone of a pair may be stronger than the other */
+#define CPA_TONEBANK_TWIST 10.0f
+
+/*!
+ * A tone pair must be this many times stronger than the other tones of the
+ * plan. A block only resolves 44Hz, so 440 and 480 leak into each other
+ * and the ast_dsp factor of 10 would reject real dial and busy tones.
+ */
+#define CPA_TONEBANK_REJECT 4.0f
+
+/*! Share of the block energy a tone pair or SIT tone must carry */
+#define CPA_TONEBANK_PURITY 0.5f
+
+/*! \brief Whether the native tone bank knows the tone plan of a zone */
+static int cpa_tonebank_supports(const char *zone)
+{
+	return ast_strlen_zero(zone) || !strcasecmp(zone, "us") || !strcasecmp(zone, "ca");
+}
+
+/*! \brief Minimum block energy of audio, derived from the dsp.conf silence threshold */
+static float cpa_tonebank_floor(void)
+{
+	return (float) cpaEnergyThreshold * cpaEnergyThreshold * CPA_TONEBANK_BLOCK;
+}
+
+/*! \brief Is p1 + p2 a clean tone pair next to the interfering tones i1 and i2 */
+static int cpa_tonebank_pair(float p1, float p2, float i1, float i2, float energy)
+{
+	float interference = MAX(i1, i2) * CPA_TONEBANK_REJECT;
+
+	if (p1 + p2 < cpa_tonebank_floor() || p1 + p2 < energy * CPA_TONEBANK_PURITY) {
+		return 0;
+	}
+
+	return p1 > interference && p2 > interference
+		&& MIN(p1, p2) * CPA_TONEBANK_TWIST > MAX(p1, p2);
+}
+
+/*! \brief Is p a clean single tone */
+static int cpa_tonebank_single(float p, float energy)
+{
+	return p >= cpa_tonebank_floor() && p >= energy * CPA_TONEBANK_PURITY;
+}
+
+/*! \brief Classify a completed block and update the tone state */
+static void cpa_tonebank_block(struct cpa_tonebank *bank)
+{
+	float hz[CPA_HZ_MAX];
+	int newstate;
+	int k;
+
+	for (k = 0; k < CPA_HZ_MAX; k++) {
+		/* Scaled so a pure tone's power equals the full rate block energy */
+		if (bank->decimate && k < CPA_HZ_DECIMATED) {
+			hz[k] = (bank->s1[k] * bank->s1[k] + bank->s2[k] * bank->s2[k]
+				- cpa_tonebank_coefs4k[k] * bank->s1[k] * bank->s2[k])
+				* (8.0f / CPA_TONEBANK_BLOCK) * cpa_tonebank_gains4k[k];
+		} else {
+			hz[k] = (bank->s1[k] * bank->s1[k] + bank->s2[k] * bank->s2[k]
+				- cpa_tonebank_coefs[k] * bank->s1[k] * bank->s2[k]) * (2.0f / CPA_TONEBANK_BLOCK);
+		}
+	}
+
+	if (cpa_tonebank_pair(hz[CPA_HZ_480], hz[CPA_HZ_620], hz[CPA_HZ_350], hz[CPA_HZ_440], bank->energy)) {
+		newstate = DSP_TONE_STATE_BUSY;
+	} else if (cpa_tonebank_pair(hz[CPA_HZ_440], hz[CPA_HZ_480], hz[CPA_HZ_350], hz[CPA_HZ_620], bank->energy)) {
+		newstate = DSP_TONE_STATE_RINGING;
+	} else if (cpa_tonebank_pair(hz[CPA_HZ_350], hz[CPA_HZ_440], hz[CPA_HZ_480], hz[CPA_HZ_620], bank->energy)) {
+		newstate = DSP_TONE_STATE_DIALTONE;
+	} else if (cpa_tonebank_single(hz[CPA_HZ_950], bank->energy)) {
+		newstate = DSP_TONE_STATE_SPECIAL1;
+	} else if (cpa_tonebank_single(hz[CPA_HZ_1400], bank->energy) && bank->sit >= 1) {
+		newstate = DSP_TONE_STATE_SPECIAL2;
+	} else if (cpa_tonebank_single(hz[CPA_HZ_1800], bank->energy) && bank->sit >= 2) {
+		newstate = DSP_TONE_STATE_SPECIAL3;
+	} else if (bank->energy >= cpa_tonebank_floor()) {
+		newstate = DSP_TONE_STATE_TALKING;
+	} else {
+		newstate = DSP_TONE_STATE_SILENCE;
+	}
+
+	/* The block that straddles a SIT tone change holds both tones, let one through */
+	if (newstate >= DSP_TONE_STATE_SPECIAL1 && newstate <= DSP_TONE_STATE_SPECIAL3) {
+		bank->sit = newstate - DSP_TONE_STATE_SPECIAL1 + 1;
+	} else if (newstate != DSP_TONE_STATE_TALKING || bank->tstate == DSP_TONE_STATE_TALKING) {
+		bank->sit = 0;
+	}
+
+	if (newstate == bank->tstate) {
+		bank->tcount++;
+	} else {
+		bank->tstate = newstate;
+		bank->tcount = 1;
+	}
+
+	memset(bank->s1, 0, sizeof(bank->s1));
+	memset(bank->s2, 0, sizeof(bank->s2));
+	bank->energy = 0;
+	bank->pos = 0;
+}
+
+/*!
+ * \brief Decimate to 4kHz and run the Goertzel filters on every other sample
+ *
+ * The half-band filter [-1 0 9 16 9 0 -1] / 32 costs three multiplies per
+ * output. The block energy and the 1800Hz filter still run at the full
+ * rate, so the talking and purity tests see the whole band and audio
+ * folded down from 2-2.4kHz cannot pose as the last SIT tone.
+ */
+static void cpa_tonebank_process_decimated(struct cpa_tonebank *bank, const int16_t *samples, int count)
+{
+	float buf[CPA_HALFBAND_TAPS - 1 + CPA_TONEBANK_BLOCK];
+	float s1[CPA_HZ_MAX], s2[CPA_HZ_MAX], s0;
+	float energy, x;
+	int len, i, k;
+
+	while (count > 0) {
+		len = MIN(count, CPA_TONEBANK_BLOCK - bank->pos);
+
+		memcpy(buf, bank->history, sizeof(bank->history));
+		memcpy(s1, bank->s1, sizeof(s1));
+		memcpy(s2, bank->s2, sizeof(s2));
+		energy = bank->energy;
+		for (i = 0; i < len; i++) {
+			x = buf[CPA_HALFBAND_TAPS - 1 + i] = samples[i];
+			energy += x * x;
+			s0 = x + cpa_tonebank_coefs[CPA_HZ_1800] * s1[CPA_HZ_1800] - s2[CPA_HZ_1800];
+			s2[CPA_HZ_1800] = s1[CPA_HZ_1800];
+			s1[CPA_HZ_1800] = s0;
+		}
+		bank->energy = energy;
+
+		for (i = bank->phase; i < len; i += 2) {
+			x = 0.5f * buf[i + 3] + 0.28125f * (buf[i + 2] + buf[i + 4]) - 0.03125f * (buf[i] + buf[i + 6]);
+			for (k = 0; k < CPA_HZ_DECIMATED; k++) {
+				s0 = x + cpa_tonebank_coefs4k[k] * s1[k] - s2[k];
+				s2[k] = s1[k];
+				s1[k] = s0;
+			}
+		}
+		memcpy(bank->s1, s1, sizeof(s1));
+		memcpy(bank->s2, s2, sizeof(s2));
+		bank->phase = i - len;
+		memcpy(bank->history, buf + len, sizeof(bank->history));
+
+		samples += len;
+		count -= len;
+		if ((bank->pos += len) == CPA_TONEBANK_BLOCK) {
+			cpa_tonebank_block(bank);
+		}
+	}
+}
+
+/*! \brief Run signed linear samples through the native tone bank */
+static void cpa_tonebank_process(struct cpa_tonebank *bank, const int16_t *samples, int count)
+{
+	float s1[CPA_HZ_MAX], s2[CPA_HZ_MAX], s0;
+	float energy, x;
+	int len, i, k;
+
+	if (bank->decimate) {
+		cpa_tonebank_process_decimated(bank, samples, count);
+		return;
+	}
+
+	while (count > 0) {
+		len = MIN(count, CPA_TONEBANK_BLOCK - bank->pos);
+
+		/* Work on locals so the compiler can keep the filters in registers */
+		memcpy(s1, bank->s1, sizeof(s1));
+		memcpy(s2, bank->s2, sizeof(s2));
+		energy = bank->energy;
+		for (i = 0; i < len; i++) {
+			x = samples[i];
+			energy += x * x;
+			for (k = 0; k < CPA_HZ_MAX; k++) {
+				s0 = x + cpa_tonebank_coefs[k] * s1[k] - s2[k];
+				s2[k] = s1[k];
+				s1[k] = s0;
+			}
+		}
+		memcpy(bank->s1, s1, sizeof(s1));
+		memcpy(bank->s2, s2, sizeof(s2));
+		bank->energy = energy;
+
+		samples += len;
+		count -= len;
+		if ((bank->pos += len) == CPA_TONEBANK_BLOCK) {
+			cpa_tonebank_block(bank);
+		}
+	}
+}
+
+/*! Cost of a template frame no path has reached yet */
+#define CPA_KWS_INF (1 << 24)
+
+/*! Template frames this far (dB) below the loudest one are trimmed from both ends */
+#define CPA_KWS_TRIM 30.0f
+
+static float cpaKwsHann[CPA_KWS_WINDOW];
+static float cpaKwsTwiddle[CPA_KWS_WINDOW / 2][2];
+static float cpaKwsMel[CPA_KWS_BANDS][CPA_KWS_WINDOW / 2 + 1];
+static int cpaKwsMelFirst[CPA_KWS_BANDS];
+static int cpaKwsMelLast[CPA_KWS_BANDS];
+
+static float cpa_kws_mel(float hz)
+{
+	return 2595.0f * log10f(1.0f + hz / 700.0f);
+}
+
+/*! \brief Window, FFT twiddles and a 200-3800Hz mel filter bank, built once at load */
+static void cpa_kws_tables_init(void)
+{
+	float lo = cpa_kws_mel(200.0f), hi = cpa_kws_mel(3800.0f);
+	float edges[CPA_KWS_BANDS + 2];
+	int b, k;
+
+	for (k = 0; k < CPA_KWS_WINDOW; k++) {
+		cpaKwsHann[k] = 0.5f - 0.5f * cosf(2.0f * M_PI * k / CPA_KWS_WINDOW);
+	}
+	for (k = 0; k < CPA_KWS_WINDOW / 2; k++) {
+		cpaKwsTwiddle[k][0] = cosf(-2.0f * M_PI * k / CPA_KWS_WINDOW);
+		cpaKwsTwiddle[k][1] = sinf(-2.0f * M_PI * k / CPA_KWS_WINDOW);
+	}
+
+	/* Band edges as FFT bins, evenly spaced on the mel scale */
+	for (b = 0; b < CPA_KWS_BANDS + 2; b++) {
+		float mel = lo + (hi - lo) * b / (CPA_KWS_BANDS + 1);
+
+		edges[b] = 700.0f * (powf(10.0f, mel / 2595.0f) - 1.0f) * CPA_KWS_WINDOW / 8000.0f;
+	}
+	memset(cpaKwsMel, 0, sizeof(cpaKwsMel));
+	for (b = 0; b < CPA_KWS_BANDS; b++) {
+		cpaKwsMelFirst[b] = ceilf(edges[b]);
+		cpaKwsMelLast[b] = MIN((int) floorf(edges[b + 2]), CPA_KWS_WINDOW / 2);
+		for (k = cpaKwsMelFirst[b]; k <= cpaKwsMelLast[b]; k++) {
+			cpaKwsMel[b][k] = k <= edges[b + 1]
+				? (k - edges[b]) / (edges[b + 1] - edges[b])
+				: (edges[b + 2] - k) / (edges[b + 2] - edges[b + 1]);
+		}
+	}
+}
+
+/*! \brief In place radix-2 FFT of one analysis window */
+static void cpa_kws_fft(float *re, float *im)
+{
+	int i, j, k, len, bit;
+
+	for (i = 1, j = 0; i < CPA_KWS_WINDOW; i++) {
+		for (bit = CPA_KWS_WINDOW >> 1; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if (i < j) {
+			float t = re[i];
+
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= CPA_KWS_WINDOW; len <<= 1) {
+		int half = len / 2, step = CPA_KWS_WINDOW / len;
+
+		for (i = 0; i < CPA_KWS_WINDOW; i += len) {
+			for (k = 0; k < half; k++) {
+				float wr = cpaKwsTwiddle[k * step][0], wi = cpaKwsTwiddle[k * step][1];
+				float xr = re[i + k + half] * wr - im[i + k + half] * wi;
+				float xi = re[i + k + half] * wi + im[i + k + half] * wr;
+
+				re[i + k + half] = re[i + k] - xr;
+				im[i + k + half] = im[i + k] - xi;
+				re[i + k] += xr;
+				im[i + k] += xi;
+			}
+		}
+	}
+}
+
+/*!
+ * \brief Log mel features of one analysis window
+ *
+ * Band levels are in dB relative to the window's mean band level, rounded
+ * to int8, so a quieter line still matches the same template.
+ *
+ * \return the mean band level in dB
+ */
+static float cpa_kws_features(const int16_t *samples, int8_t *features)
+{
+	float re[CPA_KWS_WINDOW], im[CPA_KWS_WINDOW], power[CPA_KWS_WINDOW / 2 + 1], level[CPA_KWS_BANDS];
+	float mean = 0.0f;
+	int b, k;
+
+	for (k = 0; k < CPA_KWS_WINDOW; k++) {
+		re[k] = samples[k] * cpaKwsHann[k];
+		im[k] = 0.0f;
+	}
+	cpa_kws_fft(re, im);
+	for (k = 0; k <= CPA_KWS_WINDOW / 2; k++) {
+		power[k] = re[k] * re[k] + im[k] * im[k];
+	}
+
+	for (b = 0; b < CPA_KWS_BANDS; b++) {
+		float energy = 1.0f;
+
+		for (k = cpaKwsMelFirst[b]; k <= cpaKwsMelLast[b]; k++) {
+			energy += cpaKwsMel[b][k] * power[k];
+		}
+		level[b] = 10.0f * log10f(energy);
+		mean += level[b];
+	}
+	mean /= CPA_KWS_BANDS;
+
+	for (b = 0; b < CPA_KWS_BANDS; b++) {
+		features[b] = MAX(MIN(lrintf(level[b] - mean), 127), -127);
+	}
+
+	return mean;
+}
+
+/*! \brief L1 distance of two feature frames, dB summed over the bands */
+static int cpa_kws_distance(const int8_t *a, const int8_t *b)
+{
+	int sum = 0, i;
+
+	/* Constant bounds, compilers turn this into a few vector instructions */
+	for (i = 0; i < CPA_KWS_BANDS; i++) {
+		sum += abs(a[i] - b[i]);
+	}
+
+	return sum;
+}
+
+/*!
+ * \brief Advance the subsequence DTW of one keyword by a feature frame
+ *
+ * cost, length and begin describe the best path ending at each template
+ * frame. A path may start at any input frame and each input frame moves it
+ * on by none, one or two template frames, so a keyword can be said up to
+ * twice as fast. Paths compare on their mean distance, and a match has to
+ * span no more than twice the keyword's length.
+ *
+ * \retval 1 if the whole keyword matched within threshold (dB per band)
+ * \retval 0 otherwise
+ */
+static int cpa_kws_step(const struct cpa_keyword *keyword, int threshold, int frame, const int8_t *features,
+	int32_t *cost, int16_t *length, int32_t *begin, float *best)
+{
+	int32_t prevCost = CPA_KWS_INF, prevBegin = frame, skipCost = CPA_KWS_INF, skipBegin = frame;
+	int16_t prevLength = 1, skipLength = 1;
+	int last = keyword->numFrames - 1;
+	int span, j;
+
+	for (j = 0; j <= last; j++) {
+		int32_t oldCost = cost[j], oldBegin = begin[j];
+		int16_t oldLength = length[j];
+		int32_t c = 0, b = frame;
+		int16_t l = 0;
+
+		if (j) {
+			/* Diagonal, staying on this template frame, or skipping one */
+			c = prevCost;
+			l = prevLength;
+			b = prevBegin;
+			if ((int64_t) oldCost * l < (int64_t) c * oldLength) {
+				c = oldCost;
+				l = oldLength;
+				b = oldBegin;
+			}
+			if ((int64_t) skipCost * l < (int64_t) c * skipLength) {
+				c = skipCost;
+				l = skipLength;
+				b = skipBegin;
+			}
+		}
+		cost[j] = MIN(c + cpa_kws_distance(features, keyword->frames[j]), CPA_KWS_INF);
+		length[j] = MIN(l + 1, 32767);
+		begin[j] = b;
+
+		skipCost = prevCost;
+		skipLength = prevLength;
+		skipBegin = prevBegin;
+		prevCost = oldCost;
+		prevLength = oldLength;
+		prevBegin = oldBegin;
+	}
+
+	span = frame - begin[last] + 1;
+	if (cost[last] >= CPA_KWS_INF || span > 2 * (last + 1)) {
+		return 0;
+	}
+	*best = MIN(*best, (float) cost[last] / length[last] / CPA_KWS_BANDS);
+
+	return cost[last] <= threshold * CPA_KWS_BANDS * length[last];
+}
+
+/*! \brief Forget every partial match */
+static void cpa_kws_reset(struct cpa_kws *kws)
+{
+	int i;
+
+	for (i = 0; i < CPA_KWS_BUDGET; i++) {
+		kws->cost[i] = CPA_KWS_INF;
+		kws->length[i] = 1;
+		kws->begin[i] = 0;
+	}
+	for (i = 0; i < CPA_KWS_MAX; i++) {
+		kws->best[i] = CPA_KWS_INF;
+	}
+}
+
+/*!
+ * \brief Run samples through the keyword spotter of a profile
+ *
+ * Every 10ms costs the same whatever is said: one FFT and at most
+ * CPA_KWS_BUDGET template frame distances.
+ *
+ * \return index of the keyword heard, -1 if none
+ */
+static int cpa_kws_process(struct cpa_kws *kws, const struct cpa_profile *profile, const int16_t *samples, int count)
+{
+	int8_t features[CPA_KWS_BANDS];
+	int n, i, offset;
+
+	while (count > 0) {
+		n = MIN(count, CPA_KWS_WINDOW - kws->fill);
+		memcpy(kws->window + kws->fill, samples, n * sizeof(*samples));
+		kws->fill += n;
+		samples += n;
+		count -= n;
+		if (kws->fill < CPA_KWS_WINDOW) {
+			break;
+		}
+
+		cpa_kws_features(kws->window, features);
+		memmove(kws->window, kws->window + CPA_KWS_HOP, (CPA_KWS_WINDOW - CPA_KWS_HOP) * sizeof(*kws->window));
+		kws->fill = CPA_KWS_WINDOW - CPA_KWS_HOP;
+		kws->frame++;
+
+		for (i = 0, offset = 0; i < profile->numKeywords; offset += profile->keywords[i++].numFrames) {
+			if (cpa_kws_step(&profile->keywords[i], profile->keywordThreshold, kws->frame, features,
+				kws->cost + offset, kws->length + offset, kws->begin + offset, &kws->best[i])) {
+				return i;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/*!
+ * \brief Build a keyword template from a recording of the phrase
+ *
+ * The recording is raw 8kHz signed linear (.sln), relative paths are under
+ * the cpa directory of astdatadir. Frames CPA_KWS_TRIM below the loudest
+ * one are trimmed from both ends.
+ *
+ * \retval 0 on success
+ * \retval -1 if the file cannot be read, holds no speech or is longer than maxFrames
+ */
+static int cpa_keyword_load(struct cpa_keyword *keyword, const char *phrase, const char *file, int maxFrames)
+{
+	char path[PATH_MAX];
+	int16_t *samples = NULL;
+	int8_t (*frames)[CPA_KWS_BANDS] = NULL;
+	float *levels = NULL;
+	float peak = -1000.0f;
+	int count, numFrames, first, last, i;
+	struct stat st;
+	FILE *fp;
+
+	if (*file == '/') {
+		ast_copy_string(path, file, sizeof(path));
+	} else {
+		snprintf(path, sizeof(path), "%s/cpa/%s", ast_config_AST_DATA_DIR, file);
+	}
+
+	if (!(fp = fopen(path, "r"))) {
+		ast_log(LOG_WARNING, "CPA: Unable to open keyword recording '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fileno(fp), &st) || (size_t) st.st_size < CPA_KWS_WINDOW * sizeof(*samples)
+		|| !(samples = ast_malloc(st.st_size))
+		|| fread(samples, 1, st.st_size, fp) != (size_t) st.st_size) {
+		ast_log(LOG_WARNING, "CPA: Unable to read keyword recording '%s'\n", path);
+		fclose(fp);
+		ast_free(samples);
+		return -1;
+	}
+	fclose(fp);
+
+	count = st.st_size / sizeof(*samples);
+	numFrames = (count - CPA_KWS_WINDOW) / CPA_KWS_HOP + 1;
+	if (!(frames = ast_malloc(numFrames * sizeof(*frames))) || !(levels = ast_malloc(numFrames * sizeof(*levels)))) {
+		ast_free(samples);
+		ast_free(frames);
+		return -1;
+	}
+	for (i = 0; i < numFrames; i++) {
+		levels[i] = cpa_kws_features(samples + i * CPA_KWS_HOP, frames[i]);
+		peak = MAX(peak, levels[i]);
+	}
+	ast_free(samples);
+
+	for (first = 0; first < numFrames && levels[first] < peak - CPA_KWS_TRIM; first++) {
+	}
+	for (last = numFrames - 1; last > first && levels[last] < peak - CPA_KWS_TRIM; last--) {
+	}
+	ast_free(levels);
+
+	if (last - first + 1 < 10 || last - first + 1 > maxFrames) {
+		ast_log(LOG_WARNING, "CPA: Keyword '%s' from '%s' has %d frames of speech, between 10 and %d fit\n",
+			phrase, path, last - first + 1, maxFrames);
+		ast_free(frames);
+		return -1;
+	}
+
+	memmove(frames, frames + first, (last - first + 1) * sizeof(*frames));
+	ast_copy_string(keyword->phrase, phrase, sizeof(keyword->phrase));
+	keyword->numFrames = last - first + 1;
+	keyword->frames = frames;
+
+	return 0;
+}
+
+/*! \brief Start recording per block features on a session */
+static int cpa_session_features_alloc(struct cpa_session *session)
+{
+	if (!session->features) {
+		session->features = ast_calloc(1, sizeof(*session->features));
+	}
+
+	return session->features ? 0 : -1;
+}
+
+static void cpa_session_features_free(struct cpa_session *session)
+{
+	struct cpa_features *features = session->features;
+
+	if (!features) {
+		return;
+	}
+	ast_free(features->time);
+	ast_free(features->energy);
+	ast_free(features->tcount);
+	ast_free(features->tone);
+	ast_free(features->repeated);
+	ast_free(features);
+	session->features = NULL;
+}
+
+/*!
+ * \brief Record the features of the block just analysed
+ *
+ * The columns grow together, a failed allocation stops the recording
+ * rather than the analysis.
+ */
+static void cpa_session_features_add(struct cpa_session *session, int energy)
+{
+	struct cpa_features *features = session->features;
+	const struct cpa_zone *z = &session->zones[0];
+
+	if (features->num == features->max) {
+		int max = features->max ? features->max * 2 : 256;
+		int32_t *time = ast_realloc(features->time, max * sizeof(*time));
+		int32_t *energies = time ? ast_realloc(features->energy, max * sizeof(*energies)) : NULL;
+		int32_t *tcount = energies ? ast_realloc(features->tcount, max * sizeof(*tcount)) : NULL;
+		int8_t *tone = tcount ? ast_realloc(features->tone, max) : NULL;
+		uint8_t *repeated = tone ? ast_realloc(features->repeated, max) : NULL;
+
+		/* Whatever was reallocated replaces the old pointer, even on failure */
+		features->time = time ? time : features->time;
+		features->energy = energies ? energies : features->energy;
+		features->tcount = tcount ? tcount : features->tcount;
+		features->tone = tone ? tone : features->tone;
+		features->repeated = repeated ? repeated : features->repeated;
+		if (!repeated) {
+			cpa_session_features_free(session);
+			return;
+		}
+		features->max = max;
+	}
+
+	features->time[features->num] = session->iTotalTime;
+	features->energy[features->num] = energy;
+	features->tcount[features->num] = z->tcount;
+	features->tone[features->num] = z->lastTone;
+	features->repeated[features->num] = z->repeated;
+	features->num++;
+}
+
+/*! Sessions the registry can list at once, later ones run unlisted */
+#define CPA_REGISTRY_SLOTS 1024
+
+/*!
+ * \brief A session's entry in the registry
+ *
+ * The identity is written once when the slot is claimed and guarded by seq,
+ * which is odd while the slot is being claimed or released. The live state is
+ * a single word the session thread stores after every change, so readers
+ * never take a lock and never stall a channel thread.
+ */
+struct cpa_registry_slot {
+	int used;		/*!< 0 free, 1 being claimed, 2 listed */
+	unsigned int seq;
+	char channel[AST_CHANNEL_NAME];
+	char uniqueid[AST_MAX_UNIQUEID];
+	char profile[AST_MAX_CONTEXT];
+	struct timeval start;
+	uint64_t state;		/*!< See cpa_registry_pack() */
+};
+
+/*! \brief A consistent copy of a registry slot */
+struct cpa_registry_entry {
+	char channel[AST_CHANNEL_NAME];
+	char uniqueid[AST_MAX_UNIQUEID];
+	char profile[AST_MAX_CONTEXT];
+	struct timeval start;
+	enum cpa_result result;
+	enum cpa_result provisional;
+	int rings;
+	int analysed;		/*!< ms of audio analysed */
+};
+
+static struct cpa_registry_slot cpaRegistry[CPA_REGISTRY_SLOTS];
+
+/*! Slot the next claim starts looking at, spreads claims over the table */
+static unsigned int cpaRegistryHint;
+
+/*! \brief Pack a session's live state, ms analysed in the top half, then rings, provisional and result */
+static uint64_t cpa_registry_pack(const struct cpa_session *session)
+{
+	int rings = 0, i;
+
+	/* Zones hear the same rings, the one that heard most is nearest the truth */
+	for (i = 0; i < session->numZones; i++) {
+		rings = MAX(rings, session->zones[i].rings);
+	}
+
+	return ((uint64_t) (uint32_t) session->iTotalTime << 32) | ((uint64_t) MIN(rings, 0xFFFF) << 16)
+		| ((uint64_t) (session->provisional & 0xFF) << 8) | (session->result & 0xFF);
+}
+
+/*! \brief Store a registered session's live state */
+static void cpa_registry_publish(struct cpa_session *session)
+{
+	if (session->registrySlot > 0) {
+		__atomic_store_n(&cpaRegistry[session->registrySlot - 1].state, cpa_registry_pack(session), __ATOMIC_RELEASE);
+	}
+}
+
+/*! \brief Claim a registry slot for a session that has a channel */
+static void cpa_registry_add(struct cpa_session *session)
+{
+	unsigned int first = ast_atomic_fetchadd_int((int *) &cpaRegistryHint, 1);
+	int n;
+
+	for (n = 0; n < CPA_REGISTRY_SLOTS; n++) {
+		struct cpa_registry_slot *slot = &cpaRegistry[(first + n) % CPA_REGISTRY_SLOTS];
+
+		if (__atomic_load_n(&slot->used, __ATOMIC_RELAXED)
+			|| !__sync_bool_compare_and_swap(&slot->used, 0, 1)) {
+			continue;
+		}
+		/* Odd while the identity is written, readers skip the slot */
+		__atomic_add_fetch(&slot->seq, 1, __ATOMIC_ACQ_REL);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		ast_copy_string(slot->channel, ast_channel_name(session->chan), sizeof(slot->channel));
+		ast_copy_string(slot->uniqueid, ast_channel_uniqueid(session->chan), sizeof(slot->uniqueid));
+		ast_copy_string(slot->profile, session->profile->name, sizeof(slot->profile));
+		slot->start = ast_tvnow();
+		slot->state = cpa_registry_pack(session);
+		/* Even again, the slot is readable */
+		__atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&slot->used, 2, __ATOMIC_RELEASE);
+		session->registrySlot = (slot - cpaRegistry) + 1;
+		return;
+	}
+
+	/* Tried once per analysis, a full registry is not scanned again on every frame */
+	session->registrySlot = -1;
+	ast_debug(1, "CPA: Session registry full, [%s] is not listed\n", ast_channel_name(session->chan));
+}
+
+/*! \brief Give a session's registry slot back */
+static void cpa_registry_remove(struct cpa_session *session)
+{
+	struct cpa_registry_slot *slot;
+
+	if (session->registrySlot <= 0) {
+		session->registrySlot = 0;
+		return;
+	}
+	slot = &cpaRegistry[session->registrySlot - 1];
+	session->registrySlot = 0;
+
+	/* Odd while the slot is given back, so a reader that copied the old identity throws it away */
+	__atomic_add_fetch(&slot->seq, 1, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&slot->used, 0, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * \brief Copy every registered session
+ *
+ * A slot that is claimed or released while it is being copied is read
+ * again, or left out if it keeps changing. Never blocks the sessions.
+ *
+ * \param entries Filled with up to max entries
+ * \return number of entries filled in
+ */
+static int cpa_registry_snapshot(struct cpa_registry_entry *entries, int max)
+{
+	int count = 0, n, tries;
+
+	for (n = 0; n < CPA_REGISTRY_SLOTS && count < max; n++) {
+		struct cpa_registry_slot *slot = &cpaRegistry[n];
+		struct cpa_registry_entry *entry = &entries[count];
+
+		if (__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE) != 2) {
+			continue;
+		}
+		for (tries = 0; tries < 3; tries++) {
+			unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			uint64_t state;
+
+			if (seq & 1) {
+				continue;
+			}
+			if (__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE) != 2) {
+				break;
+			}
+			memcpy(entry->channel, slot->channel, sizeof(entry->channel));
+			memcpy(entry->uniqueid, slot->uniqueid, sizeof(entry->uniqueid));
+			memcpy(entry->profile, slot->profile, sizeof(entry->profile));
+			entry->start = slot->start;
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+				continue;
+			}
+			entry->channel[sizeof(entry->channel) - 1] = '\0';
+			entry->uniqueid[sizeof(entry->uniqueid) - 1] = '\0';
+			entry->profile[sizeof(entry->profile) - 1] = '\0';
+			entry->result = state & 0xFF;
+			entry->provisional = (state >> 8) & 0xFF;
+			entry->rings = (state >> 16) & 0xFFFF;
+			entry->analysed = state >> 32;
+			count++;
+			break;
+		}
+	}
+
+	return count;
+}
+
+/*! \brief Name of a registry entry's state, the verdict once there is one */
+static const char *cpa_registry_state(const struct cpa_registry_entry *entry)
+{
+	if (entry->result > CPA_RESULT_NONE && entry->result < CPA_RESULT_MAX) {
+		return cpa_result_names[entry->result];
+	}
+
+	return "Analysing";
+}
+
+static void cpa_session_destroy(struct cpa_session *session)
+{
+	int i;
+
+	cpa_registry_remove(session);
+
+	for (i = 0; i < session->numShadows; i++) {
+		ao2_cleanup(session->shadows[i].profile);
+	}
+	session->numShadows = 0;
+	ao2_cleanup(session->profile);
+	session->profile = NULL;
+	for (i = 0; i < session->numZones; i++) {
+		ast_dsp_free(session->zones[i].dsp);
+		session->zones[i].dsp = NULL;
+	}
+	session->numZones = 0;
+	ao2_cleanup(session->impairment);
+	session->impairment = NULL;
+	cpa_session_features_free(session);
+	ast_free(session->kws);
+	session->kws = NULL;
+}
+
+/*!
+ * \brief Build the zone detectors and keyword spotter the session's profile asks for
+ *
+ * Whatever the session had before is dropped. When the profile lists
+ * several zones and one has been learned for the destination, only that
+ * zone is run.
+ *
+ * \retval 0 on success
+ * \retval -1 if a detector could not be created
+ */
+static int cpa_session_detectors(struct cpa_session *session, struct cpa_config *cfg, const char *destination)
+{
+	char learned[8] = "";
+	int i;
+
+	for (i = 0; i < session->numZones; i++) {
+		ast_dsp_free(session->zones[i].dsp);
+	}
+	memset(session->zones, 0, sizeof(session->zones));
+	session->numZones = 0;
+	session->zone = -1;
+	session->learnKey[0] = '\0';
+	ast_free(session->kws);
+	session->kws = NULL;
+	session->keyword = -1;
+
+	if (cfg && cfg->learnPrefixLength && session->profile->numZones && !ast_strlen_zero(destination)) {
+		cpa_learned_key(session->learnKey, sizeof(session->learnKey), destination, cfg->learnPrefixLength);
+		if (session->profile->numZones > 1) {
+			cpa_learned_zone(session->learnKey, cfg->learnMinHits, learned, sizeof(learned));
+		}
+	}
+
+	/* One detector per zone hypothesis, they all see the same frames */
+	for (i = 0; i < MAX(session->profile->numZones, 1); i++) {
+		struct cpa_zone *zone = &session->zones[session->numZones];
+
+		if (!ast_strlen_zero(learned) && strcasecmp(learned, session->profile->zones[i])) {
+			continue;
+		}
+
+		ast_copy_string(zone->name, session->profile->numZones ? session->profile->zones[i] : "", sizeof(zone->name));
+		zone->native = session->profile->engine == CPA_ENGINE_NATIVE && cpa_tonebank_supports(zone->name);
+		if (zone->native) {
+			memset(&zone->bank, 0, sizeof(zone->bank));
+			zone->bank.decimate = session->profile->decimate;
+			session->numZones++;
+			continue;
+		}
+
+		if (!(zone->dsp = ast_dsp_new())) {
+			return -1;
+		}
+		session->numZones++;
+		if (!ast_strlen_zero(zone->name) && ast_dsp_set_call_progress_zone(zone->dsp, zone->name)) {
+			ast_log(LOG_WARNING, "CPA: Unknown tone zone '%s' in profile '%s'\n", zone->name, session->profile->name);
+			ast_dsp_free(zone->dsp);
+			zone->dsp = NULL;
+			session->numZones--;
+		}
+	}
+	if (!session->numZones) {
+		return -1;
+	}
+	session->learnedZone = !ast_strlen_zero(learned);
+
+	if (session->profile->numKeywords) {
+		if (!(session->kws = ast_calloc(1, sizeof(*session->kws)))) {
+			return -1;
+		}
+		cpa_kws_reset(session->kws);
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Set up a session for the named profile
+ *
+ * Shadow profiles from cpa.conf are attached on a sampled fraction of calls.
+ *
+ * \retval 0 on success
+ * \retval -1 if the DSP could not be created
+ */
+static int cpa_session_init(struct cpa_session *session, const char *profileName, const char *destination,
+	int silenceThreshold, int totalAnalysisTime)
+{
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	int i;
+
+	memset(session, 0, sizeof(*session));
+	session->totalAnalysisTime = totalAnalysisTime;
+	session->screen.onset = -1;
+	session->cadence.lastOnset = -1;
+
+	if (cfg && !ast_strlen_zero(profileName)) {
+		if (!(session->profile = ao2_find(cfg->profiles, profileName, OBJ_SEARCH_KEY))) {
+			ast_log(LOG_WARNING, "CPA: Unknown profile '%s', using defaults\n", profileName);
+		}
+	}
+	if (!session->profile && cfg) {
+		session->profile = ao2_find(cfg->profiles, "default", OBJ_SEARCH_KEY);
+	}
+	if (!session->profile && !(session->profile = cpa_profile_alloc("default"))) {
+		return -1;
+	}
+
+	if (cpa_session_detectors(session, cfg, destination)) {
+		cpa_session_destroy(session);
+		return -1;
+	}
+
+	/*! All THRESH_XXX values are in GSAMP_SIZE chunks (us = 22ms) */
+	if (silenceThreshold < 0) {
+		silenceThreshold = session->profile->silenceThreshold < 0 ? dfltSilenceThreshold : session->profile->silenceThreshold;
+	}
+	session->threshSilence = silenceThreshold / 20;
+
+	if (!cfg || !cfg->numShadowProfiles || (ast_random() % 100) >= cfg->shadowSamplePercent) {
+		return 0;
+	}
+
+	for (i = 0; i < cfg->numShadowProfiles; i++) {
+		struct cpa_shadow *shadow = &session->shadows[session->numShadows];
+
+		if (!(shadow->profile = ao2_find(cfg->profiles, cfg->shadowProfiles[i], OBJ_SEARCH_KEY))) {
+			continue;
+		}
+		if (shadow->profile == session->profile) {
+			ao2_ref(shadow->profile, -1);
+			shadow->profile = NULL;
+			continue;
+		}
+		shadow->threshSilence = (shadow->profile->silenceThreshold < 0 ? dfltSilenceThreshold : shadow->profile->silenceThreshold) / 20;
+		session->numShadows++;
+	}
+
+	return 0;
+}
+
+
+/*!
+ * \brief Check the tone state of every zone against a profile
+ *
+ * A zone hears anything that is not one of its own tones as talking, so a
+ * tone verdict from any zone wins while Talking needs every zone to agree.
+ * Silence only wins once no zone has a tone verdict, a zone whose tone
+ * dropped out for a moment must not hide another zone's.
+ *
+ * \param zone set to the zone that produced the verdict
+ */
+static enum cpa_result cpa_session_evaluate(struct cpa_session *session, const struct cpa_profile *profile, int threshSilence, int *zone)
+{
+	enum cpa_result result;
+	int talking = 0, silence = -1;
+	int i;
+
+	for (i = 0; i < session->numZones; i++) {
+		struct cpa_zone *z = &session->zones[i];
+
+		if (!z->repeated) {
+			continue;
+		}
+		result = cpa_profile_evaluate(profile, threshSilence, z->lastTone, z->tcount);
+		if (result == CPA_RESULT_TALKING) {
+			talking++;
+		} else if (result == CPA_RESULT_SILENCE) {
+			if (silence < 0) {
+				silence = i;
+			}
+		} else if (result != CPA_RESULT_NONE) {
+			*zone = i;
+			return result;
+		}
+	}
+
+	if (silence >= 0) {
+		*zone = silence;
+		return CPA_RESULT_SILENCE;
+	}
+	if (talking == session->numZones) {
+		*zone = -1;
+		return CPA_RESULT_TALKING;
+	}
+
+	return CPA_RESULT_NONE;
+}
+
+/*! \brief xorshift32, cheap and repeatable for a given seed */
+static unsigned int cpa_rand(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+/*!
+ * \brief Attach an impairment chain to a session
+ *
+ * \retval 0 on success
+ * \retval -1 if there is no such type=impairment section
+ */
+static int cpa_session_impair(struct cpa_session *session, const char *name)
+{
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+
+	if (!cfg || !(session->impairment = ao2_find(cfg->impairments, name, OBJ_SEARCH_KEY))) {
+		ast_log(LOG_WARNING, "CPA: Unknown impairment '%s'\n", name);
+		return -1;
+	}
+
+	session->impairRand = session->impairment->seed ? session->impairment->seed : (ast_random() | 1);
+	session->impairLoss = 0;
+
+	return 0;
+}
+
+/*! \brief Run a signed linear frame through the session's impairment chain in place */
+static void cpa_impair_frame(struct cpa_session *session, struct ast_frame *f)
+{
+	const struct cpa_impairment *impairment = session->impairment;
+	int16_t *samples = f->data.ptr;
+	int count = f->datalen / 2;
+	int i, n, sample;
+
+	for (n = 0; n < impairment->numStages; n++) {
+		const struct cpa_impairment_stage *stage = &impairment->stages[n];
+
+		switch (stage->type) {
+		case CPA_IMPAIR_GAIN:
+			for (i = 0; i < count; i++) {
+				sample = (samples[i] * stage->value) >> 8;
+				samples[i] = MAX(MIN(sample, 32767), -32768);
+			}
+			break;
+		case CPA_IMPAIR_NOISE:
+			for (i = 0; i < count; i++) {
+				sample = samples[i] + (int) (cpa_rand(&session->impairRand) % (2 * stage->value + 1)) - stage->value;
+				samples[i] = MAX(MIN(sample, 32767), -32768);
+			}
+			break;
+		case CPA_IMPAIR_LOSS:
+			if (!session->impairLoss && (int) (cpa_rand(&session->impairRand) % 100) < stage->value) {
+				session->impairLoss = stage->burst;
+			}
+			if (session->impairLoss) {
+				session->impairLoss--;
+				memset(samples, 0, count * sizeof(*samples));
+			}
+			break;
+		case CPA_IMPAIR_CLIP:
+			for (i = 0; i < count; i++) {
+				samples[i] = MAX(MIN(samples[i], stage->value), -stage->value);
+			}
+			break;
+		case CPA_IMPAIR_ULAW:
+			for (i = 0; i < count; i++) {
+				samples[i] = AST_MULAW(AST_LIN2MU(samples[i]));
+			}
+			break;
+		case CPA_IMPAIR_ALAW:
+			for (i = 0; i < count; i++) {
+				samples[i] = AST_ALAW(AST_LIN2A(samples[i]));
+			}
+			break;
+		}
+	}
+}
+
+/*! \brief Record the final verdict of a session */
+static void cpa_session_finish(struct cpa_session *session, enum cpa_result result)
+{
+	session->result = result;
+	session->resultTime = session->iTotalTime;
+	cpa_registry_publish(session);
+}
+
+/*! \brief Mean absolute value of signed linear samples */
+static int cpa_sample_energy(const int16_t *samples, int count)
+{
+	long sum = 0;
+	int i;
+
+	if (!count) {
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		sum += abs(samples[i]);
+	}
+
+	return sum / count;
+}
+
+/*! \brief Mean absolute sample value of a signed linear frame */
+static int cpa_frame_energy(const struct ast_frame *f)
+{
+	return cpa_sample_energy(f->data.ptr, f->datalen / 2);
+}
+
+/*!
+ * \brief Add one frame to the level envelope
+ *
+ * Speech has deep dips between syllables many times a second while music
+ * and tones hold their level, so each window is marked speech like when a
+ * fifth of its frames fall well below the window's peak.
+ */
+static void cpa_envelope_update(struct cpa_envelope *env, int energy, int ms)
+{
+	int i, peak = 0, dips = 0;
+
+	env->energy = energy;
+	env->voiced = energy > cpaEnergyThreshold;
+	if (env->voiced) {
+		if (env->gapRun) {
+			env->lastGap = env->gapRun;
+		}
+		env->voicedRun += ms;
+		env->gapRun = 0;
+	} else {
+		env->gapRun += ms;
+		env->voicedRun = 0;
+	}
+
+	env->windowReady = 0;
+	env->window[env->windowFrames++] = energy;
+	env->windowTime += ms;
+	if (env->windowFrames < CPA_WINDOW_FRAMES && env->windowTime < CPA_WINDOW_TIME) {
+		return;
+	}
+
+	for (i = 0; i < env->windowFrames; i++) {
+		peak = MAX(peak, env->window[i]);
+	}
+	for (i = 0; i < env->windowFrames; i++) {
+		if (env->window[i] * 6 < peak) {
+			dips++;
+		}
+	}
+	env->speechLike = peak > cpaEnergyThreshold && dips * 5 >= env->windowFrames;
+	env->windowFrames = 0;
+	env->windowTime = 0;
+	env->windowReady = 1;
+}
+
+/*!
+ * \brief Follow a call that is on hold until a human comes back
+ *
+ * Only the level envelope is used, and steady music is looked at on one
+ * frame in holdDuty, so a call can sit on hold for a long time cheaply.
+ * Speech after the music is an announcement if the music comes back, and a
+ * human if it is followed by holdHumanSilence of silence waiting for us.
+ */
+static enum cpa_result cpa_session_feed_hold(struct cpa_session *session, struct ast_frame *f)
+{
+	struct cpa_hold *hold = &session->hold;
+	struct cpa_envelope *env = &session->envelope;
+	const struct cpa_profile *profile = session->profile;
+
+	if (hold->state == CPA_HOLD_MUSIC && !env->speechLike && hold->skip-- > 0) {
+		/* Steady music, carry the last frame's level forward */
+		if (env->voiced) {
+			env->voicedRun += session->framelength;
+		} else {
+			env->gapRun += session->framelength;
+		}
+		env->windowTime += session->framelength;
+		return CPA_RESULT_NONE;
+	}
+	hold->skip = profile->holdDuty - 1;
+
+	cpa_envelope_update(env, cpa_frame_energy(f), session->framelength);
+
+	switch (hold->state) {
+	case CPA_HOLD_WAITING:
+		hold->audioTime = env->gapRun >= CPA_HOLD_GAP ? 0 : hold->audioTime + session->framelength;
+		if (hold->audioTime >= profile->holdMinTime && !env->speechLike) {
+			hold->state = CPA_HOLD_MUSIC;
+			hold->holdStart = session->iTotalTime;
+			session->provisional = CPA_RESULT_HOLD;
+			if (session->chan) {
+				ast_verb(3, "CPA: Channel [%s] is on hold\n", ast_channel_name(session->chan));
+				manager_event(EVENT_FLAG_CALL, "CPAHold",
+					"Channel: %s\r\n"
+					"Uniqueid: %s\r\n",
+					ast_channel_name(session->chan), ast_channel_uniqueid(session->chan));
+			}
+		}
+		break;
+	case CPA_HOLD_MUSIC:
+		if ((env->windowReady && env->speechLike)
+			|| (env->voiced && env->voicedRun == session->framelength && env->lastGap >= profile->holdHumanSilence)) {
+			hold->state = CPA_HOLD_SPEECH;
+			if (session->chan) {
+				ast_debug(1, "CPA: Channel [%s] speech after [%d]ms on hold\n", ast_channel_name(session->chan),
+					session->iTotalTime - hold->holdStart);
+				manager_event(EVENT_FLAG_CALL, "CPAHoldSpeech",
+					"Channel: %s\r\n"
+					"Uniqueid: %s\r\n"
+					"HoldTime: %d\r\n",
+					ast_channel_name(session->chan), ast_channel_uniqueid(session->chan),
+					session->iTotalTime - hold->holdStart);
+			}
+		}
+		break;
+	case CPA_HOLD_SPEECH:
+		if (env->gapRun >= profile->holdHumanSilence) {
+			if (session->chan) {
+				ast_verb(3, "CPA: Channel [%s] human returned after [%d]ms on hold\n", ast_channel_name(session->chan),
+					session->iTotalTime - hold->holdStart);
+				manager_event(EVENT_FLAG_CALL, "CPAHumanReturned",
+					"Channel: %s\r\n"
+					"Uniqueid: %s\r\n"
+					"HoldTime: %d\r\n",
+					ast_channel_name(session->chan), ast_channel_uniqueid(session->chan),
+					session->iTotalTime - hold->holdStart);
+			}
+			cpa_session_finish(session, CPA_RESULT_HUMANRETURNED);
+			return session->result;
+		}
+		if (env->windowReady && env->voiced && !env->speechLike) {
+			/* The music is back, that was an announcement */
+			hold->state = CPA_HOLD_MUSIC;
+		}
+		break;
+	}
+
+	return CPA_RESULT_NONE;
+}
+
+/*! \brief Level variation of the voiced frames so far, in percent of their mean */
+static int cpa_screen_variation(const struct cpa_screen *screen)
+{
+	double mean, variance;
+
+	if (!screen->voicedFrames) {
+		return 0;
+	}
+	mean = screen->levelSum / screen->voicedFrames;
+	variance = screen->levelSquares / screen->voicedFrames - mean * mean;
+
+	return mean > 0 ? 100.0 * sqrt(MAX(variance, 0.0)) / mean : 0;
+}
+
+/*!
+ * \brief Decide between a human and a screening assistant on the first utterance
+ *
+ * A human says a few words and waits, a screening assistant talks for
+ * screenMinSpeech or more in a steady synthetic voice and then waits. Long
+ * speech with a lively level is a human (or a greeting) and is Talking as
+ * soon as that is clear.
+ *
+ * \return Talking, Screening or CPA_RESULT_NONE while the utterance goes on
+ */
+static enum cpa_result cpa_session_screen(struct cpa_session *session, struct ast_frame *f)
+{
+	struct cpa_screen *screen = &session->screen;
+	struct cpa_envelope *env = &session->envelope;
+	const struct cpa_profile *profile = session->profile;
+	int variation;
+
+	cpa_envelope_update(env, cpa_frame_energy(f), session->framelength);
+
+	if (env->voiced) {
+		if (screen->onset < 0) {
+			screen->onset = session->iTotalTime - session->framelength;
+		}
+		screen->voicedTime += session->framelength;
+		screen->voicedFrames++;
+		screen->levelSum += env->energy;
+		screen->levelSquares += (double) env->energy * env->energy;
+	}
+	if (screen->onset < 0) {
+		return CPA_RESULT_NONE;
+	}
+
+	variation = cpa_screen_variation(screen);
+	if (screen->voicedTime >= profile->screenMinSpeech && variation > profile->screenMaxVariation) {
+		ast_debug(1, "CPA: Long speech with [%d]%% level variation, human\n", variation);
+		return CPA_RESULT_TALKING;
+	}
+	if (env->gapRun < profile->screenWaitSilence) {
+		return CPA_RESULT_NONE;
+	}
+
+	/* The utterance is over and the far end is waiting for us */
+	ast_debug(1, "CPA: Utterance of [%d]ms from [%d]ms with [%d]%% level variation\n",
+		screen->voicedTime, screen->onset, variation);
+	if (screen->voicedTime >= profile->screenMinSpeech && screen->onset <= CPA_SCREEN_ONSET) {
+		return CPA_RESULT_SCREENING;
+	}
+
+	return CPA_RESULT_TALKING;
+}
+
+/*!
+ * \brief Measure how narrow band a signed linear frame is
+ *
+ * Fits an order 2 linear predictor (covariance method), which a single tone
+ * or a close pair of tones follows almost exactly while speech and noise do
+ * not. Six products a sample, a fraction of a tone bank.
+ *
+ * \param freq Set to the predictor's resonance (Hz) when the frame is narrow band
+ * \retval 1 if the prediction gain is at least CPA_CADENCE_GAIN
+ * \retval 0 otherwise
+ */
+static int cpa_cadence_tonal(const int16_t *samples, int count, float *freq)
+{
+	int64_t p00 = 0, p01 = 0, p02 = 0, p11 = 0, p12 = 0, p22 = 0;
+	double det, a1, a2, residual, cosine;
+	int n;
+
+	for (n = 2; n < count; n++) {
+		p00 += samples[n] * samples[n];
+		p01 += samples[n] * samples[n - 1];
+		p02 += samples[n] * samples[n - 2];
+		p11 += samples[n - 1] * samples[n - 1];
+		p12 += samples[n - 1] * samples[n - 2];
+		p22 += samples[n - 2] * samples[n - 2];
+	}
+
+	det = (double) p11 * p22 - (double) p12 * p12;
+	if (!p00 || det <= 0) {
+		return 0;
+	}
+	a1 = ((double) p01 * p22 - (double) p02 * p12) / det;
+	a2 = ((double) p11 * p02 - (double) p12 * p01) / det;
+	residual = p00 - a1 * p01 - a2 * p02;
+	if (residual * CPA_CADENCE_GAIN > p00 || a2 >= 0) {
+		return 0;
+	}
+
+	/* A resonance needs complex poles, their angle is the frequency */
+	cosine = a1 / (2 * sqrt(-a2));
+	if (cosine >= 1 || cosine <= -1) {
+		return 0;
+	}
+	*freq = acos(cosine) * 8000.0 / (2 * M_PI);
+
+	return 1;
+}
+
+/*!
+ * \brief Follow the on/off cadence of narrow band bursts
+ *
+ * Works on any frequency, for ringback the tone zones do not know. Audio
+ * that is not narrow band for a few frames, or a tone too long for a ring,
+ * rejects the cadence for the rest of the session.
+ *
+ * \return Ringing once a second burst of the same tone starts a ringback
+ * period after the first, CPA_RESULT_NONE otherwise
+ */
+static enum cpa_result cpa_session_cadence(struct cpa_session *session, struct ast_frame *f)
+{
+	struct cpa_cadence *cadence = &session->cadence;
+	int ms = session->framelength;
+	int energy = cpa_frame_energy(f);
+	float freq = 0;
+	int period;
+
+	if (cadence->rejected) {
+		return CPA_RESULT_NONE;
+	}
+
+	if (energy > cpaEnergyThreshold && cpa_cadence_tonal(f->data.ptr, f->datalen / 2, &freq)) {
+		if (!cadence->inBurst) {
+			cadence->inBurst = 1;
+			cadence->onset = session->iTotalTime - ms;
+			cadence->onTime = cadence->offTime = 0;
+			cadence->tonalFrames = 0;
+			cadence->freqSum = 0;
+		}
+		cadence->onTime += cadence->offTime + ms;
+		cadence->offTime = 0;
+		cadence->otherRun = 0;
+		cadence->tonalFrames++;
+		cadence->freqSum += freq;
+		if (cadence->onTime > CPA_CADENCE_MAX_ON) {
+			ast_debug(1, "CPA: Tone of [%d]ms is too long for ringback\n", cadence->onTime);
+			cadence->rejected = 1;
+			return CPA_RESULT_NONE;
+		}
+	} else if (energy > cpaEnergyThreshold) {
+		/* One frame of a burst's edge is not narrow band, a few in a row are speech or noise */
+		if (++cadence->otherRun >= 3) {
+			ast_debug(1, "CPA: Audio that is not narrow band, no ringback cadence\n");
+			cadence->rejected = 1;
+			return CPA_RESULT_NONE;
+		}
+	} else if (cadence->inBurst && (cadence->offTime += ms) >= CPA_CADENCE_MERGE) {
+		float mean = cadence->freqSum / cadence->tonalFrames;
+
+		cadence->inBurst = 0;
+		if (cadence->onTime >= CPA_CADENCE_MIN_ON) {
+			cadence->lastOnset = cadence->onset;
+			cadence->lastFreq = mean;
+		} else {
+			cadence->lastOnset = -1;
+		}
+		return CPA_RESULT_NONE;
+	}
+
+	if (!cadence->inBurst || cadence->lastOnset < 0 || cadence->onTime < CPA_CADENCE_MIN_ON) {
+		return CPA_RESULT_NONE;
+	}
+
+	/* A second ring is under way, it has to be the same tone a ringback period later */
+	period = cadence->onset - cadence->lastOnset;
+	freq = cadence->freqSum / cadence->tonalFrames;
+	if (period < CPA_CADENCE_MIN_PERIOD || period > CPA_CADENCE_MAX_PERIOD
+		|| fabsf(freq - cadence->lastFreq) > cadence->lastFreq / 10) {
+		return CPA_RESULT_NONE;
+	}
+
+	ast_debug(1, "CPA: Ringback cadence of [%d]ms at [%.0f]Hz\n", period, freq);
+	cadence->period = period;
+
+	return CPA_RESULT_RINGING;
+}
+
+/*!
+ * \brief Classify the far end by how it reacts to a probe tone
+ *
+ * Once the first burst of speech pauses for CPA_PROBE_PAUSE, the probe is
+ * played. Speech within CPA_PROBE_REACTION of it went on regardless and
+ * is a recording. Otherwise the passive feature decides: a human answers
+ * with a short burst, a greeting is longer. A burst that runs past
+ * probeHumanBurst twice over without pausing is a recording without
+ * probing at all.
+ *
+ * \return Human, Machine or CPA_RESULT_NONE while undecided
+ */
+static enum cpa_result cpa_session_probe(struct cpa_session *session, struct ast_frame *f)
+{
+	struct cpa_probe *probe = &session->probe;
+	struct cpa_envelope *env = &session->envelope;
+	const struct cpa_profile *profile = session->profile;
+	int since;
+
+	cpa_envelope_update(env, cpa_frame_energy(f), session->framelength);
+
+	switch (probe->state) {
+	case CPA_PROBE_LISTENING:
+		if (env->voiced) {
+			probe->burst += session->framelength;
+			if (probe->burst >= 2 * profile->probeHumanBurst) {
+				ast_debug(1, "CPA: [%d]ms of speech without a pause, machine\n", probe->burst);
+				return CPA_RESULT_MACHINE;
+			}
+		} else if (probe->burst && env->gapRun >= CPA_PROBE_PAUSE) {
+			/* A replayed session has no channel, the probe went out when it was recorded */
+			if (session->chan && ast_playtones_start(session->chan, 0, profile->probeTone, 0)) {
+				ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to play probe '%s'\n",
+					ast_channel_name(session->chan), profile->probeTone);
+				return probe->burst <= profile->probeHumanBurst ? CPA_RESULT_HUMAN : CPA_RESULT_MACHINE;
+			}
+			probe->state = CPA_PROBE_PLAYING;
+			probe->start = session->iTotalTime;
+		}
+		break;
+	case CPA_PROBE_PLAYING:
+		since = session->iTotalTime - probe->start;
+		if (env->voiced && since < CPA_PROBE_REACTION) {
+			ast_debug(1, "CPA: Speech [%d]ms into the probe, machine\n", since);
+			return CPA_RESULT_MACHINE;
+		}
+		if (env->voiced || since >= profile->probeWindow) {
+			ast_debug(1, "CPA: %s [%d]ms after the probe, first burst [%d]ms\n",
+				env->voiced ? "Reaction" : "Silence", since, probe->burst);
+			return probe->burst <= profile->probeHumanBurst ? CPA_RESULT_HUMAN : CPA_RESULT_MACHINE;
+		}
+		break;
+	}
+
+	return CPA_RESULT_NONE;
+}
+
+/*! Frames it takes the noise floor to rise to a new level, so words never lift it */
+#define CPA_EOG_FLOOR_RISE 128
+
+/*! Lowest level that counts as speech, for lines with a digitally silent floor */
+#define CPA_EOG_MIN_LEVEL 32
+
+/*!
+ * \brief Follow the far end's speech until it stops for good
+ *
+ * The floor drops to any quieter frame at once and rises slowly, so the
+ * dips between words keep it at the line noise during a long greeting.
+ *
+ * \retval 1 once speech was followed by eogSilence
+ * \retval 0 while it goes on
+ */
+static int cpa_session_eog(struct cpa_session *session, struct ast_frame *f)
+{
+	struct cpa_eog *eog = &session->eog;
+	const struct cpa_profile *profile = session->profile;
+	int energy = cpa_frame_energy(f);
+
+	if (eog->done) {
+		return 1;
+	}
+
+	if (!eog->floor || energy < eog->floor) {
+		eog->floor = MAX(energy, 1);
+	} else {
+		eog->floor += (energy - eog->floor + CPA_EOG_FLOOR_RISE - 1) / CPA_EOG_FLOOR_RISE;
+	}
+
+	if (energy >= MAX(eog->floor * profile->eogMargin / 256, CPA_EOG_MIN_LEVEL)) {
+		eog->speechTime += session->framelength;
+		eog->silenceTime = 0;
+		return 0;
+	}
+	if (!eog->speechTime) {
+		return 0;
+	}
+
+	eog->silenceTime += session->framelength;
+	if (eog->silenceTime < profile->eogSilence) {
+		return 0;
+	}
+	if (eog->speechTime < profile->eogMinSpeech) {
+		/* An early pause, or noise and ringback before the greeting, the greeting may still come */
+		ast_debug(1, "CPA: Pause after [%d]ms of speech, too short for a greeting, still listening\n", eog->speechTime);
+		eog->silenceTime = 0;
+		return 0;
+	}
+
+	eog->done = 1;
+	eog->end = session->iTotalTime - eog->silenceTime;
+	ast_debug(1, "CPA: [%d]ms of speech over a floor of [%d] ended at [%d]ms, end of greeting\n", eog->speechTime,
+		eog->floor, eog->end);
+
+	return 1;
+}
+
+/*!
+ * \brief Keep listening after the verdict until the greeting ends
+ *
+ * Only the end of greeting tracker runs, the verdict already stands.
+ */
+static void cpa_session_wait_eog(struct cpa_session *session, int maxWait)
+{
+	struct timeval start = ast_tvnow();
+	struct ast_frame *f;
+	int res;
+
+	while (!session->eog.done && ast_tvdiff_ms(ast_tvnow(), start) < maxWait
+		&& (res = ast_waitfor(session->chan, 2 * dfltMaxWaitTimeForFrame)) > -1) {
+		if (!res) {
+			continue;
+		}
+		if (!(f = ast_read(session->chan))) {
+			break;
+		}
+		if (f->frametype == AST_FRAME_VOICE) {
+			session->framelength = ast_codec_samples_count(f) / DEFAULT_SAMPLES_PER_MS;
+			session->iTotalTime += session->framelength;
+			cpa_session_eog(session, f);
+		}
+		ast_frfree(f);
+	}
+}
+
+/*! \brief Point frame at one frame of a block and make its length the session's current one */
+static void cpa_session_frame(struct cpa_session *session, struct ast_frame *frame, int16_t *samples, int count)
+{
+	frame->data.ptr = samples;
+	frame->samples = count;
+	frame->datalen = count * 2;
+	session->framelength = count / DEFAULT_SAMPLES_PER_MS;
+}
+
+/*!
+ * \brief Run a block of signed linear audio through the session
+ *
+ * The tone detectors and the keyword spotter see the whole block at once,
+ * they keep their own sample counts. The tone state and count pulled from
+ * each zone's DSP are the features shared by the active profile and any
+ * shadow profiles. Everything that counts frames, from impairment to
+ * screening, still follows the block frame by frame as it arrived.
+ *
+ * \param frameSamples Samples of each frame in the block, NULL if it is a single frame
+ * \param numFrames Frames in frameSamples
+ *
+ * \return the verdict of the active profile, CPA_RESULT_NONE if undecided
+ */
+static enum cpa_result cpa_session_analyse(struct cpa_session *session, struct ast_frame *f, const int *frameSamples, int numFrames)
+{
+	struct ast_frame frame = *f;
+	int16_t *samples = f->data.ptr;
+	enum cpa_result result, toneResult;
+	int start = session->iTotalTime, end = start;
+	int single = f->datalen / 2;
+	int toneState;
+	int zone = -1;
+	int decided;
+	int offset, i, n;
+
+	if (!frameSamples) {
+		frameSamples = &single;
+		numFrames = 1;
+	}
+
+	for (n = 0, offset = 0; session->impairment && n < numFrames; offset += frameSamples[n++]) {
+		cpa_session_frame(session, &frame, samples + offset, frameSamples[n]);
+		cpa_impair_frame(session, &frame);
+	}
+
+	for (n = 0; n < numFrames; n++) {
+		end += frameSamples[n] / DEFAULT_SAMPLES_PER_MS;
+	}
+	session->framelength = end - start;
+	ast_debug(1, "Frametype = AST_FRAME_VOICE. Framelength = [%d]\n", session->framelength);
+
+	/* If the total time exceeds the analysis time then give up as we are not too sure */
+	session->iTotalTime = end;
+	cpa_registry_publish(session);
+	if (session->iTotalTime >= session->totalAnalysisTime) {
+		cpa_session_finish(session, session->provisional != CPA_RESULT_NONE ? session->provisional : CPA_RESULT_TIMEOUT);
+		return session->result;
+	}
+	session->iTotalTime = start;
+
+	if (session->holdMode) {
+		for (n = 0, offset = 0; n < numFrames; offset += frameSamples[n++]) {
+			cpa_session_frame(session, &frame, samples + offset, frameSamples[n]);
+			session->iTotalTime += session->framelength;
+			if ((result = cpa_session_feed_hold(session, &frame)) != CPA_RESULT_NONE) {
+				return result;
+			}
+		}
+		return CPA_RESULT_NONE;
+	}
+
+	for (i = 0; i < session->numZones; i++) {
+		struct cpa_zone *z = &session->zones[i];
+
+		ast_debug(1, "CPA Checking Call Progress in zone [%s].\n", z->name);
+		if (z->native) {
+			cpa_tonebank_process(&z->bank, f->data.ptr, f->datalen / 2);
+			toneState = z->bank.tstate;
+		} else {
+			if (ast_dsp_call_progress(z->dsp, f) > 0) {
+				ast_debug(1, "CPA: Wait what? Frame Control came back as NOT SILENCE\n");
+			}
+			toneState = ast_dsp_get_tstate(z->dsp);
+		}
+		ast_debug(1, "CPA Frame - Frametype: [%d] Subclass: [%d] DSP ToneState: [%d]\n", f->frametype, f->subclass.integer, toneState);
+
+		if (toneState != z->lastTone) {
+			ast_debug(1, "Stop state %d with duration %d\n", z->lastTone, z->tcount);
+			ast_debug(1, "Start state %d\n", toneState);
+			z->lastTone = toneState;
+			z->tcount = 1;
+			z->repeated = 0;
+			if (toneState == DSP_TONE_STATE_RINGING) {
+				z->rings++;
+			}
+		} else {
+			z->tcount = z->native ? z->bank.tcount : ast_dsp_get_tcount(z->dsp);
+			z->repeated = 1;
+			ast_debug(1, "CPA ToneState Repeated - lastTone: [%d] toneState: [%d] tcount: [%d]\n", z->lastTone, toneState, z->tcount);
+		}
+	}
+
+	if (session->kws && (session->keyword = cpa_kws_process(session->kws, session->profile, f->data.ptr, f->datalen / 2)) >= 0) {
+		ast_debug(1, "CPA: Heard keyword '%s'\n", session->profile->keywords[session->keyword].phrase);
+		toneResult = CPA_RESULT_MACHINE;
+	} else {
+		for (i = 0; i < session->numShadows; i++) {
+			struct cpa_shadow *shadow = &session->shadows[i];
+
+			if (shadow->result != CPA_RESULT_NONE) {
+				continue;
+			}
+			result = cpa_session_evaluate(session, shadow->profile, shadow->threshSilence, &zone);
+			if (result != CPA_RESULT_NONE && result != CPA_RESULT_SILENCE) {
+				shadow->result = result;
+				shadow->resultTime = end;
+			}
+		}
+		toneResult = cpa_session_evaluate(session, session->profile, session->threshSilence, &zone);
+	}
+	/* A tone or a keyword only counts once the whole block is in */
+	decided = toneResult != CPA_RESULT_TALKING && toneResult != CPA_RESULT_SILENCE && toneResult != CPA_RESULT_NONE;
+
+	for (n = 0, offset = 0; n < numFrames; offset += frameSamples[n++]) {
+		cpa_session_frame(session, &frame, samples + offset, frameSamples[n]);
+		session->iTotalTime += session->framelength;
+		if (session->eogMode) {
+			cpa_session_eog(session, &frame);
+		}
+		if (session->features && session->numZones) {
+			cpa_session_features_add(session, cpa_frame_energy(&frame));
+		}
+		if (decided) {
+			continue;
+		}
+
+		result = toneResult;
+		if (session->profile->cadence
+			&& (result == CPA_RESULT_TALKING || result == CPA_RESULT_SILENCE || result == CPA_RESULT_NONE)) {
+			if (cpa_session_cadence(session, &frame) == CPA_RESULT_RINGING) {
+				result = CPA_RESULT_RINGING;
+				zone = -1;
+			} else if (result == CPA_RESULT_TALKING && !session->cadence.rejected) {
+				/* Only a steady tone so far, Talking waits until it is clear it is no ringback */
+				session->provisional = result;
+				result = CPA_RESULT_NONE;
+			}
+		}
+		if ((session->probeMode || session->profile->screening)
+			&& (result == CPA_RESULT_TALKING || result == CPA_RESULT_SILENCE || result == CPA_RESULT_NONE)) {
+			/* Talking has to wait until the first utterance tells human from assistant or machine */
+			enum cpa_result screened = session->probeMode ? cpa_session_probe(session, &frame) : cpa_session_screen(session, &frame);
+
+			if (result == CPA_RESULT_TALKING) {
+				session->provisional = result;
+			}
+			if (screened != CPA_RESULT_NONE || result == CPA_RESULT_TALKING) {
+				result = screened;
+				zone = -1;
+			}
+		}
+		if (result == CPA_RESULT_SILENCE) {
+			/* Silence alone never ends the analysis, it is what we report on Timeout */
+			if (session->provisional == CPA_RESULT_NONE) {
+				session->provisional = result;
+			}
+			continue;
+		}
+		if (result != CPA_RESULT_NONE) {
+			session->zone = zone;
+			cpa_session_finish(session, result);
+			return result;
+		}
+	}
+
+	if (decided) {
+		session->zone = session->keyword >= 0 ? -1 : zone;
+		cpa_session_finish(session, toneResult);
+		return toneResult;
+	}
+
+	return CPA_RESULT_NONE;
+}
+
+/*! \brief cpa_session_analyse(), timed for the metrics when the session is live */
+static enum cpa_result cpa_session_feed_block(struct cpa_session *session, struct ast_frame *f, const int *frameSamples, int numFrames)
+{
+	struct timeval start;
+	enum cpa_result result;
+
+	if (!session->chan) {
+		return cpa_session_analyse(session, f, frameSamples, numFrames);
+	}
+
+	start = ast_tvnow();
+	result = cpa_session_analyse(session, f, frameSamples, numFrames);
+	cpa_histogram_observe(&cpaFrameCost, ast_tvdiff_us(ast_tvnow(), start));
+
+	return result;
+}
+
+/*! \brief Run one signed linear voice frame through the session */
+static enum cpa_result cpa_session_feed(struct cpa_session *session, struct ast_frame *f)
+{
+	return cpa_session_feed_block(session, f, NULL, 0);
+}
+
+/*!
+ * \brief Feed the verdict's zone back into the learned state
+ *
+ * A learned zone that only led to a Timeout loses a hit, so a destination
+ * that changed its tone plan goes back to trying every zone.
+ */
+static void cpa_session_learn(struct cpa_session *session)
+{
+	if (ast_strlen_zero(session->learnKey)) {
+		return;
+	}
+
+	if (session->zone >= 0) {
+		cpa_learn_zone(session->learnKey, session->zones[session->zone].name, 1, time(NULL), 0);
+	} else if (session->learnedZone && session->result == CPA_RESULT_TIMEOUT) {
+		cpa_learn_zone(session->learnKey, session->zones[0].name, -1, time(NULL), 0);
+	}
+}
+
+/*!
+ * \brief Compare the shadow profiles with the active verdict
+ *
+ * Each shadow's verdict and decision time is logged, stored in CPASHADOW as
+ * profile:verdict:ms entries and added to the profile's shadow statistics.
+ */
+static void cpa_session_report_shadows(struct ast_channel *chan, struct cpa_session *session)
+{
+	struct ast_str *buf;
+	int i;
+
+	if (!session->numShadows || session->holdMode || !(buf = ast_str_create(128))) {
+		return;
+	}
+
+	ast_atomic_fetchadd_int(&cpaStats.shadowCalls, 1);
+
+	for (i = 0; i < session->numShadows; i++) {
+		struct cpa_shadow *shadow = &session->shadows[i];
+		struct cpa_shadow_stats *stats = &shadow->profile->shadowStats;
+
+		ast_atomic_fetchadd_int(&stats->runs, 1);
+		if (shadow->result == CPA_RESULT_NONE) {
+			ast_atomic_fetchadd_int(&stats->undecided, 1);
+		} else if (shadow->result == session->result) {
+			ast_atomic_fetchadd_int(&stats->agree, 1);
+			if (shadow->resultTime < session->resultTime) {
+				ast_atomic_fetchadd_int(&stats->earlier, 1);
+				ast_atomic_fetchadd_int(&stats->savedTime, session->resultTime - shadow->resultTime);
+			}
+		} else {
+			ast_atomic_fetchadd_int(&stats->disagree, 1);
+		}
+
+		ast_verb(3, "CPA: Channel [%s] shadow profile [%s] returned [%s] at [%d]ms, active profile [%s] returned [%s] at [%d]ms\n",
+			ast_channel_name(chan), shadow->profile->name, cpa_result_names[shadow->result], shadow->resultTime,
+			session->profile->name, cpa_result_names[session->result], session->resultTime);
+
+		ast_str_append(&buf, 0, "%s%s:%s:%d", i ? "," : "", shadow->profile->name,
+			shadow->result == CPA_RESULT_NONE ? "None" : cpa_result_names[shadow->result], shadow->resultTime);
+	}
+
+	pbx_builtin_setvar_helper(chan, "CPASHADOW", ast_str_buffer(buf));
+	ast_free(buf);
+}
+
+/*!
+ * \brief Packets received on the channel's RTP instance
+ *
+ * \return the packet count, -1 if the channel has no RTP
+ */
+static int cpa_rtp_rxcount(struct ast_channel *chan)
+{
+	struct ast_rtp_glue *glue;
+	struct ast_rtp_instance *rtp = NULL;
+	struct ast_rtp_instance_stats stats = { 0, };
+	int res = -1;
+
+	ast_channel_lock(chan);
+	if ((glue = ast_rtp_instance_get_glue(ast_channel_tech(chan)->type)) && glue->get_rtp_info) {
+		glue->get_rtp_info(chan, &rtp);
+	}
+	ast_channel_unlock(chan);
+
+	if (!rtp) {
+		return -1;
+	}
+	if (!ast_rtp_instance_get_stats(rtp, &stats, AST_RTP_INSTANCE_STAT_RXCOUNT)) {
+		res = stats.rxcount;
+	}
+	ao2_ref(rtp, -1);
+
+	return res;
+}
+
+static void cpa_session_datastore_destroy(void *data)
+{
+	struct cpa_session *session = data;
+
+	cpa_session_destroy(session);
+	ast_free(session);
+}
+
+/*! \brief Keeps a CPA session on the channel between CPA(...,R) calls */
+static const struct ast_datastore_info cpa_session_datastore = {
+	.type = "cpa_session",
+	.destroy = cpa_session_datastore_destroy,
+};
+
+/*!
+ * \brief Find the session an earlier CPA() left on the channel, or start one there
+ *
+ * A resumed session keeps its tone detectors, envelope and timeline, only
+ * the verdict and the probe, screening, hold and cadence state are cleared
+ * and the analysis window starts again from where the timeline stands. A
+ * different profile takes over the thresholds and gets zone detectors and
+ * a keyword spotter of its own, as a new session would.
+ *
+ * \return the session, owned by the channel datastore, NULL on error
+ */
+static struct cpa_session *cpa_session_resume(struct ast_channel *chan, const char *profileName, int silenceThreshold,
+	int totalAnalysisTime, const char *destination)
+{
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	struct ast_datastore *datastore;
+	struct cpa_session *session;
+	struct cpa_profile *profile;
+	int rebuild = 0, i;
+
+	ast_channel_lock(chan);
+	datastore = ast_channel_datastore_find(chan, &cpa_session_datastore, NULL);
+	ast_channel_unlock(chan);
+
+	if (!datastore) {
+		if (!(session = ast_calloc(1, sizeof(*session)))) {
+			return NULL;
+		}
+		if (cpa_session_init(session, profileName, destination, silenceThreshold, totalAnalysisTime)) {
+			ast_free(session);
+			return NULL;
+		}
+		if (!(datastore = ast_datastore_alloc(&cpa_session_datastore, NULL))) {
+			cpa_session_datastore_destroy(session);
+			return NULL;
+		}
+		datastore->data = session;
+		ast_channel_lock(chan);
+		ast_channel_datastore_add(chan, datastore);
+		ast_channel_unlock(chan);
+		return session;
+	}
+
+	session = datastore->data;
+	ast_debug(1, "CPA: Channel [%s]. Resuming session at [%d]ms\n", ast_channel_name(chan), session->iTotalTime);
+
+	if (!ast_strlen_zero(profileName) && strcasecmp(profileName, session->profile->name)
+		&& (cfg = ao2_global_obj_ref(cpa_globals))) {
+		if ((profile = ao2_find(cfg->profiles, profileName, OBJ_SEARCH_KEY))) {
+			ao2_ref(session->profile, -1);
+			session->profile = profile;
+			rebuild = 1;
+		} else {
+			ast_log(LOG_WARNING, "CPA: Unknown profile '%s', keeping '%s'\n", profileName, session->profile->name);
+		}
+	}
+	/* A session whose rebuild failed was left without detectors, it gets another go */
+	if ((rebuild || !session->numZones) && cpa_session_detectors(session, cfg, destination)) {
+		return NULL;
+	}
+	if (silenceThreshold < 0) {
+		silenceThreshold = session->profile->silenceThreshold < 0 ? dfltSilenceThreshold : session->profile->silenceThreshold;
+	}
+	session->threshSilence = silenceThreshold / 20;
+
+	session->totalAnalysisTime = session->iTotalTime + totalAnalysisTime;
+	session->result = CPA_RESULT_NONE;
+	session->provisional = CPA_RESULT_NONE;
+	session->resultTime = 0;
+	session->zone = -1;
+	session->keyword = -1;
+	if (session->kws) {
+		/* A match the last call ended on would be found again on the first frame */
+		cpa_kws_reset(session->kws);
+	}
+	/* What one call's probe, screening, hold and cadence saw says nothing about the next */
+	memset(&session->probe, 0, sizeof(session->probe));
+	memset(&session->screen, 0, sizeof(session->screen));
+	session->screen.onset = -1;
+	memset(&session->hold, 0, sizeof(session->hold));
+	memset(&session->cadence, 0, sizeof(session->cadence));
+	session->cadence.lastOnset = -1;
+	for (i = 0; i < session->numShadows; i++) {
+		session->shadows[i].result = CPA_RESULT_NONE;
+		session->shadows[i].resultTime = 0;
+	}
+
+	return session;
+}
+
+#define CPA_RECORD_MAGIC "CPAREC"
+#define CPA_RECORD_VERSION 1
+
+/*! Most bytes of events a recording keeps, the rest of a long call is dropped */
+#define CPA_RECORD_MAX (4 * 1024 * 1024)
+
+/*! \brief What the analysis loop saw, in the order it saw it */
+enum cpa_record_type {
+	CPA_RECORD_FRAME = 1,	/*!< A frame was read, voice frames carry their samples */
+	CPA_RECORD_FEED,	/*!< The voice frames since the last feed went to the detectors */
+	CPA_RECORD_WAITFOR,	/*!< ast_waitfor() timed out */
+	CPA_RECORD_HANGUP,	/*!< ast_read() returned nothing */
+	CPA_RECORD_NOMEDIA,	/*!< The RTP check found no packets */
+	CPA_RECORD_EXPIRED,	/*!< The wall clock ran out without frames */
+};
+
+enum cpa_record_flags {
+	CPA_RECORD_HOLD = (1 << 0),
+	CPA_RECORD_PROBE = (1 << 1),
+	CPA_RECORD_EOG = (1 << 2),
+	CPA_RECORD_TRUNCATED = (1 << 3),
+};
+
+/*!
+ * \brief Recording file header
+ *
+ * Written last, once the verdict is known, and followed by the events.
+ */
+struct cpa_record_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;			/*!< enum cpa_record_flags */
+	int32_t silenceThreshold;	/*!< As given to cpa_session_init() */
+	int32_t totalAnalysisTime;	/*!< Effective analysis time, hold included */
+	uint32_t impairRand;		/*!< Impairment random state at the start */
+	int32_t resultTime;
+	uint8_t result;
+	uint8_t numZones;
+	uint8_t pad[2];
+	int64_t created;
+	char uniqueid[64];
+	char profile[32];
+	char impairment[32];
+	char zones[CPA_MAX_ZONES][8];	/*!< Zones that ran, learning is not repeated on replay */
+};
+
+/*! \brief One event, voice frames are followed by samples signed linear samples */
+struct cpa_record_event {
+	uint8_t type;
+	uint8_t frametype;
+	uint16_t samples;
+	int32_t subclass;
+	uint32_t time;			/*!< ms since the analysis started */
+};
+
+/*! \brief Events of a session being recorded, kept in memory until the end */
+struct cpa_recorder {
+	char *buf;
+	size_t len;
+	size_t max;
+	struct timeval start;
+	int truncated;
+};
+
+/*! \brief Add an event to a recording, recorder may be NULL */
+static void cpa_record(struct cpa_recorder *recorder, enum cpa_record_type type, const struct ast_frame *f)
+{
+	struct cpa_record_event event = { .type = type, };
+	size_t size = sizeof(event);
+
+	if (!recorder || recorder->truncated) {
+		return;
+	}
+
+	event.time = ast_tvdiff_ms(ast_tvnow(), recorder->start);
+	if (f) {
+		event.frametype = f->frametype;
+		if (f->frametype == AST_FRAME_VOICE) {
+			event.samples = f->samples;
+			size += f->samples * 2;
+		} else {
+			event.subclass = f->subclass.integer;
+		}
+	}
+
+	if (recorder->len + size > recorder->max) {
+		size_t max = MAX(recorder->max * 2, 64 * 1024);
+		char *buf;
+
+		if (recorder->len + size > CPA_RECORD_MAX || !(buf = ast_realloc(recorder->buf, MIN(max, CPA_RECORD_MAX)))) {
+			recorder->truncated = 1;
+			return;
+		}
+		recorder->buf = buf;
+		recorder->max = MIN(max, CPA_RECORD_MAX);
+	}
+
+	memcpy(recorder->buf + recorder->len, &event, sizeof(event));
+	if (event.samples) {
+		memcpy(recorder->buf + recorder->len + sizeof(event), f->data.ptr, event.samples * 2);
+	}
+	recorder->len += size;
+}
+
+/*!
+ * \brief Write a finished recording
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int cpa_recorder_write(struct cpa_recorder *recorder, const char *filename, const struct cpa_session *session,
+	const char *uniqueid, int silenceThreshold, int totalAnalysisTime, uint32_t impairRand)
+{
+	struct cpa_record_header header = { CPA_RECORD_MAGIC, };
+	FILE *fp;
+	int i;
+
+	header.version = CPA_RECORD_VERSION;
+	header.flags = (session->holdMode ? CPA_RECORD_HOLD : 0) | (session->probeMode ? CPA_RECORD_PROBE : 0)
+		| (session->eogMode ? CPA_RECORD_EOG : 0) | (recorder->truncated ? CPA_RECORD_TRUNCATED : 0);
+	header.silenceThreshold = silenceThreshold;
+	header.totalAnalysisTime = totalAnalysisTime;
+	header.impairRand = impairRand;
+	header.result = session->result;
+	header.resultTime = session->resultTime;
+	header.created = recorder->start.tv_sec;
+	ast_copy_string(header.uniqueid, uniqueid, sizeof(header.uniqueid));
+	ast_copy_string(header.profile, session->profile->name, sizeof(header.profile));
+	if (session->impairment) {
+		ast_copy_string(header.impairment, session->impairment->name, sizeof(header.impairment));
+	}
+	header.numZones = session->numZones;
+	for (i = 0; i < session->numZones; i++) {
+		ast_copy_string(header.zones[i], session->zones[i].name, sizeof(header.zones[i]));
+	}
+
+	if (!(fp = fopen(filename, "w"))) {
+		ast_log(LOG_WARNING, "CPA: Unable to write recording '%s': %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, fp) != 1
+		|| (recorder->len && fwrite(recorder->buf, recorder->len, 1, fp) != 1)
+		|| fclose(fp)) {
+		ast_log(LOG_WARNING, "CPA: Unable to write recording '%s': %s\n", filename, strerror(errno));
+		unlink(filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*! Most audio (ms) the analysis loop batches up in one wakeup */
+#define CPA_MAX_BATCH_MS 200
+
+/*! Most frames in one batch, 5ms frames filling CPA_MAX_BATCH_MS */
+#define CPA_MAX_BATCH_FRAMES (CPA_MAX_BATCH_MS / 5)
+
+/*! \brief Signed linear audio drained from a channel in one wakeup */
+struct cpa_batch {
+	struct ast_frame frame;
+	int16_t samples[CPA_MAX_BATCH_MS * DEFAULT_SAMPLES_PER_MS];
+	int frameSamples[CPA_MAX_BATCH_FRAMES];	/*!< Length of each frame appended, they are fed one by one */
+	int numFrames;
+	struct ast_frame *pending;	/*!< Read while draining but not batched, handled on the next wakeup */
+};
+
+/*!
+ * \brief Add a voice frame to a batch
+ *
+ * \retval 0 on success
+ * \retval -1 if the frame is not signed linear or does not fit
+ */
+static int cpa_batch_append(struct cpa_batch *batch, const struct ast_frame *f)
+{
+	if (!batch->frame.samples) {
+		batch->numFrames = 0;
+	}
+	if (ast_format_cmp(f->subclass.format, ast_format_slin) != AST_FORMAT_CMP_EQUAL
+		|| batch->frame.samples + f->samples > (int) ARRAY_LEN(batch->samples)
+		|| batch->numFrames == CPA_MAX_BATCH_FRAMES) {
+		return -1;
+	}
+
+	if (!batch->frame.samples) {
+		memset(&batch->frame, 0, sizeof(batch->frame));
+		batch->frame.frametype = AST_FRAME_VOICE;
+		batch->frame.subclass.format = ast_format_slin;
+		batch->frame.data.ptr = batch->samples;
+		batch->frame.src = "CPA";
+	}
+	memcpy(batch->samples + batch->frame.samples, f->data.ptr, f->samples * 2);
+	batch->frame.samples += f->samples;
+	batch->frame.datalen = batch->frame.samples * 2;
+	batch->frameSamples[batch->numFrames++] = f->samples;
+
+	return 0;
+}
+
+/*!
+ * \brief Feed a batch to a session
+ *
+ * The detectors run once over the whole batch, what counts frames still
+ * sees each frame as it was read.
+ *
+ * \return the verdict, CPA_RESULT_NONE while undecided
+ */
+static enum cpa_result cpa_session_feed_batch(struct cpa_session *session, struct cpa_batch *batch)
+{
+	return cpa_session_feed_block(session, &batch->frame, batch->frameSamples, batch->numFrames);
+}
+
+/*!
+ * \brief Drain the voice frames already queued on a channel into a batch
+ *
+ * Never waits, so the batch holds at most the audio that arrived while we
+ * were busy, bounded by maxBatchMs. Anything that is not voice, or voice
+ * that does not fit, ends the drain and is kept in the batch's pending
+ * frame for the next wakeup, it has been read already. Frames taken are
+ * added to recorder, which may be NULL.
+ *
+ * \retval 0 on success
+ * \retval -1 if the channel hung up
+ */
+static int cpa_batch_drain(struct ast_channel *chan, struct cpa_batch *batch, int maxBatchMs, struct cpa_recorder *recorder)
+{
+	struct ast_frame *f;
+
+	while (batch->frame.samples < maxBatchMs * DEFAULT_SAMPLES_PER_MS && ast_waitfor(chan, 0) > 0) {
+		if (!(f = ast_read(chan))) {
+			cpa_record(recorder, CPA_RECORD_HANGUP, NULL);
+			return -1;
+		}
+		if (f->frametype == AST_FRAME_NULL) {
+			cpa_record(recorder, CPA_RECORD_FRAME, f);
+			ast_frfree(f);
+			continue;
+		}
+		if (f->frametype != AST_FRAME_VOICE || cpa_batch_append(batch, f)) {
+			/* Recorded when it is handled */
+			batch->pending = f;
+			break;
+		}
+		cpa_record(recorder, CPA_RECORD_FRAME, f);
+		ast_frfree(f);
+	}
+
+	return 0;
+}
+
+static void callProgress(struct ast_channel *chan, const char *data)
+{
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	int res = 0;
+	struct ast_frame *f = NULL;
+	struct cpa_session localSession;
+	struct cpa_session *session = NULL;
+	int dtmf = -1;
+	RAII_VAR(struct ast_format *, readFormat, NULL, ao2_cleanup);
+	char *parse = ast_strdupa(data);
+	const char *destination;
+	struct ast_flags flags = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	struct timeval start, lastMediaCheck;
+	int rxCount = -1, rx;
+	int analysisStart;
+	struct cpa_batch batch;
+	int maxBatchMs = cfg ? MIN(cfg->maxBatchMs, CPA_MAX_BATCH_MS) : 0;
+	int hungUp = 0;
+	const char *profileName;
+	char autoTrunk[AST_MAX_CONTEXT] = "";
+	char autoProfile[AST_MAX_CONTEXT];
+	struct cpa_recorder recorder = { NULL, };
+	struct cpa_recorder *rec = NULL;
+	unsigned int impairRand;
+
+	/* Lets set the initial values of the variables that will control the algorithm.
+	   The initial values are the default ones. If they are passed as arguments
+	   when invoking the application, then the default values will be overwritten
+	   by the ones passed as parameters. */
+	int maxWaitTimeForFrame  = dfltMaxWaitTimeForFrame;
+	int silenceThreshold     = -1;
+	int totalAnalysisTime    = dfltTotalAnalysisTime;
+	int dtmfWait 	  		 = dfltDTMFWait;
+
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(argSilenceThreshold);
+		AST_APP_ARG(argTotalAnalysisTime);
+		AST_APP_ARG(argDTMFWait);
+		AST_APP_ARG(argProfile);
+		AST_APP_ARG(argOptions);
+	);
+
+	if (!ast_strlen_zero(parse)) {
+		/* Some arguments have been passed. Lets parse them and overwrite the defaults. */
+		AST_STANDARD_APP_ARGS(args, parse);
+		if (!ast_strlen_zero(args.argSilenceThreshold))
+			silenceThreshold = atoi(args.argSilenceThreshold);
+		if (!ast_strlen_zero(args.argTotalAnalysisTime))
+			totalAnalysisTime = atoi(args.argTotalAnalysisTime);
+		if (!ast_strlen_zero(args.argDTMFWait))
+			dtmfWait = atoi(args.argDTMFWait);
+		if (!ast_strlen_zero(args.argOptions))
+			ast_app_parse_options(cpa_opts, &flags, opts, args.argOptions);
+	} else {
+		ast_debug(1, "CPA using the default parameters.\n");
+	}
+
+	if (maxWaitTimeForFrame > totalAnalysisTime)
+		maxWaitTimeForFrame = totalAnalysisTime;
+
+	/* Set read format to signed linear so we get signed linear frames in */
+	readFormat = ao2_bump(ast_channel_readformat(chan));
+	if (ast_set_read_format(chan, ast_format_slin) < 0 ) {
+		ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to set to linear mode, giving up\n", ast_channel_name(chan));
+		pbx_builtin_setvar_helper(chan , "CPASTATUS", "NOTSLIN");
+		return;
+	}
+
+	ast_channel_lock(chan);
+	destination = ast_strdupa(S_OR(pbx_builtin_getvar_helper(chan, "CPADESTINATION"),
+		S_COR(ast_channel_connected(chan)->id.number.valid, ast_channel_connected(chan)->id.number.str, "")));
+	ast_channel_unlock(chan);
+
+	profileName = args.argProfile;
+	if (!strcasecmp(S_OR(profileName, ""), "auto")) {
+		if (cfg && cfg->numAutoProfiles) {
+			cpa_channel_trunk(chan, autoTrunk, sizeof(autoTrunk));
+			cpa_auto_select(cfg, autoTrunk, autoProfile, sizeof(autoProfile));
+			profileName = autoProfile;
+			ast_verb(3, "CPA: Channel [%s] on trunk [%s] runs profile [%s]\n", ast_channel_name(chan), autoTrunk, profileName);
+		} else {
+			ast_log(LOG_WARNING, "CPA: Profile auto needs auto_profiles in cpa.conf, using the default\n");
+			profileName = NULL;
+		}
+		pbx_builtin_setvar_helper(chan, "CPAPROFILE", S_OR(profileName, "default"));
+	}
+
+	if (ast_test_flag(&flags, OPT_RESUME)) {
+		session = cpa_session_resume(chan, profileName, silenceThreshold, totalAnalysisTime, destination);
+	} else if (!cpa_session_init(&localSession, profileName, destination, silenceThreshold, totalAnalysisTime)) {
+		/* Create a new DSP for call progress */
+		session = &localSession;
+	}
+	if (!session) {
+		ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to create DSP :(\n", ast_channel_name(chan));
+		pbx_builtin_setvar_helper(chan , "CPASTATUS", "NODETECTOR");
+		return;
+	}
+	session->chan = chan;
+	analysisStart = session->iTotalTime;
+	/* Listed while it runs, a resumed session was taken off the list when it was parked */
+	cpa_registry_add(session);
+
+	if (cfg && !ast_strlen_zero(cfg->featureFile) && cpa_session_features_alloc(session)) {
+		ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to record features\n", ast_channel_name(chan));
+	}
+
+	if (ast_test_flag(&flags, OPT_IMPAIR) && !ast_strlen_zero(opts[OPT_ARG_IMPAIR]) && !session->impairment) {
+		cpa_session_impair(session, opts[OPT_ARG_IMPAIR]);
+	}
+	impairRand = session->impairRand;
+
+	session->probeMode = ast_test_flag(&flags, OPT_PROBE) ? 1 : 0;
+
+	session->eogMode = ast_test_flag(&flags, OPT_EOG) ? 1 : 0;
+	memset(&session->eog, 0, sizeof(session->eog));
+	session->eog.end = -1;
+
+	/* A resumed session runs in whatever mode this call asks for */
+	session->holdMode = ast_test_flag(&flags, OPT_HOLD) ? 1 : 0;
+	if (session->holdMode) {
+		/* Hold can last far longer than any tone analysis */
+		totalAnalysisTime = 1000 * (!ast_strlen_zero(opts[OPT_ARG_HOLD]) ? atoi(opts[OPT_ARG_HOLD]) : session->profile->holdMaxTime);
+		session->totalAnalysisTime = analysisStart + totalAnalysisTime;
+	}
+
+	/* Now we're ready to roll! */
+	ast_verb(3, "CPA: maxWaitTimeForFrame [%d] silenceThreshold [%d] totalAnalysisTime [%d] dtmfWait [%d] profile [%s] zones [%d] shadows [%d]\n",
+				maxWaitTimeForFrame, session->threshSilence * 20, totalAnalysisTime, dtmfWait, session->profile->name, session->numZones, session->numShadows);
+
+	/* First, if DTMF Wait is greater than 0, wait that many ms for DTMF to determine if there is an attempted phreak attack */
+/*	if (dtmfWait > 0) {
+		ast_debug(1, "CPA: Waiting for DTMF on Channel [%s] for [%d]ms.\n", ast_channel_name(chan), dtmfWait);
+		dtmf = ast_waitfordigit(chan, dtmfWait);
+		if (dtmf) {
+			ast_verb(3, "CPA: Channel [%s] has incoming DTMF, Digit received: [%d]\n", ast_channel_name(chan), dtmf);
+			strcpy(cpaStatus , "FoundDTMF");
+			res = 1;
+		} else {
+			ast_debug(1, "CPA: No DTMF detected on Channel [%s] after [%d]ms\n", ast_channel_name(chan), dtmfWait);
+		}
+	}*/
+
+	/* Without RTP there is nothing to watch, the frames will have to tell */
+	start = lastMediaCheck = ast_tvnow();
+
+	/* A resumed session started before we could record it */
+	if (cfg && !ast_strlen_zero(cfg->recordDir) && session == &localSession
+		&& (int) (ast_random() % 100) < cfg->recordSamplePercent) {
+		recorder.start = start;
+		rec = &recorder;
+	}
+	if (cfg && cfg->noMediaGrace > 0) {
+		rxCount = cpa_rtp_rxcount(chan);
+	}
+
+	/* Now we go into a loop waiting for frames from the channel */
+	batch.pending = NULL;
+	while (batch.pending || (res = ast_waitfor(chan, 2 * maxWaitTimeForFrame)) > -1) {
+		if (rxCount >= 0 && ast_tvdiff_ms(ast_tvnow(), lastMediaCheck) >= cfg->noMediaGrace) {
+			/* Checked every grace period so media that stops later is caught too */
+			if ((rx = cpa_rtp_rxcount(chan)) == rxCount) {
+				ast_verb(3, "CPA: Channel [%s]. No RTP received in [%d]ms\n", ast_channel_name(chan), cfg->noMediaGrace);
+				cpa_record(rec, CPA_RECORD_NOMEDIA, NULL);
+				cpa_session_finish(session, CPA_RESULT_NOMEDIA);
+				break;
+			}
+			rxCount = rx;
+			lastMediaCheck = ast_tvnow();
+		}
+
+		if (!res) {
+			/* A channel that never sends a frame must not keep us here past the analysis time */
+			if (ast_tvdiff_ms(ast_tvnow(), start) >= totalAnalysisTime + 2 * maxWaitTimeForFrame) {
+				cpa_record(rec, CPA_RECORD_EXPIRED, NULL);
+				if (session->iTotalTime != analysisStart) {
+					cpa_session_finish(session, session->provisional != CPA_RESULT_NONE ? session->provisional : CPA_RESULT_TIMEOUT);
+				}
+				break;
+			}
+			cpa_record(rec, CPA_RECORD_WAITFOR, NULL);
+			continue;
+		}
+
+		/* A frame the last drain read but could not batch comes first */
+		if (batch.pending) {
+			f = batch.pending;
+			batch.pending = NULL;
+		} else if (!(f = ast_read(chan))) {
+			/* If we fail to read in a frame, that means they hung up */
+			cpa_record(rec, CPA_RECORD_HANGUP, NULL);
+			ast_verb(3, "CPA: Channel [%s]. Hungup\n", ast_channel_name(chan));
+			ast_debug(1, "Got hangup\n");
+			cpa_session_finish(session, CPA_RESULT_HUNGUP);
+			break;
+		}
+
+		ast_debug(1, "CPA checking frametype: [%d].\n", f->frametype);
+		cpa_record(rec, CPA_RECORD_FRAME, f);
+
+		if (f->frametype == AST_FRAME_DTMF_BEGIN || f->frametype == AST_FRAME_DTMF_END){
+			ast_verb(3, "CPA: Channel [%s] has incoming DTMF, Digit received: [%d]\n", ast_channel_name(chan), f->subclass.integer);
+			cpa_session_finish(session, CPA_RESULT_FOUNDDTMF);
+			ast_frfree(f);
+			break;
+		}
+
+		if (f->frametype != AST_FRAME_VOICE) {
+			ast_frfree(f);
+			continue;
+		}
+
+		/* Bursty delivery queues several frames per wakeup, take them all in one go */
+		batch.frame.samples = 0;
+		if (maxBatchMs > 0 && !cpa_batch_append(&batch, f)) {
+			ast_frfree(f);
+			hungUp = cpa_batch_drain(chan, &batch, maxBatchMs, rec);
+			f = &batch.frame;
+		}
+
+		cpa_record(rec, CPA_RECORD_FEED, NULL);
+		if ((f == &batch.frame ? cpa_session_feed_batch(session, &batch) : cpa_session_feed(session, f)) != CPA_RESULT_NONE) {
+			if (session->result == CPA_RESULT_TIMEOUT || session->result == CPA_RESULT_SILENCE) {
+				ast_verb(3, "CPA: Channel [%s]. Detection Timeout...\n", ast_channel_name(chan));
+			}
+			ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpa_result_names[session->result]);
+		} else if (hungUp) {
+			ast_verb(3, "CPA: Channel [%s]. Hungup\n", ast_channel_name(chan));
+			cpa_session_finish(session, CPA_RESULT_HUNGUP);
+		}
+
+		if (f != &batch.frame) {
+			ast_frfree(f);
+		}
+		if (session->result != CPA_RESULT_NONE) {
+			break;
+		}
+	}
+
+	if (batch.pending) {
+		/* Read after the verdict, it goes the way of any frame read past it */
+		ast_frfree(batch.pending);
+		batch.pending = NULL;
+	}
+
+	if (session->result == CPA_RESULT_NONE) {
+		/* There was no frame to analyze, something's wrong with the channel!. */
+		ast_verb(3, "CPA: No Frames Collected for Channel [%s], something is wrong with this channel.\n", ast_channel_name(chan));
+		cpa_session_finish(session, CPA_RESULT_NOFRAMES);
+	}
+
+	/* Set the status and cause on the channel */
+	pbx_builtin_setvar_helper(chan , "CPASTATUS" , cpa_result_names[session->result]);
+	if (session->profile->numZones) {
+		pbx_builtin_setvar_helper(chan, "CPAZONE", session->zone < 0 ? "" : session->zones[session->zone].name);
+	}
+	if (session->profile->cadence) {
+		char period[16] = "";
+
+		if (session->cadence.period && session->result == CPA_RESULT_RINGING) {
+			snprintf(period, sizeof(period), "%d", session->cadence.period);
+		}
+		pbx_builtin_setvar_helper(chan, "CPARINGPERIOD", period);
+	}
+	if (session->profile->numKeywords) {
+		pbx_builtin_setvar_helper(chan, "CPAKEYWORD", session->keyword < 0 ? "" : session->profile->keywords[session->keyword].phrase);
+	}
+	if (session->eogMode && !session->holdMode) {
+		char eog[16] = "";
+
+		if (session->result == CPA_RESULT_TALKING || session->result == CPA_RESULT_MACHINE) {
+			cpa_session_wait_eog(session, session->profile->eogMaxWait);
+		}
+		if (session->eog.end >= 0) {
+			snprintf(eog, sizeof(eog), "%d", MAX(session->eog.end - analysisStart, 0));
+			ast_verb(3, "CPA: Channel [%s] greeting ended at [%s]ms\n", ast_channel_name(chan), eog);
+		}
+		pbx_builtin_setvar_helper(chan, "CPAEOG", eog);
+	}
+	ast_verb(3, "CPA: Channel [%s] - Frame Length: [%d] - iTotalTime: [%d] - CPAStatus: [%s]\n", ast_channel_name(chan), session->framelength, session->iTotalTime, cpa_result_names[session->result]);
+
+	/* A resumed session's timeline includes the earlier calls, only this one's wait counts */
+	cpa_stats_verdict(session->result, session->resultTime - analysisStart);
+	cpa_trunk_verdict(chan, session->result);
+	cpa_session_report_shadows(chan, session);
+	cpa_session_learn(session);
+	if (session->features && cfg && !ast_strlen_zero(cfg->featureFile)) {
+		const char *label;
+
+		ast_channel_lock(chan);
+		label = ast_strdupa(S_OR(pbx_builtin_getvar_helper(chan, "CPALABEL"), ""));
+		ast_channel_unlock(chan);
+		cpa_features_append(cfg->featureFile, session, ast_channel_uniqueid(chan), label);
+		cpa_session_features_free(session);
+	}
+	if (rec) {
+		char filename[PATH_MAX];
+
+		snprintf(filename, sizeof(filename), "%s/%s.cparec", cfg->recordDir, ast_channel_uniqueid(chan));
+		if (!cpa_recorder_write(rec, filename, session, ast_channel_uniqueid(chan), session->threshSilence * 20,
+			session->totalAnalysisTime - analysisStart, impairRand)) {
+			pbx_builtin_setvar_helper(chan, "CPARECORDING", filename);
+		}
+		ast_free(recorder.buf);
+	}
+	if (!ast_strlen_zero(autoTrunk)) {
+		cpa_auto_record(autoTrunk, autoProfile, ast_channel_uniqueid(chan), session->result,
+			session->resultTime - analysisStart);
+	}
+
+	if (session->probe.state == CPA_PROBE_PLAYING) {
+		ast_playtones_stop(chan);
+	}
+
+	/* Restore channel read format */
+	if (readFormat && ast_set_read_format(chan, readFormat))
+		ast_log(LOG_WARNING, "CPA: Unable to restore read format on '%s'\n", ast_channel_name(chan));
+
+	/* Free the DSP used to detect silence, a resumable session lives on in its datastore */
+	if (session == &localSession) {
+		cpa_session_destroy(session);
+	} else {
+		/* Parked until the next CPA(...,R), nothing is analysing it */
+		cpa_registry_remove(session);
+	}
+
+	return;
+}
+
+void cpa2str(char cpaString[256], int cpa)
+{
+	//char cpaString[256] = "";
+	switch (cpa) {
+		case 0:
+			strcpy(cpaString, "Silence");
+			break;
+		case AST_CONTROL_HANGUP:
+			strcpy(cpaString, "Hangup");
+			break;			
+		case AST_CONTROL_RINGING:
+			strcpy(cpaString, "Ringing");
+			break;
+		case AST_CONTROL_ANSWER:
+			strcpy(cpaString, "Answer");
+			break;
+		case AST_CONTROL_BUSY:
+			strcpy(cpaString, "Busy");
+			break;
+		case AST_CONTROL_CONGESTION:
+			strcpy(cpaString, "Congestion");
+			break;
+		case -1:
+			strcpy(cpaString, "Negative One! Uh Oh!!!");
+			break;
+		default:
+			ast_log(LOG_WARNING, "Unknown CPA: '%d'", cpa);
+			strcpy(cpaString, "Unknown");
+
+		}
+}
+
+void tone2str(char toneString[256], int tone)
+{
+	//char cpaString[256] = "";
+	switch (tone) {
+		case DSP_TONE_STATE_SILENCE:
+			strcpy(toneString, "Silence");
+			break;
+		case DSP_TONE_STATE_HUNGUP:
+			strcpy(toneString, "Hungup");
+			break;			
+		case DSP_TONE_STATE_DIALTONE:
+			strcpy(toneString, "Dialtone");
+			break;
+		case DSP_TONE_STATE_RINGING:
+			strcpy(toneString, "Ringing");
+			break;
+		case DSP_TONE_STATE_TALKING:
+			strcpy(toneString, "Talking");
+			break;
+		case DSP_TONE_STATE_BUSY:
+			strcpy(toneString, "Busy");
+			break;
+		case DSP_TONE_STATE_SPECIAL1:
+			strcpy(toneString, "Special1");
+			break;
+		case DSP_TONE_STATE_SPECIAL2:
+			strcpy(toneString, "Special2");
+			break;
+		case DSP_TONE_STATE_SPECIAL3:
+			strcpy(toneString, "Special3");
+			break;						
+		case -1:
+			strcpy(toneString, "Negative One! Uh Oh!!!");
+			break;
+		default:
+			ast_log(LOG_WARNING, "Unknown Tone: '%d'", tone);
+			strcpy(toneString, "Unknown");
+
+		}
+}
+
+static int cpa_exec(struct ast_channel *chan, const char *data)
+{
+	callProgress(chan, data);
+
+	return 0;
+}
+
+/*! Most legs CPADial() forks to */
+#define CPA_MAX_LEGS 8
+
+/*! \brief One forked leg of CPADial() */
+struct cpa_leg {
+	struct ast_channel *chan;
+	char interface[256];
+	char *resource;
+	int answered;
+	int cause;		/*!< Why the leg failed, 0 while it is still in the race */
+	struct ast_format *readFormat;	/*!< Read format before analysis, given back for the bridge */
+	struct cpa_session session;
+};
+
+/*! \brief Hang up a leg that lost the race */
+static void cpa_leg_hangup(struct cpa_leg *leg, int cause)
+{
+	if (!leg->chan) {
+		return;
+	}
+	if (leg->answered) {
+		cpa_session_destroy(&leg->session);
+	}
+	ao2_cleanup(leg->readFormat);
+	leg->readFormat = NULL;
+	ast_channel_hangupcause_set(leg->chan, cause);
+	ast_hangup(leg->chan);
+	leg->chan = NULL;
+	if (!leg->cause) {
+		leg->cause = cause;
+	}
+}
+
+/*!
+ * \brief Start call progress analysis on a leg that just answered
+ *
+ * \retval 0 on success
+ * \retval -1 if the leg cannot be analysed and should be dropped
+ */
+static int cpa_leg_answered(struct cpa_leg *leg, const char *profile, int totalAnalysisTime)
+{
+	leg->answered = 1;
+
+	/* A leg restarted after ringing is already in slin, keep the format it came up with */
+	if (!leg->readFormat) {
+		leg->readFormat = ao2_bump(ast_channel_readformat(leg->chan));
+	}
+	if (ast_set_read_format(leg->chan, ast_format_slin) < 0) {
+		ast_log(LOG_WARNING, "CPADial: Leg [%s]. Unable to set to linear mode\n", ast_channel_name(leg->chan));
+		leg->answered = 0;
+		return -1;
+	}
+	if (cpa_session_init(&leg->session, profile, leg->resource, -1, totalAnalysisTime)) {
+		ast_log(LOG_WARNING, "CPADial: Leg [%s]. Unable to create DSP\n", ast_channel_name(leg->chan));
+		leg->answered = 0;
+		return -1;
+	}
+	leg->session.chan = leg->chan;
+	cpa_registry_add(&leg->session);
+
+	ast_verb(3, "CPADial: Leg [%s] answered, analysing\n", ast_channel_name(leg->chan));
+	return 0;
+}
+
+/*!
+ * \brief Handle a frame from a forked leg
+ *
+ * \return the leg's verdict once it has one, CPA_RESULT_NONE while undecided
+ */
+static enum cpa_result cpa_leg_frame(struct cpa_leg *leg, struct ast_frame *f, const char *profile, int totalAnalysisTime)
+{
+	enum cpa_result result = CPA_RESULT_NONE;
+
+	switch (f->frametype) {
+	case AST_FRAME_CONTROL:
+		switch (f->subclass.integer) {
+		case AST_CONTROL_ANSWER:
+			if (!leg->answered && cpa_leg_answered(leg, profile, totalAnalysisTime)) {
+				cpa_leg_hangup(leg, AST_CAUSE_NORMAL_CLEARING);
+			}
+			break;
+		case AST_CONTROL_BUSY:
+			cpa_leg_hangup(leg, AST_CAUSE_BUSY);
+			break;
+		case AST_CONTROL_CONGESTION:
+			cpa_leg_hangup(leg, AST_CAUSE_CONGESTION);
+			break;
+		}
+		break;
+	case AST_FRAME_VOICE:
+		if (!leg->answered) {
+			/* Some channel drivers never queue the answer, early media only counts once we are up */
+			if (ast_channel_state(leg->chan) != AST_STATE_UP) {
+				break;
+			}
+			if (cpa_leg_answered(leg, profile, totalAnalysisTime)) {
+				cpa_leg_hangup(leg, AST_CAUSE_NORMAL_CLEARING);
+				break;
+			}
+		}
+		result = cpa_session_feed(&leg->session, f);
+		break;
+	default:
+		break;
+	}
+
+	return result;
+}
+
+/*!
+ * \brief Fork a call to several destinations and keep the first human
+ *
+ * Every leg that answers gets its own CPA session and they are all served
+ * from this one thread. The first leg to reach Talking is bridged to the
+ * caller and the rest are hung up as answered elsewhere. Ringing after
+ * answer (a PBX still hunting) restarts that leg's analysis, any other
+ * verdict drops the leg.
+ */
+static int cpadial_exec(struct ast_channel *chan, const char *data)
+{
+	struct cpa_leg legs[CPA_MAX_LEGS];
+	struct ast_channel *watch[CPA_MAX_LEGS + 1];
+	struct ast_channel *active;
+	struct cpa_leg *winner = NULL;
+	struct ast_bridge_config config;
+	struct ast_frame *f;
+	struct timeval start = ast_tvnow();
+	char *parse = ast_strdupa(S_OR(data, ""));
+	char *interfaces, *interface;
+	const char *dialStatus = "NOANSWER";
+	int timeout = 30000;
+	int numLegs = 0, live, busy = 0, ringing = 0;
+	int res = 0, i, ms;
+
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(argInterfaces);
+		AST_APP_ARG(argTimeout);
+		AST_APP_ARG(argProfile);
+	);
+
+	AST_STANDARD_APP_ARGS(args, parse);
+	if (ast_strlen_zero(args.argInterfaces)) {
+		ast_log(LOG_WARNING, "CPADial requires an argument (Tech1/dest1[&Tech2/dest2...])\n");
+		return -1;
+	}
+	if (!ast_strlen_zero(args.argTimeout) && atoi(args.argTimeout) > 0) {
+		timeout = atoi(args.argTimeout) * 1000;
+	}
+
+	memset(legs, 0, sizeof(legs));
+
+	interfaces = args.argInterfaces;
+	while ((interface = strsep(&interfaces, "&"))) {
+		struct cpa_leg *leg = &legs[numLegs];
+		char *tech = ast_strip(interface);
+		int cause = 0;
+
+		if (ast_strlen_zero(tech)) {
+			continue;
+		}
+		if (numLegs == CPA_MAX_LEGS) {
+			ast_log(LOG_WARNING, "CPADial: Only %d legs are supported, ignoring '%s'\n", CPA_MAX_LEGS, tech);
+			break;
+		}
+
+		ast_copy_string(leg->interface, tech, sizeof(leg->interface));
+		if (!(leg->resource = strchr(leg->interface, '/'))) {
+			ast_log(LOG_WARNING, "CPADial: Dial argument takes format (technology/resource), ignoring '%s'\n", tech);
+			continue;
+		}
+		numLegs++;
+
+		/* Split the copy in interface so the tech and resource can be used on their own */
+		*leg->resource++ = '\0';
+		leg->chan = ast_request(leg->interface, ast_channel_nativeformats(chan), NULL, chan, leg->resource, &cause);
+		*(leg->resource - 1) = '/';
+		if (!leg->chan) {
+			ast_log(LOG_WARNING, "CPADial: Unable to create channel '%s' (cause %d)\n", leg->interface, cause);
+			leg->cause = cause ? cause : AST_CAUSE_CONGESTION;
+			continue;
+		}
+
+		/* Present the caller to the far end the way Dial() does */
+		ast_channel_lock_both(leg->chan, chan);
+		ast_channel_inherit_variables(chan, leg->chan);
+		ast_connected_line_copy_from_caller(ast_channel_connected(leg->chan), ast_channel_caller(chan));
+		ast_party_redirecting_copy(ast_channel_redirecting(leg->chan), ast_channel_redirecting(chan));
+		ast_channel_dialed(leg->chan)->transit_network_select = ast_channel_dialed(chan)->transit_network_select;
+		ast_channel_req_accountcodes(leg->chan, chan, AST_CHANNEL_REQUESTOR_BRIDGE_PEER);
+		ast_channel_unlock(chan);
+		ast_channel_unlock(leg->chan);
+
+		if (ast_call(leg->chan, leg->resource, 0)) {
+			ast_log(LOG_WARNING, "CPADial: Unable to call '%s'\n", leg->interface);
+			cpa_leg_hangup(leg, AST_CAUSE_CONGESTION);
+			continue;
+		}
+		ast_verb(3, "CPADial: Called %s\n", leg->interface);
+	}
+
+	for (;;) {
+		ms = timeout - ast_tvdiff_ms(ast_tvnow(), start);
+		watch[0] = chan;
+		for (i = 0, live = 1; i < numLegs; i++) {
+			if (legs[i].chan) {
+				watch[live++] = legs[i].chan;
+			}
+		}
+		if (live == 1 || ms <= 0) {
+			break;
+		}
+
+		if (!(active = ast_waitfor_n(watch, live, &ms))) {
+			continue;
+		}
+
+		if (active == chan) {
+			/* The caller only matters if they give up */
+			if (!(f = ast_read(chan))) {
+				ast_verb(3, "CPADial: Caller [%s] hung up\n", ast_channel_name(chan));
+				dialStatus = "CANCEL";
+				res = -1;
+				break;
+			}
+			ast_frfree(f);
+			continue;
+		}
+
+		for (i = 0; i < numLegs; i++) {
+			struct cpa_leg *leg = &legs[i];
+			enum cpa_result result;
+
+			if (leg->chan != active) {
+				continue;
+			}
+			if (!(f = ast_read(leg->chan))) {
+				cpa_leg_hangup(leg, AST_CAUSE_NORMAL_CLEARING);
+				break;
+			}
+			if (!ringing && f->frametype == AST_FRAME_CONTROL && f->subclass.integer == AST_CONTROL_RINGING
+				&& !leg->answered) {
+				/* Let the caller hear it once, later legs ringing change nothing for them */
+				ast_verb(3, "CPADial: Leg [%s] is ringing\n", ast_channel_name(leg->chan));
+				ast_indicate(chan, AST_CONTROL_RINGING);
+				ringing = 1;
+			}
+			result = cpa_leg_frame(leg, f, args.argProfile, dfltTotalAnalysisTime);
+			ast_frfree(f);
+
+			if (result == CPA_RESULT_NONE) {
+				break;
+			}
+			ast_verb(3, "CPADial: Leg [%s] returned [%s] at [%d]ms\n", ast_channel_name(leg->chan),
+				cpa_result_names[result], leg->session.resultTime);
+			cpa_stats_verdict(result, leg->session.resultTime);
+			cpa_trunk_verdict(leg->chan, result);
+
+			if (result == CPA_RESULT_TALKING) {
+				winner = leg;
+			} else if (result == CPA_RESULT_RINGING) {
+				/* Still hunting behind the answer, start over on this leg */
+				cpa_session_destroy(&leg->session);
+				if (cpa_leg_answered(leg, args.argProfile, dfltTotalAnalysisTime)) {
+					cpa_leg_hangup(leg, AST_CAUSE_NORMAL_CLEARING);
+				}
+			} else {
+				cpa_leg_hangup(leg, result == CPA_RESULT_BUSY ? AST_CAUSE_BUSY : AST_CAUSE_NORMAL_CLEARING);
+			}
+			break;
+		}
+		if (winner) {
+			break;
+		}
+	}
+
+	for (i = 0; i < numLegs; i++) {
+		if (&legs[i] == winner) {
+			continue;
+		}
+		cpa_leg_hangup(&legs[i], winner ? AST_CAUSE_ANSWERED_ELSEWHERE : AST_CAUSE_NO_ANSWER);
+		if (legs[i].cause == AST_CAUSE_BUSY) {
+			busy++;
+		}
+	}
+
+	if (!winner) {
+		if (!numLegs) {
+			dialStatus = "CHANUNAVAIL";
+		} else if (busy == numLegs) {
+			dialStatus = "BUSY";
+		}
+		pbx_builtin_setvar_helper(chan, "CPADIALSTATUS", dialStatus);
+		return res;
+	}
+
+	ast_verb(3, "CPADial: Leg [%s] reached a human, bridging to [%s]\n", ast_channel_name(winner->chan), ast_channel_name(chan));
+	pbx_builtin_setvar_helper(chan, "CPADIALSTATUS", "ANSWER");
+	pbx_builtin_setvar_helper(chan, "CPADIALLEG", winner->interface);
+	pbx_builtin_setvar_helper(chan, "CPASTATUS", cpa_result_names[winner->session.result]);
+	cpa_session_learn(&winner->session);
+	cpa_session_destroy(&winner->session);
+
+	/* Analysis wanted slin, the bridge should see the leg as it came up */
+	if (winner->readFormat && ast_set_read_format(winner->chan, winner->readFormat) < 0) {
+		ast_log(LOG_WARNING, "CPADial: Leg [%s]. Unable to restore read format\n", ast_channel_name(winner->chan));
+	}
+	ao2_cleanup(winner->readFormat);
+	winner->readFormat = NULL;
+
+	if (ast_channel_state(chan) != AST_STATE_UP && ast_answer(chan)) {
+		ast_hangup(winner->chan);
+		return -1;
+	}
+
+	/* The bridge owns the winning leg from here on */
+	memset(&config, 0, sizeof(config));
+	return ast_bridge_call(chan, winner->chan, &config);
+}
+
+/*!
+ * \brief Decode an 8kHz voice frame to signed linear
+ *
+ * For hooks that see the channel's native format rather than the slin
+ * CPA() asks for.
+ *
+ * \return number of samples written, -1 if the format is not analysed
+ */
+static int cpa_frame_slin(const struct ast_frame *frame, int16_t *samples, int max)
+{
+	const unsigned char *payload = frame->data.ptr;
+	int count = MIN(frame->samples, max);
+	int i;
+
+	if (ast_format_cmp(frame->subclass.format, ast_format_ulaw) == AST_FORMAT_CMP_EQUAL) {
+		for (i = 0; i < count; i++) {
+			samples[i] = AST_MULAW(payload[i]);
+		}
+	} else if (ast_format_cmp(frame->subclass.format, ast_format_alaw) == AST_FORMAT_CMP_EQUAL) {
+		for (i = 0; i < count; i++) {
+			samples[i] = AST_ALAW(payload[i]);
+		}
+	} else if (ast_format_cmp(frame->subclass.format, ast_format_slin) == AST_FORMAT_CMP_EQUAL) {
+		memcpy(samples, frame->data.ptr, count * 2);
+	} else {
+		return -1;
+	}
+
+	return count;
+}
+
+/*! Participants the shared monitor pool can watch at once */
+#define CPA_MONITOR_SLOTS 512
+
+/*! Sampled frames a participant can hand over between two sweeps */
+#define CPA_MONITOR_FRAMES 4
+
+/*! Longest frame (samples) that is sampled, 60ms. Longer ones are passed over */
+#define CPA_MONITOR_SAMPLES 480
+
+/*! How often (ms) the monitor thread sweeps the pool */
+#define CPA_MONITOR_INTERVAL 200
+
+enum cpa_monitor_reason {
+	CPA_MONITOR_OK = 0,
+	CPA_MONITOR_MUSIC,	/*!< Hold music, the participant put the conference on hold */
+	CPA_MONITOR_TONE,	/*!< Busy, reorder, dial tone or SIT, the line behind it is gone */
+	CPA_MONITOR_HISS,	/*!< Steady noise from a dead line */
+};
+
+static const char * const cpa_monitor_reasons[] = {
+	[CPA_MONITOR_OK] = "Cleared",
+	[CPA_MONITOR_MUSIC] = "Music",
+	[CPA_MONITOR_TONE] = "Tone",
+	[CPA_MONITOR_HISS] = "Hiss",
+};
+
+enum cpa_monitor_action {
+	CPA_MONITOR_EVENTS = 0,	/*!< Only raise events */
+	CPA_MONITOR_MUTE,	/*!< Replace the participant's audio with null frames while it offends */
+	CPA_MONITOR_DROP,	/*!< Hang the participant up */
+};
+
+/*!
+ * \brief One monitored participant in the shared pool
+ *
+ * The framehook only copies one frame in duty into the slot, everything
+ * else is done by the monitor thread on its next sweep.
+ */
+struct cpa_monitor_slot {
+	ast_mutex_t lock;
+	int inUse;
+	struct ast_channel *chan;	/*!< Reference held while the hook is attached */
+	enum cpa_monitor_action action;
+	int skip;			/*!< Frames left before the next sampled one */
+	int duty;			/*!< monitor_duty, refreshed by the monitor thread so the hook needs no config */
+	int16_t frames[CPA_MONITOR_FRAMES][CPA_MONITOR_SAMPLES];
+	int frameSamples[CPA_MONITOR_FRAMES];	/*!< Samples in each handed over frame */
+	int numFrames;
+	int pendingTime;		/*!< ms of audio the handed over frames stand for */
+	int muted;			/*!< Set by the monitor thread, read by the hook */
+	/* Only used by the monitor thread */
+	struct cpa_tonebank bank;
+	struct cpa_envelope envelope;
+	int toneTime;
+	int musicTime;
+	int hissTime;
+	enum cpa_monitor_reason reason;
+};
+
+static struct cpa_monitor_slot cpaMonitorSlots[CPA_MONITOR_SLOTS];
+AST_MUTEX_DEFINE_STATIC(cpaMonitorLock);
+static ast_cond_t cpaMonitorCond;
+static pthread_t cpaMonitorThread = AST_PTHREADT_NULL;
+static int cpaMonitorStop;
+
+/*! \brief Keeps the framehook id so CPAMonitor() is attached once per channel */
+static const struct ast_datastore_info cpa_monitor_datastore = {
+	.type = "cpa_monitor",
+	.destroy = ast_free_ptr,
+};
+
+/*! \brief Take a free slot for a channel, NULL if the pool is full */
+static struct cpa_monitor_slot *cpa_monitor_claim(struct ast_channel *chan, enum cpa_monitor_action action, int duty)
+{
+	int i;
+
+	ast_mutex_lock(&cpaMonitorLock);
+	for (i = 0; i < CPA_MONITOR_SLOTS; i++) {
+		struct cpa_monitor_slot *slot = &cpaMonitorSlots[i];
+
+		ast_mutex_lock(&slot->lock);
+		if (slot->inUse) {
+			ast_mutex_unlock(&slot->lock);
+			continue;
+		}
+		slot->inUse = 1;
+		slot->chan = ast_channel_ref(chan);
+		slot->action = action;
+		slot->skip = 0;
+		slot->duty = duty;
+		slot->numFrames = 0;
+		slot->pendingTime = 0;
+		slot->muted = 0;
+		memset(&slot->bank, 0, sizeof(slot->bank));
+		memset(&slot->envelope, 0, sizeof(slot->envelope));
+		slot->toneTime = slot->musicTime = slot->hissTime = 0;
+		slot->reason = CPA_MONITOR_OK;
+		ast_mutex_unlock(&slot->lock);
+		ast_mutex_unlock(&cpaMonitorLock);
+		return slot;
+	}
+	ast_mutex_unlock(&cpaMonitorLock);
+
+	return NULL;
+}
+
+static void cpa_monitor_hook_destroy(void *data)
+{
+	struct cpa_monitor_slot *slot = data;
+
+	ast_mutex_lock(&slot->lock);
+	slot->inUse = 0;
+	slot->chan = ast_channel_unref(slot->chan);
+	ast_mutex_unlock(&slot->lock);
+
+	ast_module_unref(ast_module_info->self);
+}
+
+/*!
+ * \brief Read path of a monitored participant
+ *
+ * Runs in the participant's thread for every frame, so it does no more
+ * than count, copy a sampled frame as signed linear, and drop the audio of
+ * a muted participant.
+ */
+static struct ast_frame *cpa_monitor_hook(struct ast_channel *chan, struct ast_frame *frame,
+	enum ast_framehook_event event, void *data)
+{
+	struct cpa_monitor_slot *slot = data;
+	int16_t samples[CPA_MONITOR_SAMPLES];
+	int count, ms;
+
+	if (event != AST_FRAMEHOOK_EVENT_READ || !frame || frame->frametype != AST_FRAME_VOICE) {
+		return frame;
+	}
+
+	if (slot->skip-- <= 0) {
+		if (frame->samples > CPA_MONITOR_SAMPLES || (count = cpa_frame_slin(frame, samples, CPA_MONITOR_SAMPLES)) <= 0) {
+			/* Only 8kHz audio is analysed, and only whole frames */
+			return frame;
+		}
+
+		ms = frame->samples / DEFAULT_SAMPLES_PER_MS;
+
+		ast_mutex_lock(&slot->lock);
+		slot->skip = slot->duty - 1;
+		if (slot->numFrames < CPA_MONITOR_FRAMES) {
+			memcpy(slot->frames[slot->numFrames], samples, count * sizeof(*samples));
+			slot->frameSamples[slot->numFrames++] = count;
+		}
+		/* Frames between the sampled ones count towards it */
+		slot->pendingTime += ms * (slot->skip + 1);
+		ast_mutex_unlock(&slot->lock);
+	}
+
+	/* A stale read only delays the mute by one frame */
+	if (slot->muted) {
+		ast_frfree(frame);
+		return &ast_null_frame;
+	}
+
+	return frame;
+}
+
+/*! \brief Analyse the frames a participant handed over and decide if it offends */
+static enum cpa_monitor_reason cpa_monitor_analyse(struct cpa_monitor_slot *slot, const struct cpa_config *cfg)
+{
+	struct cpa_envelope *env = &slot->envelope;
+	int i, ms, energy, lastEnergy, sampled = 0;
+
+	if (!slot->numFrames) {
+		return slot->reason;
+	}
+	for (i = 0; i < slot->numFrames; i++) {
+		sampled += slot->frameSamples[i];
+	}
+
+	for (i = 0; i < slot->numFrames; i++) {
+		/* Each frame stands for its share of the audio since the last sweep */
+		ms = (int64_t) slot->pendingTime * slot->frameSamples[i] / sampled;
+		cpa_tonebank_process(&slot->bank, slot->frames[i], slot->frameSamples[i]);
+		switch (slot->bank.tstate) {
+		case DSP_TONE_STATE_BUSY:
+		case DSP_TONE_STATE_SPECIAL1:
+		case DSP_TONE_STATE_SPECIAL2:
+		case DSP_TONE_STATE_SPECIAL3:
+		case DSP_TONE_STATE_DIALTONE:
+		case DSP_TONE_STATE_HUNGUP:
+			slot->toneTime += ms;
+			break;
+		case DSP_TONE_STATE_SILENCE:
+			/* The off part of a cadence, forget slowly */
+			slot->toneTime = MAX(slot->toneTime - ms / 4, 0);
+			break;
+		default:
+			slot->toneTime = 0;
+			break;
+		}
+
+		lastEnergy = env->energy;
+		energy = cpa_sample_energy(slot->frames[i], slot->frameSamples[i]);
+		cpa_envelope_update(env, energy, ms);
+
+		/* Hiss holds its level within an eighth from one sample to the next */
+		if (env->voiced && abs(energy - lastEnergy) * 8 < lastEnergy) {
+			slot->hissTime += ms;
+		} else {
+			slot->hissTime = 0;
+		}
+		if (env->gapRun >= CPA_HOLD_GAP || (env->windowReady && env->speechLike)) {
+			slot->musicTime = 0;
+		} else if (env->voiced) {
+			slot->musicTime += ms;
+		}
+	}
+	slot->numFrames = 0;
+	slot->pendingTime = 0;
+
+	if (slot->toneTime >= cfg->monitorToneTime) {
+		return CPA_MONITOR_TONE;
+	} else if (slot->hissTime >= cfg->monitorHissTime) {
+		return CPA_MONITOR_HISS;
+	} else if (slot->musicTime >= cfg->monitorMusicTime) {
+		return CPA_MONITOR_MUSIC;
+	}
+
+	return CPA_MONITOR_OK;
+}
+
+/*! \brief Sweep the pool every CPA_MONITOR_INTERVAL and act on offending participants */
+static void *cpa_monitor_run(void *data)
+{
+	struct cpa_config *cfg;
+	struct timespec ts;
+	struct timeval next;
+	int i;
+
+	ast_mutex_lock(&cpaMonitorLock);
+	while (!cpaMonitorStop) {
+		next = ast_tvadd(ast_tvnow(), ast_samp2tv(CPA_MONITOR_INTERVAL, 1000));
+		ts.tv_sec = next.tv_sec;
+		ts.tv_nsec = next.tv_usec * 1000;
+		ast_cond_timedwait(&cpaMonitorCond, &cpaMonitorLock, &ts);
+		if (cpaMonitorStop) {
+			break;
+		}
+		ast_mutex_unlock(&cpaMonitorLock);
+
+		/* One reference per sweep, a reload takes effect on the next one */
+		if (!(cfg = ao2_global_obj_ref(cpa_globals))) {
+			ast_mutex_lock(&cpaMonitorLock);
+			continue;
+		}
+		for (i = 0; i < CPA_MONITOR_SLOTS; i++) {
+			struct cpa_monitor_slot *slot = &cpaMonitorSlots[i];
+			struct ast_channel *chan = NULL;
+			enum cpa_monitor_reason reason;
+			enum cpa_monitor_action action = CPA_MONITOR_EVENTS;
+
+			ast_mutex_lock(&slot->lock);
+			if (!slot->inUse) {
+				ast_mutex_unlock(&slot->lock);
+				continue;
+			}
+			slot->duty = cfg->monitorDuty;
+			if (!slot->numFrames) {
+				ast_mutex_unlock(&slot->lock);
+				continue;
+			}
+			reason = cpa_monitor_analyse(slot, cfg);
+			if (reason != slot->reason) {
+				slot->reason = reason;
+				action = slot->action;
+				slot->muted = reason != CPA_MONITOR_OK && action == CPA_MONITOR_MUTE;
+				chan = ast_channel_ref(slot->chan);
+			}
+			ast_mutex_unlock(&slot->lock);
+
+			if (!chan) {
+				continue;
+			}
+			ast_verb(3, "CPAMonitor: Channel [%s] %s\n", ast_channel_name(chan), cpa_monitor_reasons[reason]);
+			manager_event(EVENT_FLAG_CALL, "CPAMonitor",
+				"Channel: %s\r\n"
+				"Uniqueid: %s\r\n"
+				"Reason: %s\r\n"
+				"Action: %s\r\n",
+				ast_channel_name(chan), ast_channel_uniqueid(chan), cpa_monitor_reasons[reason],
+				reason == CPA_MONITOR_OK ? (action == CPA_MONITOR_MUTE ? "Unmuted" : "None")
+				: action == CPA_MONITOR_MUTE ? "Muted" : action == CPA_MONITOR_DROP ? "Dropped" : "None");
+			if (reason != CPA_MONITOR_OK && action == CPA_MONITOR_DROP) {
+				ast_softhangup(chan, AST_SOFTHANGUP_EXPLICIT);
+			}
+			ast_channel_unref(chan);
+		}
+		ao2_ref(cfg, -1);
+
+		ast_mutex_lock(&cpaMonitorLock);
+	}
+	ast_mutex_unlock(&cpaMonitorLock);
+
+	return NULL;
+}
+
+/*!
+ * \brief Watch a channel for hold music, dead line tones and hiss
+ *
+ * Meant for conference participants, e.g. from a ConfBridge join
+ * subroutine. The channel only gets a framehook, the analysis runs on the
+ * shared monitor thread.
+ */
+static int cpamonitor_exec(struct ast_channel *chan, const char *data)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = cpa_monitor_hook,
+		.destroy_cb = cpa_monitor_hook_destroy,
+		.disable_inheritance = 1,
+	};
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	enum cpa_monitor_action action = CPA_MONITOR_EVENTS;
+	struct cpa_monitor_slot *slot;
+	struct ast_datastore *datastore;
+	int *id;
+
+	if (!ast_strlen_zero(data)) {
+		if (!strcasecmp(data, "mute")) {
+			action = CPA_MONITOR_MUTE;
+		} else if (!strcasecmp(data, "drop")) {
+			action = CPA_MONITOR_DROP;
+		} else if (strcasecmp(data, "events")) {
+			ast_log(LOG_WARNING, "CPAMonitor: Unknown action '%s', only raising events\n", data);
+		}
+	}
+
+	ast_channel_lock(chan);
+	if (ast_channel_datastore_find(chan, &cpa_monitor_datastore, NULL)) {
+		ast_channel_unlock(chan);
+		ast_debug(1, "CPAMonitor: Channel [%s] is already monitored\n", ast_channel_name(chan));
+		return 0;
+	}
+	ast_channel_unlock(chan);
+
+	if (!(slot = cpa_monitor_claim(chan, action, cfg ? cfg->monitorDuty : 4))) {
+		ast_log(LOG_WARNING, "CPAMonitor: All %d monitor slots are in use, not monitoring [%s]\n",
+			CPA_MONITOR_SLOTS, ast_channel_name(chan));
+		return 0;
+	}
+	interface.data = slot;
+
+	/* Released by the destroy callback */
+	ast_module_ref(ast_module_info->self);
+
+	if (!(datastore = ast_datastore_alloc(&cpa_monitor_datastore, NULL)) || !(id = ast_calloc(1, sizeof(*id)))) {
+		ast_datastore_free(datastore);
+		cpa_monitor_hook_destroy(slot);
+		return 0;
+	}
+	datastore->data = id;
+
+	ast_channel_lock(chan);
+	if ((*id = ast_framehook_attach(chan, &interface)) < 0) {
+		ast_channel_unlock(chan);
+		ast_log(LOG_WARNING, "CPAMonitor: Unable to attach to [%s]\n", ast_channel_name(chan));
+		ast_datastore_free(datastore);
+		cpa_monitor_hook_destroy(slot);
+		return 0;
+	}
+	ast_channel_datastore_add(chan, datastore);
+	ast_channel_unlock(chan);
+
+	ast_verb(3, "CPAMonitor: Monitoring [%s]\n", ast_channel_name(chan));
+
+	return 0;
+}
+
+/*! Timing wheel resolution (ms) */
+#define CPA_WHEEL_TICK 10
+
+/*! Slots per level of the timing wheel as a power of two */
+#define CPA_WHEEL_BITS 8
+#define CPA_WHEEL_SLOTS (1 << CPA_WHEEL_BITS)
+#define CPA_WHEEL_MASK (CPA_WHEEL_SLOTS - 1)
+
+/*! Levels of the timing wheel, each slot spans a whole turn of the level below (~46 hours in all) */
+#define CPA_WHEEL_LEVELS 3
+
+/*!
+ * \brief A deadline on the shared timing wheel
+ *
+ * Embedded in an ao2 object, obj. The wheel holds a reference to obj while
+ * the timer is armed and fire() is called without any lock held.
+ */
+struct cpa_timer {
+	struct cpa_timer *next;
+	struct cpa_timer **pprev;	/*!< Link pointing at us, NULL while not armed */
+	struct cpa_timer *fireNext;	/*!< Due list of one wheel turn */
+	uint64_t expires;		/*!< Tick the timer is due at */
+	void *obj;
+	void (*fire)(struct cpa_timer *timer);
+};
+
+static struct cpa_timer *cpaWheel[CPA_WHEEL_LEVELS][CPA_WHEEL_SLOTS];
+AST_MUTEX_DEFINE_STATIC(cpaWheelLock);
+static ast_cond_t cpaWheelCond;
+static pthread_t cpaWheelThread = AST_PTHREADT_NULL;
+static int cpaWheelStop;
+static struct timeval cpaWheelStart;
+static uint64_t cpaWheelTick;		/*!< Last tick the wheel turned to */
+static int cpaWheelArmed;
+
+/*! \brief Ticks since the wheel started */
+static uint64_t cpa_wheel_now(void)
+{
+	return ast_tvdiff_ms(ast_tvnow(), cpaWheelStart) / CPA_WHEEL_TICK;
+}
+
+/*! \brief Put a timer in the slot its distance calls for, with cpaWheelLock held */
+static void cpa_wheel_link(struct cpa_timer *timer)
+{
+	uint64_t delta = timer->expires > cpaWheelTick ? timer->expires - cpaWheelTick : 0;
+	struct cpa_timer **slot;
+	int level = 0;
+
+	/* Cascaded timers that are due now land in the slot about to be fired */
+	while (level < CPA_WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * CPA_WHEEL_BITS))) {
+		level++;
+	}
+
+	slot = &cpaWheel[level][(timer->expires >> (level * CPA_WHEEL_BITS)) & CPA_WHEEL_MASK];
+	if ((timer->next = *slot)) {
+		timer->next->pprev = &timer->next;
+	}
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+/*! \brief Take a timer off the wheel, with cpaWheelLock held */
+static void cpa_wheel_unlink(struct cpa_timer *timer)
+{
+	if ((*timer->pprev = timer->next)) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/*!
+ * \brief Turn the wheel by one tick, with cpaWheelLock held
+ *
+ * Every time a level completes a turn, the next slot of the level above is
+ * spread over the levels below. Timers that are due are unlinked and added
+ * to due, still holding their reference.
+ */
+static void cpa_wheel_turn(struct cpa_timer **due)
+{
+	struct cpa_timer *timer, *list;
+	int level;
+
+	cpaWheelTick++;
+	for (level = 1; level < CPA_WHEEL_LEVELS && !(cpaWheelTick & ((1ULL << (level * CPA_WHEEL_BITS)) - 1)); level++) {
+		struct cpa_timer **slot = &cpaWheel[level][(cpaWheelTick >> (level * CPA_WHEEL_BITS)) & CPA_WHEEL_MASK];
+
+		list = *slot;
+		*slot = NULL;
+		while ((timer = list)) {
+			list = timer->next;
+			cpa_wheel_link(timer);
+		}
+	}
+
+	list = cpaWheel[0][cpaWheelTick & CPA_WHEEL_MASK];
+	while ((timer = list)) {
+		list = timer->next;
+		cpa_wheel_unlink(timer);
+		cpaWheelArmed--;
+		timer->fireNext = *due;
+		*due = timer;
+	}
+}
+
+/*! Longest a timer can be armed for (ms), one turn of the top level */
+#define CPA_WHEEL_MAX_MS ((int64_t) CPA_WHEEL_TICK * ((1LL << (CPA_WHEEL_LEVELS * CPA_WHEEL_BITS)) - 1))
+
+/*!
+ * \brief Arm a timer, or move it if it is already armed
+ *
+ * Constant time whatever the number of armed timers. Due at the first tick
+ * at least ms away, at most CPA_WHEEL_MAX_MS.
+ */
+static void cpa_timer_arm(struct cpa_timer *timer, int ms)
+{
+	int64_t ticks = (MIN(MAX(ms, 0), CPA_WHEEL_MAX_MS) + CPA_WHEEL_TICK - 1) / CPA_WHEEL_TICK;
+
+	ast_mutex_lock(&cpaWheelLock);
+	if (timer->pprev) {
+		cpa_wheel_unlink(timer);
+	} else {
+		ao2_ref(timer->obj, +1);
+		if (!cpaWheelArmed++) {
+			/* The idle wheel stopped turning, catch up without turning through the gap */
+			cpaWheelTick = cpa_wheel_now();
+			ast_cond_signal(&cpaWheelCond);
+		}
+	}
+	/* Counted from the clock, the wheel may be a tick behind */
+	timer->expires = MAX(cpa_wheel_now(), cpaWheelTick) + MAX(ticks, 1);
+	cpa_wheel_link(timer);
+	ast_mutex_unlock(&cpaWheelLock);
+}
+
+/*! \brief Disarm a timer, a timer that is firing right now still fires */
+static void cpa_timer_cancel(struct cpa_timer *timer)
+{
+	int armed;
+
+	ast_mutex_lock(&cpaWheelLock);
+	if ((armed = timer->pprev != NULL)) {
+		cpa_wheel_unlink(timer);
+		cpaWheelArmed--;
+	}
+	ast_mutex_unlock(&cpaWheelLock);
+
+	if (armed) {
+		ao2_ref(timer->obj, -1);
+	}
+}
+
+/*! \brief Turn the wheel every tick while a timer is armed and fire the due ones */
+static void *cpa_wheel_run(void *data)
+{
+	struct cpa_timer *due, *timer;
+	struct timespec ts;
+	struct timeval next;
+	uint64_t now;
+
+	ast_mutex_lock(&cpaWheelLock);
+	while (!cpaWheelStop) {
+		if (!cpaWheelArmed) {
+			ast_cond_wait(&cpaWheelCond, &cpaWheelLock);
+			continue;
+		}
+
+		if ((now = cpa_wheel_now()) <= cpaWheelTick) {
+			next = ast_tvadd(cpaWheelStart, ast_samp2tv((cpaWheelTick + 1) * CPA_WHEEL_TICK, 1000));
+			ts.tv_sec = next.tv_sec;
+			ts.tv_nsec = next.tv_usec * 1000;
+			ast_cond_timedwait(&cpaWheelCond, &cpaWheelLock, &ts);
+			continue;
+		}
+
+		due = NULL;
+		while (cpaWheelTick < now) {
+			cpa_wheel_turn(&due);
+		}
+		ast_mutex_unlock(&cpaWheelLock);
+
+		while ((timer = due)) {
+			due = timer->fireNext;
+			timer->fire(timer);
+			ao2_ref(timer->obj, -1);
+		}
+
+		ast_mutex_lock(&cpaWheelLock);
+	}
+	ast_mutex_unlock(&cpaWheelLock);
+
+	return NULL;
+}
+
+/*! \brief An analysis started through the C API, runs in a framehook */
+struct ast_cpa_handle {
+	struct ast_channel *chan;
+	int id;			/*!< Framehook id, -1 once detached */
+	int done;		/*!< Verdict delivered or analysis cancelled */
+	ast_cpa_verdict_cb callback;
+	void *data;
+	struct cpa_session session;
+	struct cpa_timer deadline;	/*!< Catches a channel that stops sending frames */
+	struct timeval start;
+	struct timeval lastFrame;
+	int maxTime;		/*!< Wall clock ms before Timeout */
+	int noMediaGrace;	/*!< ms without a frame before NoMedia, 0 disables */
+	enum cpa_result expired;	/*!< Set by the deadline for the read path to deliver */
+};
+
+static void cpa_handle_destructor(void *obj)
+{
+	struct ast_cpa_handle *handle = obj;
+
+	cpa_session_destroy(&handle->session);
+	ast_channel_cleanup(handle->chan);
+	ast_module_unref(ast_module_info->self);
+}
+
+static void cpa_handle_hook_destroy(void *data)
+{
+	ao2_ref(data, -1);
+}
+
+/*!
+ * \brief Deadline of an analysis started through the C API
+ *
+ * Runs on the wheel thread. The verdict is left for the read path, woken
+ * with a null frame, so the callback still runs on the channel's thread.
+ * A channel that sent a frame lately is checked again later.
+ */
+static void cpa_handle_expire(struct cpa_timer *timer)
+{
+	struct ast_cpa_handle *handle = timer->obj;
+	struct timeval now = ast_tvnow();
+	int elapsed, idle;
+
+	ast_channel_lock(handle->chan);
+	if (handle->done || handle->expired != CPA_RESULT_NONE) {
+		ast_channel_unlock(handle->chan);
+		return;
+	}
+	elapsed = ast_tvdiff_ms(now, handle->start);
+	idle = ast_tvdiff_ms(now, handle->lastFrame);
+	if (elapsed >= handle->maxTime) {
+		handle->expired = CPA_RESULT_TIMEOUT;
+	} else if (handle->noMediaGrace > 0 && idle >= handle->noMediaGrace) {
+		handle->expired = CPA_RESULT_NOMEDIA;
+	} else {
+		cpa_timer_arm(timer, handle->noMediaGrace > 0
+			? MIN(handle->maxTime - elapsed, handle->noMediaGrace - idle) : handle->maxTime - elapsed);
+		ast_channel_unlock(handle->chan);
+		return;
+	}
+	ast_channel_unlock(handle->chan);
+
+	ast_queue_frame(handle->chan, &ast_null_frame);
+}
+
+/*! \brief Deliver the verdict of an analysis started through the C API, with the channel locked */
+static void cpa_handle_verdict(struct ast_channel *chan, struct ast_cpa_handle *handle, enum cpa_result result)
+{
+	handle->done = 1;
+	cpa_timer_cancel(&handle->deadline);
+	ast_debug(1, "CPA: Channel [%s] returned [%s] at [%d]ms to its module\n", ast_channel_name(chan),
+		cpa_result_names[result], handle->session.resultTime);
+	cpa_stats_verdict(result, handle->session.resultTime);
+	cpa_trunk_verdict(chan, result);
+	cpa_session_learn(&handle->session);
+	handle->callback(chan, cpa_result_names[result], handle->session.resultTime, handle->data);
+
+	/* Only marks the hook, it goes once this frame is through */
+	ast_framehook_detach(chan, handle->id);
+	handle->id = -1;
+}
+
+/*!
+ * \brief Read path of a channel analysed through the C API
+ *
+ * Frames pass through untouched, a decoded copy feeds the session. Runs
+ * with the channel locked, which also guards the handle.
+ */
+static struct ast_frame *cpa_handle_hook(struct ast_channel *chan, struct ast_frame *frame,
+	enum ast_framehook_event event, void *data)
+{
+	struct ast_cpa_handle *handle = data;
+	int16_t samples[CPA_MAX_BATCH_MS * DEFAULT_SAMPLES_PER_MS];
+	struct ast_frame slin = { .frametype = AST_FRAME_VOICE, .src = "CPA", };
+	enum cpa_result result;
+	int count;
+
+	if (handle->done || event != AST_FRAMEHOOK_EVENT_READ || !frame) {
+		return frame;
+	}
+
+	if (handle->expired != CPA_RESULT_NONE) {
+		/* Like CPA(), no audio at all by the deadline is NoFrames */
+		if (handle->expired == CPA_RESULT_TIMEOUT && handle->session.provisional != CPA_RESULT_NONE) {
+			cpa_session_finish(&handle->session, handle->session.provisional);
+		} else if (handle->expired == CPA_RESULT_TIMEOUT && !handle->session.iTotalTime) {
+			cpa_session_finish(&handle->session, CPA_RESULT_NOFRAMES);
+		} else {
+			cpa_session_finish(&handle->session, handle->expired);
+		}
+		cpa_handle_verdict(chan, handle, handle->session.result);
+		return frame;
+	}
+
+	if (frame->frametype != AST_FRAME_VOICE || (count = cpa_frame_slin(frame, samples, ARRAY_LEN(samples))) <= 0) {
+		return frame;
+	}
+	handle->lastFrame = ast_tvnow();
+
+	slin.subclass.format = ast_format_slin;
+	slin.data.ptr = samples;
+	slin.samples = count;
+	slin.datalen = count * 2;
+	if ((result = cpa_session_feed(&handle->session, &slin)) != CPA_RESULT_NONE) {
+		cpa_handle_verdict(chan, handle, result);
+	}
+
+	return frame;
+}
+
+struct ast_cpa_handle *ast_cpa_start(struct ast_channel *chan, const char *profile, int totalAnalysisTime,
+	ast_cpa_verdict_cb callback, void *data)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = cpa_handle_hook,
+		.destroy_cb = cpa_handle_hook_destroy,
+		.disable_inheritance = 1,
+	};
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	struct ast_cpa_handle *handle;
+	const char *destination;
+
+	if (!chan || !callback || !(handle = ao2_alloc(sizeof(*handle), cpa_handle_destructor))) {
+		return NULL;
+	}
+	/* Released by the destructor, a module with live handles cannot be unloaded */
+	ast_module_ref(ast_module_info->self);
+	handle->id = -1;
+	handle->callback = callback;
+	handle->data = data;
+
+	ast_channel_lock(chan);
+	destination = ast_strdupa(S_OR(pbx_builtin_getvar_helper(chan, "CPADESTINATION"),
+		S_COR(ast_channel_connected(chan)->id.number.valid, ast_channel_connected(chan)->id.number.str, "")));
+	ast_channel_unlock(chan);
+
+	if (cpa_session_init(&handle->session, profile, destination, -1,
+		totalAnalysisTime > 0 ? totalAnalysisTime : dfltTotalAnalysisTime)) {
+		ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to create DSP\n", ast_channel_name(chan));
+		ao2_ref(handle, -1);
+		return NULL;
+	}
+	handle->chan = ast_channel_ref(chan);
+	handle->session.chan = chan;
+	cpa_registry_add(&handle->session);
+	handle->deadline.obj = handle;
+	handle->deadline.fire = cpa_handle_expire;
+	handle->start = handle->lastFrame = ast_tvnow();
+	/* The same allowance CPA() gives a channel that stops sending frames */
+	handle->maxTime = handle->session.totalAnalysisTime + 2 * dfltMaxWaitTimeForFrame;
+	handle->noMediaGrace = cfg ? cfg->noMediaGrace : 0;
+
+	/* The framehook holds its own reference */
+	interface.data = ao2_bump(handle);
+	ast_channel_lock(chan);
+	if ((handle->id = ast_framehook_attach(chan, &interface)) < 0) {
+		ast_channel_unlock(chan);
+		ast_log(LOG_WARNING, "CPA: Unable to attach to [%s]\n", ast_channel_name(chan));
+		ao2_ref(handle, -2);
+		return NULL;
+	}
+	cpa_timer_arm(&handle->deadline, handle->noMediaGrace > 0 ? MIN(handle->maxTime, handle->noMediaGrace) : handle->maxTime);
+	ast_channel_unlock(chan);
+
+	ast_verb(3, "CPA: Analysing [%s] for a module, profile [%s]\n", ast_channel_name(chan), handle->session.profile->name);
+
+	return handle;
+}
+
+void ast_cpa_cancel(struct ast_cpa_handle *handle)
+{
+	if (!handle) {
+		return;
+	}
+
+	ast_channel_lock(handle->chan);
+	handle->done = 1;
+	cpa_timer_cancel(&handle->deadline);
+	if (handle->id >= 0) {
+		ast_framehook_detach(handle->chan, handle->id);
+		handle->id = -1;
+	}
+	ast_channel_unlock(handle->chan);
+
+	ao2_ref(handle, -1);
+}
+
+static char *handle_cli_cpa_show_profiles(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	struct ao2_iterator i;
+	struct cpa_profile *profile;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa show profiles";
+		e->usage =
+			"Usage: cpa show profiles\n"
+			"       Lists the CPA profiles loaded from cpa.conf and their thresholds.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(cfg = ao2_global_obj_ref(cpa_globals))) {
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, "%-20s %8s %5s %5s %5s %5s %6s %-6s %s\n", "Profile", "Silence", "Ring", "Talk", "Busy", "Cong", "Hangup", "Engine", "Zones");
+	i = ao2_iterator_init(cfg->profiles, 0);
+	while ((profile = ao2_iterator_next(&i))) {
+		char zones[CPA_MAX_ZONES * 8 + CPA_MAX_ZONES] = "";
+		int z;
+
+		for (z = 0; z < profile->numZones; z++) {
+			if (z) {
+				strcat(zones, ",");
+			}
+			strcat(zones, profile->zones[z]);
+		}
+		ast_cli(a->fd, "%-20s %8d %5d %5d %5d %5d %6d %-6s %s\n", profile->name,
+			profile->silenceThreshold < 0 ? dfltSilenceThreshold : profile->silenceThreshold,
+			profile->threshRing, profile->threshTalk, profile->threshBusy, profile->threshCongestion, profile->threshHangup,
+			profile->engine == CPA_ENGINE_NATIVE ? (profile->decimate ? "4k" : "native") : "dsp", S_OR(zones, "(dsp default)"));
+		ao2_ref(profile, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_cpa_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	struct ao2_iterator i;
+	struct cpa_profile *profile;
+	int res;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa show stats";
+		e->usage =
+			"Usage: cpa show stats\n"
+			"       Shows CPA verdict counters and how each shadow profile compared\n"
+			"       with the active profile on the sampled calls.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "Calls analysed: %d\n", cpaStats.calls);
+	for (res = CPA_RESULT_NONE + 1; res < CPA_RESULT_MAX; res++) {
+		ast_cli(a->fd, "  %-12s %d\n", cpa_result_names[res], cpaStats.results[res]);
+	}
+	ast_cli(a->fd, "Calls shadowed: %d\n", cpaStats.shadowCalls);
+	ast_cli(a->fd, "Learned destinations: %d\n\n", learned_dests ? ao2_container_count(learned_dests) : 0);
+
+	if (!(cfg = ao2_global_obj_ref(cpa_globals))) {
+		return CLI_SUCCESS;
+	}
+
+	ast_cli(a->fd, "%-20s %6s %6s %8s %9s %7s %10s\n", "Shadow Profile", "Runs", "Agree", "Disagree", "Undecided", "Earlier", "Avg Saved");
+	i = ao2_iterator_init(cfg->profiles, 0);
+	while ((profile = ao2_iterator_next(&i))) {
+		struct cpa_shadow_stats *stats = &profile->shadowStats;
+
+		if (stats->runs) {
+			ast_cli(a->fd, "%-20s %6d %6d %8d %9d %7d %8dms\n", profile->name, stats->runs, stats->agree,
+				stats->disagree, stats->undecided, stats->earlier, stats->earlier ? stats->savedTime / stats->earlier : 0);
+		}
+		ao2_ref(profile, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_cpa_state(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int res;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa {export|import} state";
+		e->usage =
+			"Usage: cpa {export|import} state <file>\n"
+			"       Writes the learned CPA state to a snapshot file, or merges a\n"
+			"       snapshot exported by this or another node into it.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args + 1) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!strcasecmp(a->argv[1], "export")) {
+		if ((res = cpa_snapshot_export(a->argv[3])) < 0) {
+			return CLI_FAILURE;
+		}
+		ast_cli(a->fd, "Exported %d learned destinations to %s\n", res, a->argv[3]);
+	} else {
+		if ((res = cpa_snapshot_import(a->argv[3])) < 0) {
+			return CLI_FAILURE;
+		}
+		ast_cli(a->fd, "Merged %d learned destinations from %s\n", res, a->argv[3]);
+	}
+
+	return CLI_SUCCESS;
+}
+
+/*! \brief Replay every call of a mapped feature store through one profile and print a row */
+static void cpa_features_scan(int fd, const char *map, size_t size, const struct cpa_profile *profile)
+{
+	int threshSilence = (profile->silenceThreshold < 0 ? dfltSilenceThreshold : profile->silenceThreshold) / 20;
+	int calls = 0, agree = 0, wrong = 0, undecided = 0, time;
+	int64_t totalTime = 0;
+	size_t offset = sizeof(struct cpa_feature_header);
+
+	while (offset + sizeof(struct cpa_feature_call) <= size) {
+		const struct cpa_feature_call *call = (const struct cpa_feature_call *) (map + offset);
+		struct cpa_feature_columns columns;
+		enum cpa_result result, expected;
+
+		cpa_feature_columns(call, &columns);
+		result = cpa_features_replay(profile, threshSilence, call, &columns, &time);
+		expected = call->label != CPA_RESULT_NONE ? call->label : call->result;
+
+		calls++;
+		totalTime += time;
+		if (result == CPA_RESULT_TIMEOUT || result == CPA_RESULT_SILENCE) {
+			undecided++;
+		} else if (result == expected || (result == CPA_RESULT_TALKING && expected == CPA_RESULT_HUMAN)) {
+			agree++;
+		} else {
+			wrong++;
+		}
+		offset += call->size;
+	}
+
+	ast_cli(fd, "%-20s %7d %7d %7d %9d %7dms\n", profile->name, calls, agree, wrong, undecided,
+		calls ? (int) (totalTime / calls) : 0);
+}
+
+static char *handle_cli_cpa_scan_features(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	const struct cpa_feature_header *header;
+	struct cpa_profile *profile;
+	struct ao2_iterator i;
+	struct stat st;
+	size_t offset;
+	int calls = 0, labeled = 0, blocks = 0;
+	char *map;
+	int fd;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa scan features";
+		e->usage =
+			"Usage: cpa scan features <file> [profile]\n"
+			"       Replays every call of a feature store through the thresholds of a\n"
+			"       profile, or of every profile, without decoding any audio. Verdicts\n"
+			"       are compared with the calls' CPALABEL, or with the verdict recorded\n"
+			"       for unlabeled calls.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args + 1 && a->argc != e->args + 2) {
+		return CLI_SHOWUSAGE;
+	}
+	if (!(cfg = ao2_global_obj_ref(cpa_globals))) {
+		return CLI_FAILURE;
+	}
+
+	if ((fd = open(a->argv[3], O_RDONLY)) < 0) {
+		ast_cli(a->fd, "Unable to open '%s': %s\n", a->argv[3], strerror(errno));
+		return CLI_FAILURE;
+	}
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*header)) {
+		ast_cli(a->fd, "'%s' is truncated\n", a->argv[3]);
+		close(fd);
+		return CLI_FAILURE;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ast_cli(a->fd, "Unable to map '%s': %s\n", a->argv[3], strerror(errno));
+		return CLI_FAILURE;
+	}
+	/* One pass front to back */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	header = (const struct cpa_feature_header *) map;
+	if (memcmp(header->magic, CPA_FEATURE_MAGIC, sizeof(header->magic))
+		|| header->schema != CPA_FEATURE_SCHEMA || header->callSize != sizeof(struct cpa_feature_call)) {
+		ast_cli(a->fd, "'%s' is not a feature store of schema %d\n", a->argv[3], CPA_FEATURE_SCHEMA);
+		munmap(map, st.st_size);
+		return CLI_FAILURE;
+	}
+
+	/* Check the framing once so the scans can trust it */
+	for (offset = sizeof(*header); offset + sizeof(struct cpa_feature_call) <= (size_t) st.st_size; ) {
+		const struct cpa_feature_call *call = (const struct cpa_feature_call *) (map + offset);
+
+		if (call->size != cpa_feature_call_size(call->numBlocks) || offset + call->size > (size_t) st.st_size) {
+			ast_cli(a->fd, "Call %d at offset %zu is corrupt, scanning the %d before it\n", calls + 1, offset, calls);
+			break;
+		}
+		calls++;
+		labeled += call->label != CPA_RESULT_NONE;
+		blocks += call->numBlocks;
+		offset += call->size;
+	}
+	ast_cli(a->fd, "%d calls, %d labeled, %d blocks\n\n", calls, labeled, blocks);
+
+	ast_cli(a->fd, "%-20s %7s %7s %7s %9s %9s\n", "Profile", "Calls", "Agree", "Wrong", "Undecided", "Avg Time");
+	if (a->argc == e->args + 2) {
+		if (!(profile = ao2_find(cfg->profiles, a->argv[4], OBJ_SEARCH_KEY))) {
+			ast_cli(a->fd, "No profile '%s'\n", a->argv[4]);
+		} else {
+			cpa_features_scan(a->fd, map, offset, profile);
+			ao2_ref(profile, -1);
+		}
+	} else {
+		i = ao2_iterator_init(cfg->profiles, 0);
+		while ((profile = ao2_iterator_next(&i))) {
+			cpa_features_scan(a->fd, map, offset, profile);
+			ao2_ref(profile, -1);
+		}
+		ao2_iterator_destroy(&i);
+	}
+
+	munmap(map, st.st_size);
+
+	return CLI_SUCCESS;
+}
+
+/*! Length of each benchmark signal in samples, one second at 8kHz */
+#define CPA_BENCH_SAMPLES 8000
+
+/*! Samples handed over at a time, a 20ms frame as a channel would */
+#define CPA_BENCH_FRAME 160
+
+/*! \brief Synthetic signals the benchmark runs through both engines */
+static const struct {
+	const char *name;
+	int freq1;		/*!< Hz, 0 for none */
+	int freq2;
+	int noise;		/*!< Peak of white noise added to the tones */
+	int sit;		/*!< Play the 950/1400Hz SIT sequence ending on this tone (Hz) instead */
+} cpa_bench_signals[] = {
+	{ "Ringback", 440, 480, 0, 0 },
+	{ "Busy", 480, 620, 0, 0 },
+	{ "Dial tone", 350, 440, 0, 0 },
+	{ "SIT", 0, 0, 0, 1800 },
+	{ "Speech band noise", 0, 0, 3000, 0 },
+	{ "Silence", 0, 0, 0, 0 },
+	/* None of these is a tone of the plan, the decimated bank must not fold them onto one */
+	{ "2.0kHz", 2000, 0, 0, 0 },
+	{ "2.2kHz", 2200, 0, 0, 0 },
+	{ "2.4kHz", 2400, 0, 0, 0 },
+	{ "1.8+2.2kHz", 1800, 2200, 0, 0 },
+	{ "SIT ending 2.2kHz", 0, 0, 0, 2200 },
+};
+
+/*! \brief Render one benchmark signal, tones at -20dBFS each */
+static void cpa_bench_render(int signal, int16_t *samples)
+{
+	const int sitFreqs[] = { 950, 1400, cpa_bench_signals[signal].sit };
+	unsigned int rand = 0x2545f491;
+	double level = 3276.0;
+	int n;
+
+	for (n = 0; n < CPA_BENCH_SAMPLES; n++) {
+		double t = (double) n / 8000.0;
+		double x = 0.0;
+
+		if (cpa_bench_signals[signal].sit) {
+			x = level * sin(2.0 * M_PI * sitFreqs[MIN(n / 2667, 2)] * t);
+		} else {
+			if (cpa_bench_signals[signal].freq1) {
+				x += level * sin(2.0 * M_PI * cpa_bench_signals[signal].freq1 * t);
+			}
+			if (cpa_bench_signals[signal].freq2) {
+				x += level * sin(2.0 * M_PI * cpa_bench_signals[signal].freq2 * t);
+			}
+		}
+		if (cpa_bench_signals[signal].noise) {
+			x += (int) (cpa_rand(&rand) % (2 * cpa_bench_signals[signal].noise + 1)) - cpa_bench_signals[signal].noise;
+		}
+		samples[n] = x;
+	}
+}
+
+static char *handle_cli_cpa_benchmark(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int16_t *samples;
+	struct ast_frame fr = { .frametype = AST_FRAME_VOICE, };
+	char dspState[256], nativeState[256], decimatedState[256];
+	int64_t dspTime = 0, nativeTime = 0, decimatedTime = 0;
+	struct cpa_session *impair = NULL;
+	unsigned int impairSeed = 0;
+	int blocks = 0, agree = 0;
+	int iterations = 20;
+	int signal, iter, n;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa benchmark";
+		e->usage =
+			"Usage: cpa benchmark [iterations [impairment]]\n"
+			"       Runs synthetic North American tones, and tones near 2kHz none of\n"
+			"       the engines should take for one, through the DSP, the native\n"
+			"       tone bank and the native tone bank decimated to 4kHz. Shows the\n"
+			"       tone state each settles on, how often the decimated bank agrees\n"
+			"       with the full rate one block by block, and how long each took\n"
+			"       per second of audio. With an impairment, the signals first go\n"
+			"       through that type=impairment chain from cpa.conf.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > e->args + 2) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc > e->args && (iterations = atoi(a->argv[e->args])) <= 0) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc > e->args + 1) {
+		if (!(impair = ast_calloc(1, sizeof(*impair)))) {
+			return CLI_FAILURE;
+		}
+		if (cpa_session_impair(impair, a->argv[e->args + 1])) {
+			ast_cli(a->fd, "No impairment '%s'\n", a->argv[e->args + 1]);
+			ast_free(impair);
+			return CLI_FAILURE;
+		}
+		/* Every signal sees the same noise and losses */
+		impairSeed = impair->impairRand;
+		ast_cli(a->fd, "Impairment: %s\n\n", impair->impairment->name);
+	}
+
+	if (!(samples = ast_malloc(CPA_BENCH_SAMPLES * sizeof(*samples)))) {
+		if (impair) {
+			ao2_cleanup(impair->impairment);
+			ast_free(impair);
+		}
+		return CLI_FAILURE;
+	}
+
+	fr.subclass.format = ast_format_slin;
+	fr.samples = CPA_BENCH_FRAME;
+	fr.datalen = CPA_BENCH_FRAME * sizeof(*samples);
+
+	ast_cli(a->fd, "%-18s %-10s %-10s %-10s %6s\n", "Signal", "DSP", "Native", "4kHz", "Agree");
+	for (signal = 0; signal < (int) ARRAY_LEN(cpa_bench_signals); signal++) {
+		int dspTstate = -1, nativeTstate = -1, decimatedTstate = -1;
+		int signalBlocks = 0, signalAgree = 0;
+
+		cpa_bench_render(signal, samples);
+		if (impair) {
+			impair->impairRand = impairSeed;
+			impair->impairLoss = 0;
+			for (n = 0; n < CPA_BENCH_SAMPLES; n += CPA_BENCH_FRAME) {
+				fr.data.ptr = samples + n;
+				cpa_impair_frame(impair, &fr);
+			}
+		}
+
+		for (iter = 0; iter < iterations; iter++) {
+			struct ast_dsp *dsp;
+			struct cpa_tonebank bank, decimated;
+			struct timeval start;
+
+			if (!(dsp = ast_dsp_new())) {
+				ast_free(samples);
+				if (impair) {
+					ao2_cleanup(impair->impairment);
+					ast_free(impair);
+				}
+				return CLI_FAILURE;
+			}
+			ast_dsp_set_call_progress_zone(dsp, "us");
+			start = ast_tvnow();
+			for (n = 0; n < CPA_BENCH_SAMPLES; n += CPA_BENCH_FRAME) {
+				fr.data.ptr = samples + n;
+				ast_dsp_call_progress(dsp, &fr);
+			}
+			dspTime += ast_tvdiff_us(ast_tvnow(), start);
+			dspTstate = ast_dsp_get_tstate(dsp);
+			ast_dsp_free(dsp);
+
+			memset(&bank, 0, sizeof(bank));
+			start = ast_tvnow();
+			for (n = 0; n < CPA_BENCH_SAMPLES; n += CPA_BENCH_FRAME) {
+				cpa_tonebank_process(&bank, samples + n, CPA_BENCH_FRAME);
+			}
+			nativeTime += ast_tvdiff_us(ast_tvnow(), start);
+			nativeTstate = bank.tstate;
+
+			memset(&decimated, 0, sizeof(decimated));
+			decimated.decimate = 1;
+			start = ast_tvnow();
+			for (n = 0; n < CPA_BENCH_SAMPLES; n += CPA_BENCH_FRAME) {
+				cpa_tonebank_process(&decimated, samples + n, CPA_BENCH_FRAME);
+			}
+			decimatedTime += ast_tvdiff_us(ast_tvnow(), start);
+			decimatedTstate = decimated.tstate;
+		}
+
+		/* Accuracy is checked outside the timed runs, block by block */
+		{
+			struct cpa_tonebank bank, decimated;
+
+			memset(&bank, 0, sizeof(bank));
+			memset(&decimated, 0, sizeof(decimated));
+			decimated.decimate = 1;
+			for (n = 0; n < CPA_BENCH_SAMPLES; n += CPA_BENCH_FRAME) {
+				cpa_tonebank_process(&bank, samples + n, CPA_BENCH_FRAME);
+				cpa_tonebank_process(&decimated, samples + n, CPA_BENCH_FRAME);
+				signalBlocks++;
+				signalAgree += bank.tstate == decimated.tstate;
+			}
+		}
+		blocks += signalBlocks;
+		agree += signalAgree;
+
+		tone2str(dspState, dspTstate);
+		tone2str(nativeState, nativeTstate);
+		tone2str(decimatedState, decimatedTstate);
+		ast_cli(a->fd, "%-18s %-10s %-10s %-10s %5d%%\n", cpa_bench_signals[signal].name, dspState, nativeState,
+			decimatedState, signalAgree * 100 / signalBlocks);
+	}
+	ast_free(samples);
+	if (impair) {
+		ao2_cleanup(impair->impairment);
+		ast_free(impair);
+	}
+
+	n = iterations * ARRAY_LEN(cpa_bench_signals);
+	ast_cli(a->fd, "\nDSP:    %8.1fus per second of audio\n", (double) dspTime / n);
+	ast_cli(a->fd, "Native: %8.1fus per second of audio\n", (double) nativeTime / n);
+	ast_cli(a->fd, "4kHz:   %8.1fus per second of audio, %.2fus per block\n", (double) decimatedTime / n,
+		(double) decimatedTime / n / ((double) CPA_BENCH_SAMPLES / CPA_TONEBANK_BLOCK));
+	if (nativeTime) {
+		ast_cli(a->fd, "Native tone bank is %.2fx the speed of the DSP\n", (double) dspTime / nativeTime);
+		ast_cli(a->fd, "Decimation saves %.2fus per block (%d%%), agreeing on %d%% of blocks\n",
+			(double) (nativeTime - decimatedTime) / n / ((double) CPA_BENCH_SAMPLES / CPA_TONEBANK_BLOCK),
+			(int) ((nativeTime - decimatedTime) * 100 / nativeTime), agree * 100 / MAX(blocks, 1));
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_cpa_show_selection(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct ao2_iterator i;
+	struct cpa_arm *arm;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa show selection";
+		e->usage =
+			"Usage: cpa show selection\n"
+			"       Shows how each auto_profiles candidate has done on each trunk:\n"
+			"       mean time to the verdict and accuracy on the calls that got a\n"
+			"       disposition through CPA_DISPOSITION or CPADisposition.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-40s %7s %9s %7s %8s\n", "Trunk/Profile", "Calls", "Avg Time", "Scored", "Accuracy");
+	if (!cpa_arms) {
+		return CLI_SUCCESS;
+	}
+	i = ao2_iterator_init(cpa_arms, 0);
+	while ((arm = ao2_iterator_next(&i))) {
+		ao2_lock(arm);
+		ast_cli(a->fd, "%-40s %7d %7dms %7d %7d%%\n", arm->key, arm->calls,
+			arm->calls ? (int) (arm->totalTime / arm->calls) : 0, arm->scored,
+			arm->scored ? 100 * arm->correct / arm->scored : 0);
+		ao2_unlock(arm);
+		ao2_ref(arm, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_cpa_show_trunks(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	struct ao2_iterator i;
+	struct cpa_trunk *trunk;
+	time_t now = time(NULL);
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa show trunks";
+		e->usage =
+			"Usage: cpa show trunks\n"
+			"       Shows the verdicts each trunk returned within trunk_window and\n"
+			"       whether one failure dominates them.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(cfg = ao2_global_obj_ref(cpa_globals)) || !cpa_trunks) {
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, "%-40s %6s %-12s %8s\n", "Trunk", "Calls", "Status", "Since");
+	i = ao2_iterator_init(cpa_trunks, 0);
+	while ((trunk = ao2_iterator_next(&i))) {
+		enum cpa_result result = cpa_trunk_assess(cfg, trunk, now);
+		int calls = 0, n;
+
+		ao2_lock(trunk);
+		for (n = 0; n < trunk->count; n++) {
+			calls += now - trunk->times[n] < cfg->trunkWindow;
+		}
+		ast_cli(a->fd, "%-40s %6d %-12s %7lds\n", trunk->name, calls,
+			result != CPA_RESULT_NONE ? cpa_result_names[result] : "OK",
+			trunk->since ? (long) (now - trunk->since) : 0L);
+		ao2_unlock(trunk);
+		ao2_ref(trunk, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_cpa_show_sessions(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct cpa_registry_entry *entries;
+	struct timeval now = ast_tvnow();
+	int count, n;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa show sessions";
+		e->usage =
+			"Usage: cpa show sessions\n"
+			"       Lists the sessions being analysed, with their state, rings heard\n"
+			"       and how long they have run.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != e->args) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(entries = ast_malloc(CPA_REGISTRY_SLOTS * sizeof(*entries)))) {
+		return CLI_FAILURE;
+	}
+	count = cpa_registry_snapshot(entries, CPA_REGISTRY_SLOTS);
+
+	ast_cli(a->fd, "%-40s %-16s %-12s %-12s %5s %9s %9s\n", "Channel", "Profile", "State", "Provisional",
+		"Rings", "Analysed", "Elapsed");
+	for (n = 0; n < count; n++) {
+		struct cpa_registry_entry *entry = &entries[n];
+
+		ast_cli(a->fd, "%-40s %-16s %-12s %-12s %5d %7dms %7ldms\n", entry->channel, entry->profile,
+			cpa_registry_state(entry), cpa_result_names[entry->provisional], entry->rings, entry->analysed,
+			(long) ast_tvdiff_ms(now, entry->start));
+	}
+	ast_cli(a->fd, "%d active CPA session%s\n", count, ESS(count));
+	ast_free(entries);
+
+	return CLI_SUCCESS;
+}
+
+static int manager_cpa_sessions(struct mansession *s, const struct message *m)
+{
+	const char *actionId = astman_get_header(m, "ActionID");
+	struct cpa_registry_entry *entries;
+	struct timeval now = ast_tvnow();
+	char idText[256] = "";
+	int count, n;
+
+	if (!(entries = ast_malloc(CPA_REGISTRY_SLOTS * sizeof(*entries)))) {
+		astman_send_error(s, m, "Out of memory");
+		return 0;
+	}
+	count = cpa_registry_snapshot(entries, CPA_REGISTRY_SLOTS);
+
+	if (!ast_strlen_zero(actionId)) {
+		snprintf(idText, sizeof(idText), "ActionID: %s\r\n", actionId);
+	}
+
+	astman_send_listack(s, m, "CPA sessions will follow", "start");
+	for (n = 0; n < count; n++) {
+		struct cpa_registry_entry *entry = &entries[n];
+
+		astman_append(s,
+			"Event: CPASession\r\n"
+			"%s"
+			"Channel: %s\r\n"
+			"Uniqueid: %s\r\n"
+			"Profile: %s\r\n"
+			"State: %s\r\n"
+			"Provisional: %s\r\n"
+			"Rings: %d\r\n"
+			"Analysed: %d\r\n"
+			"Elapsed: %ld\r\n"
+			"\r\n",
+			idText, entry->channel, entry->uniqueid, entry->profile, cpa_registry_state(entry),
+			cpa_result_names[entry->provisional], entry->rings, entry->analysed,
+			(long) ast_tvdiff_ms(now, entry->start));
+	}
+	ast_free(entries);
+
+	astman_send_list_complete_start(s, m, "CPASessionsComplete", count);
+	astman_send_list_complete_end(s);
+
+	return 0;
+}
+
+/*! \brief Copy a label value, escaped for the Prometheus text format */
+static void cpa_metrics_escape(char *dst, size_t size, const char *src)
+{
+	size_t len = 0;
+
+	for (; *src && len + 2 < size; src++) {
+		if (*src == '\\' || *src == '"' || *src == '\n') {
+			dst[len++] = '\\';
+			dst[len++] = *src == '\n' ? 'n' : *src;
+		} else {
+			dst[len++] = *src;
+		}
+	}
+	dst[len] = '\0';
+}
+
+static void cpa_metrics_histogram(struct ast_str **buf, struct cpa_histogram *histogram)
+{
+	unsigned long long count = 0;
+	int i;
+
+	ast_str_append(buf, 0, "# HELP %s %s\n# TYPE %s histogram\n", histogram->name, histogram->help, histogram->name);
+	for (i = 0; i < CPA_HISTOGRAM_BUCKETS; i++) {
+		count += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+		ast_str_append(buf, 0, "%s_bucket{le=\"%g\"} %llu\n", histogram->name, histogram->bounds[i] * histogram->unit, count);
+	}
+	count += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+	ast_str_append(buf, 0, "%s_bucket{le=\"+Inf\"} %llu\n", histogram->name, count);
+	ast_str_append(buf, 0, "%s_sum %g\n", histogram->name,
+		__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) * histogram->unit);
+	ast_str_append(buf, 0, "%s_count %llu\n", histogram->name, count);
+}
+
+/*!
+ * \brief Render the module's metrics in the Prometheus text format
+ *
+ * Everything read here is updated with atomic operations, so rendering
+ * never waits for a session. Only the trunk list is walked through its
+ * container.
+ */
+static void cpa_metrics_render(struct ast_str **buf)
+{
+	struct ao2_iterator i;
+	struct cpa_trunk *trunk;
+	int sessions = 0, participants = 0, res, n;
+
+	ast_str_append(buf, 0, "# HELP cpa_calls_total Calls analysed.\n# TYPE cpa_calls_total counter\n");
+	ast_str_append(buf, 0, "cpa_calls_total %d\n", __atomic_load_n(&cpaStats.calls, __ATOMIC_RELAXED));
+	ast_str_append(buf, 0, "# HELP cpa_results_total Verdicts by status.\n# TYPE cpa_results_total counter\n");
+	for (res = CPA_RESULT_NONE + 1; res < CPA_RESULT_MAX; res++) {
+		ast_str_append(buf, 0, "cpa_results_total{status=\"%s\"} %d\n", cpa_result_names[res],
+			__atomic_load_n(&cpaStats.results[res], __ATOMIC_RELAXED));
+	}
+	ast_str_append(buf, 0, "# HELP cpa_shadow_calls_total Calls the shadow profiles ran on.\n# TYPE cpa_shadow_calls_total counter\n");
+	ast_str_append(buf, 0, "cpa_shadow_calls_total %d\n", __atomic_load_n(&cpaStats.shadowCalls, __ATOMIC_RELAXED));
+
+	cpa_metrics_histogram(buf, &cpaDecisionTime);
+	cpa_metrics_histogram(buf, &cpaFrameCost);
+
+	for (n = 0; n < CPA_REGISTRY_SLOTS; n++) {
+		sessions += __atomic_load_n(&cpaRegistry[n].used, __ATOMIC_RELAXED) == 2;
+	}
+	for (n = 0; n < CPA_MONITOR_SLOTS; n++) {
+		participants += !!__atomic_load_n(&cpaMonitorSlots[n].inUse, __ATOMIC_RELAXED);
+	}
+	ast_str_append(buf, 0, "# HELP cpa_sessions Sessions being analysed.\n# TYPE cpa_sessions gauge\n");
+	ast_str_append(buf, 0, "cpa_sessions %d\n", sessions);
+	ast_str_append(buf, 0, "# HELP cpa_sessions_capacity Sessions the registry can list.\n# TYPE cpa_sessions_capacity gauge\n");
+	ast_str_append(buf, 0, "cpa_sessions_capacity %d\n", CPA_REGISTRY_SLOTS);
+	ast_str_append(buf, 0, "# HELP cpa_monitor_pool_used CPAMonitor() participants watched.\n# TYPE cpa_monitor_pool_used gauge\n");
+	ast_str_append(buf, 0, "cpa_monitor_pool_used %d\n", participants);
+	ast_str_append(buf, 0, "# HELP cpa_monitor_pool_capacity CPAMonitor() participants the pool can watch.\n# TYPE cpa_monitor_pool_capacity gauge\n");
+	ast_str_append(buf, 0, "cpa_monitor_pool_capacity %d\n", CPA_MONITOR_SLOTS);
+
+	if (!cpa_trunks) {
+		return;
+	}
+
+	ast_str_append(buf, 0, "# HELP cpa_trunk_results_total Verdicts by trunk and status.\n# TYPE cpa_trunk_results_total counter\n");
+	i = ao2_iterator_init(cpa_trunks, 0);
+	while ((trunk = ao2_iterator_next(&i))) {
+		char name[AST_MAX_CONTEXT * 2];
+
+		cpa_metrics_escape(name, sizeof(name), trunk->name);
+		for (res = CPA_RESULT_NONE + 1; res < CPA_RESULT_MAX; res++) {
+			int total = __atomic_load_n(&trunk->totals[res], __ATOMIC_RELAXED);
+
+			if (total) {
+				ast_str_append(buf, 0, "cpa_trunk_results_total{trunk=\"%s\",status=\"%s\"} %d\n",
+					name, cpa_result_names[res], total);
+			}
+		}
+		ao2_ref(trunk, -1);
+	}
+	ao2_iterator_destroy(&i);
+
+	ast_str_append(buf, 0, "# HELP cpa_trunk_degraded 1 while one failure dominates the trunk's calls.\n# TYPE cpa_trunk_degraded gauge\n");
+	i = ao2_iterator_init(cpa_trunks, 0);
+	while ((trunk = ao2_iterator_next(&i))) {
+		char name[AST_MAX_CONTEXT * 2];
+
+		cpa_metrics_escape(name, sizeof(name), trunk->name);
+		ast_str_append(buf, 0, "cpa_trunk_degraded{trunk=\"%s\"} %d\n", name,
+			__atomic_load_n(&trunk->degraded, __ATOMIC_RELAXED) != CPA_RESULT_NONE);
+		ao2_ref(trunk, -1);
+	}
+	ao2_iterator_destroy(&i);
+}
+
+/*! \brief Serve the metrics on the built in HTTP server, see http.conf */
+static int cpa_metrics_http(struct ast_tcptls_session_instance *ser, const struct ast_http_uri *urih,
+	const char *uri, enum ast_http_method method, struct ast_variable *get_params, struct ast_variable *headers)
+{
+	struct ast_str *header = NULL, *out;
+
+	if (method != AST_HTTP_GET && method != AST_HTTP_HEAD) {
+		ast_http_error(ser, 501, "Not Implemented", "Only GET and HEAD are supported");
+		return 0;
+	}
+	if (!(out = ast_str_create(4096)) || !(header = ast_str_create(64))) {
+		ast_free(out);
+		ast_http_error(ser, 500, "Server Error", "Out of memory");
+		return 0;
+	}
+
+	ast_str_set(&header, 0, "Content-Type: text/plain; version=0.0.4\r\n");
+	cpa_metrics_render(&out);
+	/* Sends and frees both strings */
+	ast_http_send(ser, method, 200, NULL, header, out, 0, 0);
+
+	return 0;
+}
+
+static struct ast_http_uri cpa_metrics_uri = {
+	.description = "CPA metrics",
+	.uri = "cpa/metrics",
+	.callback = cpa_metrics_http,
+	.key = __FILE__,
+};
+
+/*!
+ * \brief Write the metrics to a file for a node exporter's textfile collector
+ *
+ * Written next to the target and renamed into place like the snapshot.
+ *
+ * \retval 0 on success
+ * \retval -1 on error
+ */
+static int cpa_metrics_write(const char *filename)
+{
+	struct ast_str *out;
+	char tmpname[PATH_MAX];
+	FILE *fp;
+
+	if (!(out = ast_str_create(4096))) {
+		return -1;
+	}
+	cpa_metrics_render(&out);
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (!(fp = fopen(tmpname, "w"))) {
+		ast_log(LOG_WARNING, "CPA: Unable to write metrics '%s': %s\n", tmpname, strerror(errno));
+		ast_free(out);
+		return -1;
+	}
+	if (fwrite(ast_str_buffer(out), 1, ast_str_strlen(out), fp) != ast_str_strlen(out) || fclose(fp)) {
+		ast_log(LOG_WARNING, "CPA: Unable to write metrics '%s': %s\n", tmpname, strerror(errno));
+		unlink(tmpname);
+		ast_free(out);
+		return -1;
+	}
+	ast_free(out);
+
+	if (rename(tmpname, filename)) {
+		ast_log(LOG_WARNING, "CPA: Unable to move metrics into place as '%s': %s\n", filename, strerror(errno));
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_MUTEX_DEFINE_STATIC(cpaMetricsLock);
+static ast_cond_t cpaMetricsCond;
+static pthread_t cpaMetricsThread = AST_PTHREADT_NULL;
+static int cpaMetricsStop;
+
+/*! \brief Rewrite metrics_file every metrics_interval seconds */
+static void *cpa_metrics_run(void *data)
+{
+	struct timespec ts;
+	struct timeval next;
+
+	ast_mutex_lock(&cpaMetricsLock);
+	while (!cpaMetricsStop) {
+		struct cpa_config *cfg = ao2_global_obj_ref(cpa_globals);
+
+		next = ast_tvadd(ast_tvnow(), ast_samp2tv(cfg ? cfg->metricsInterval : 15, 1));
+		ao2_cleanup(cfg);
+		ts.tv_sec = next.tv_sec;
+		ts.tv_nsec = next.tv_usec * 1000;
+		ast_cond_timedwait(&cpaMetricsCond, &cpaMetricsLock, &ts);
+		if (cpaMetricsStop) {
+			break;
+		}
+		ast_mutex_unlock(&cpaMetricsLock);
+
+		/* Taken again, a reload may have changed metrics_file while we waited */
+		cfg = ao2_global_obj_ref(cpa_globals);
+		if (cfg && !ast_strlen_zero(cfg->metricsFile)) {
+			cpa_metrics_write(cfg->metricsFile);
+		}
+		ao2_cleanup(cfg);
+
+		ast_mutex_lock(&cpaMetricsLock);
+	}
+	ast_mutex_unlock(&cpaMetricsLock);
+
+	return NULL;
+}
+
+/*! The metrics URI is linked to the HTTP server */
+static int cpaMetricsLinked;
+
+/*!
+ * \brief Start or stop the metrics thread and HTTP endpoint as cfg asks
+ *
+ * The thread only runs while metrics_file is set and the endpoint is only
+ * there with metrics_http. NULL stops both, for unload.
+ */
+static void cpa_metrics_apply(struct cpa_config *cfg)
+{
+	int wantFile = cfg && !ast_strlen_zero(cfg->metricsFile);
+	int wantHttp = cfg && cfg->metricsHttp;
+
+	if (wantHttp && !cpaMetricsLinked) {
+		cpaMetricsLinked = !ast_http_uri_link(&cpa_metrics_uri);
+	} else if (!wantHttp && cpaMetricsLinked) {
+		ast_http_uri_unlink(&cpa_metrics_uri);
+		cpaMetricsLinked = 0;
+	}
+
+	if (wantFile && cpaMetricsThread == AST_PTHREADT_NULL) {
+		cpaMetricsStop = 0;
+		if (ast_pthread_create_background(&cpaMetricsThread, NULL, cpa_metrics_run, NULL)) {
+			ast_log(LOG_WARNING, "CPA: Unable to start the metrics thread, metrics_file will not be written\n");
+			cpaMetricsThread = AST_PTHREADT_NULL;
+		}
+	} else if (!wantFile && cpaMetricsThread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&cpaMetricsLock);
+		cpaMetricsStop = 1;
+		ast_cond_signal(&cpaMetricsCond);
+		ast_mutex_unlock(&cpaMetricsLock);
+		pthread_join(cpaMetricsThread, NULL);
+		cpaMetricsThread = AST_PTHREADT_NULL;
+	}
+}
+
+/*! \brief Drop the zones a recording did not run, so learning since does not change the replay */
+static void cpa_session_keep_zones(struct cpa_session *session, const char zones[][8], int numZones)
+{
+	int i, j, kept = 0;
+
+	for (i = 0; i < session->numZones; i++) {
+		for (j = 0; j < numZones && strcasecmp(session->zones[i].name, zones[j]); j++) {
+		}
+		if (j == numZones) {
+			ast_dsp_free(session->zones[i].dsp);
+			continue;
+		}
+		if (kept != i) {
+			session->zones[kept] = session->zones[i];
+		}
+		kept++;
+	}
+	session->numZones = kept;
+}
+
+/*!
+ * \brief Run a recording through a fresh session
+ *
+ * Mirrors the decisions of callProgress() event by event, so with the same
+ * profile the verdict comes out the same.
+ *
+ * \retval 0 and the session holds the verdict
+ * \retval -1 if the recording cannot be replayed
+ */
+static int cpa_session_replay(struct cpa_session *session, const char *map, size_t size, struct ast_cli_args *a)
+{
+	const struct cpa_record_header *header = (const struct cpa_record_header *) map;
+	struct cpa_batch batch;
+	struct ast_frame single = { .frametype = AST_FRAME_VOICE, };
+	size_t offset = sizeof(*header);
+	int hungUp = 0, done = 0;
+
+	if (cpa_session_init(session, header->profile, NULL, header->silenceThreshold, header->totalAnalysisTime)) {
+		ast_cli(a->fd, "Unable to create a session for profile '%s'\n", header->profile);
+		return -1;
+	}
+	cpa_session_keep_zones(session, header->zones, MIN(header->numZones, CPA_MAX_ZONES));
+	if (session->numZones != header->numZones) {
+		ast_cli(a->fd, "Profile '%s' no longer runs the zones of the recording\n", header->profile);
+		cpa_session_destroy(session);
+		return -1;
+	}
+	if (!ast_strlen_zero(header->impairment)) {
+		cpa_session_impair(session, header->impairment);
+		session->impairRand = header->impairRand;
+	}
+	session->holdMode = header->flags & CPA_RECORD_HOLD ? 1 : 0;
+	session->probeMode = header->flags & CPA_RECORD_PROBE ? 1 : 0;
+	session->eogMode = header->flags & CPA_RECORD_EOG ? 1 : 0;
+	session->eog.end = -1;
+
+	batch.frame.samples = 0;
+	while (!done && session->result == CPA_RESULT_NONE && offset + sizeof(struct cpa_record_event) <= size) {
+		const struct cpa_record_event *event = (const struct cpa_record_event *) (map + offset);
+		struct ast_frame frame = { .frametype = event->frametype, .src = "CPA", };
+
+		offset += sizeof(*event) + event->samples * 2;
+		if (offset > size) {
+			ast_cli(a->fd, "Recording ends inside an event\n");
+			break;
+		}
+
+		switch (event->type) {
+		case CPA_RECORD_FRAME:
+			if (event->frametype == AST_FRAME_VOICE) {
+				frame.subclass.format = ast_format_slin;
+				frame.data.ptr = (void *) (event + 1);
+				frame.samples = event->samples;
+				frame.datalen = event->samples * 2;
+				if (cpa_batch_append(&batch, &frame)) {
+					/* Live feeds a frame that does not batch on its own, after what was batched */
+					if (batch.frame.samples) {
+						cpa_session_feed_batch(session, &batch);
+						batch.frame.samples = 0;
+					}
+					single = frame;
+				}
+			} else if (event->frametype == AST_FRAME_DTMF_BEGIN || event->frametype == AST_FRAME_DTMF_END) {
+				cpa_session_finish(session, CPA_RESULT_FOUNDDTMF);
+			}
+			break;
+		case CPA_RECORD_FEED:
+			if (batch.frame.samples) {
+				cpa_session_feed_batch(session, &batch);
+				batch.frame.samples = 0;
+			} else if (single.samples) {
+				cpa_session_feed(session, &single);
+				single.samples = 0;
+			}
+			if (hungUp && session->result == CPA_RESULT_NONE) {
+				cpa_session_finish(session, CPA_RESULT_HUNGUP);
+			}
+			break;
+		case CPA_RECORD_HANGUP:
+			/* While draining, the frames read so far are still fed */
+			if (batch.frame.samples) {
+				hungUp = 1;
+			} else {
+				cpa_session_finish(session, CPA_RESULT_HUNGUP);
+			}
+			break;
+		case CPA_RECORD_NOMEDIA:
+			cpa_session_finish(session, CPA_RESULT_NOMEDIA);
+			break;
+		case CPA_RECORD_EXPIRED:
+			if (session->iTotalTime) {
+				cpa_session_finish(session, session->provisional != CPA_RESULT_NONE ? session->provisional : CPA_RESULT_TIMEOUT);
+			}
+			done = 1;
+			break;
+		}
+	}
+
+	if (session->result == CPA_RESULT_NONE) {
+		cpa_session_finish(session, CPA_RESULT_NOFRAMES);
+	}
 
-/* Set to the lowest ms value provided in cpa.conf or application parameters */
+	return 0;
+}
 
-static int dfltMaxWaitTimeForFrame  = 50;
-static int dfltSilenceThreshold     = 100;
-static int dfltTotalAnalysisTime    = 1000;
-static int dfltDTMFWait				= 0;
+static char *handle_cli_cpa_replay(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	const struct cpa_record_header *header;
+	struct cpa_session session;
+	struct stat st;
+	char *map;
+	int fd, same;
 
-void cpa2str(char cpaString[256], int cpa);
-void tone2str(char toneString[256], int tone);
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa replay";
+		e->usage =
+			"Usage: cpa replay <file>\n"
+			"       Runs a session recording through the profile it was made with,\n"
+			"       as configured now, and compares the verdict with the recorded one.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
 
-static void callProgress(struct ast_channel *chan, const char *data)
-{
-	int res = 0;
-	struct ast_frame *f = NULL;
-	//struct ast_frame *cpaf = NULL;
-	struct ast_dsp *cpadsp = NULL;
-	int dspnoise = 0, framelength = 0;
-	int iTotalTime = 0;
-	//int noiseDuration = 0;
-	int toneState = 0;	
-	int lastTone = 0;
-	int tcount = 0;
-	int dtmf = -1;
-	RAII_VAR(struct ast_format *, readFormat, NULL, ao2_cleanup);
-	char cpaStatus[256] = "";
-	//char toneStatus[256] = "";
-	char *parse = ast_strdupa(data);
-	//char progzone[10] = "us";
-	
-	/* Set defaults for tone chunks */
-	int THRESH_SILENCE = 12;	/*!< Silence for at least 240ms */
-	int THRESH_RING = 8;		/*!< Need at least 150ms ring to accept */
-	int THRESH_TALK = 2;		/*!< Talk detection does not work continuously */
-	int THRESH_BUSY = 4;		/*!< Need at least 80ms to accept */
-	int THRESH_CONGESTION = 4;		/*!< Need at least 80ms to accept */
-	int THRESH_HANGUP = 60;		/*!< Need at least 1300ms to accept hangup */
+	if (a->argc != e->args + 1) {
+		return CLI_SHOWUSAGE;
+	}
 
-	/* Lets set the initial values of the variables that will control the algorithm.
-	   The initial values are the default ones. If they are passed as arguments
-	   when invoking the application, then the default values will be overwritten
-	   by the ones passed as parameters. */
-	int maxWaitTimeForFrame  = dfltMaxWaitTimeForFrame;
-	int silenceThreshold     = dfltSilenceThreshold;
-	int totalAnalysisTime    = dfltTotalAnalysisTime;	
-	int dtmfWait 	  		 = dfltDTMFWait;	
+	if ((fd = open(a->argv[2], O_RDONLY)) < 0) {
+		ast_cli(a->fd, "Unable to open '%s': %s\n", a->argv[2], strerror(errno));
+		return CLI_FAILURE;
+	}
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(*header)) {
+		ast_cli(a->fd, "'%s' is truncated\n", a->argv[2]);
+		close(fd);
+		return CLI_FAILURE;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ast_cli(a->fd, "Unable to map '%s': %s\n", a->argv[2], strerror(errno));
+		return CLI_FAILURE;
+	}
 
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(argSilenceThreshold);
-		AST_APP_ARG(argTotalAnalysisTime);
-		AST_APP_ARG(argDTMFWait);
-	);
+	header = (const struct cpa_record_header *) map;
+	if (memcmp(header->magic, CPA_RECORD_MAGIC, sizeof(header->magic)) || header->version != CPA_RECORD_VERSION) {
+		ast_cli(a->fd, "'%s' is not a CPA recording of version %d\n", a->argv[2], CPA_RECORD_VERSION);
+		munmap(map, st.st_size);
+		return CLI_FAILURE;
+	}
+	if (header->flags & CPA_RECORD_TRUNCATED) {
+		ast_cli(a->fd, "The recording was truncated at %d bytes, the replay stops early\n", CPA_RECORD_MAX);
+	}
 
-	if (!ast_strlen_zero(parse)) {
-		/* Some arguments have been passed. Lets parse them and overwrite the defaults. */
-		AST_STANDARD_APP_ARGS(args, parse);
-		if (!ast_strlen_zero(args.argSilenceThreshold))
-			silenceThreshold = atoi(args.argSilenceThreshold);
-		if (!ast_strlen_zero(args.argTotalAnalysisTime))
-			totalAnalysisTime = atoi(args.argTotalAnalysisTime);
-		if (!ast_strlen_zero(args.argDTMFWait))
-			dtmfWait = atoi(args.argDTMFWait);
-	} else {
-		ast_debug(1, "CPA using the default parameters.\n");
+	if (cpa_session_replay(&session, map, st.st_size, a)) {
+		munmap(map, st.st_size);
+		return CLI_FAILURE;
 	}
 
-	if (maxWaitTimeForFrame > totalAnalysisTime)
-		maxWaitTimeForFrame = totalAnalysisTime;
+	same = session.result == header->result && session.resultTime == header->resultTime;
+	ast_cli(a->fd, "Call [%s] profile [%s]\n", header->uniqueid, header->profile);
+	ast_cli(a->fd, "Recorded: %s at %dms\n", header->result < CPA_RESULT_MAX ? cpa_result_names[header->result] : "?", header->resultTime);
+	ast_cli(a->fd, "Replayed: %s at %dms\n", cpa_result_names[session.result], session.resultTime);
+	ast_cli(a->fd, "%s\n", same ? "Identical" : "DIFFERENT");
 
-	/* Now we're ready to roll! */
-	ast_verb(3, "CPA: maxWaitTimeForFrame [%d] silenceThreshold [%d] totalAnalysisTime [%d] dtmfWait [%d]\n",
-				maxWaitTimeForFrame, silenceThreshold, totalAnalysisTime, dtmfWait);
-	
+	cpa_session_destroy(&session);
+	munmap(map, st.st_size);
 
-	/*! All THRESH_XXX values are in GSAMP_SIZE chunks (us = 22ms) */
-	THRESH_SILENCE = silenceThreshold / 20;	/*!< Silence for at least 240ms */
-	//THRESH_RING = 8;		/*!< Need at least 150ms ring to accept */
-	//THRESH_TALK = 2;		/*!< Talk detection does not work continuously */
-	//THRESH_BUSY = 4;		/*!< Need at least 80ms to accept */
-	//THRESH_CONGESTION = 4;		/*!< Need at least 80ms to accept */
-	//THRESH_HANGUP = 60;		/*!< Need at least 1300ms to accept hangup */
-	//THRESH_RING2ANSWER = 300;	/*!< Timeout from start of ring to answer (about 6600 ms) */
-	
-	
+	return CLI_SUCCESS;
+}
 
-	/* Set read format to signed linear so we get signed linear frames in */
-	readFormat = ao2_bump(ast_channel_readformat(chan));
-	if (ast_set_read_format(chan, ast_format_slin) < 0 ) {
-		ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to set to linear mode, giving up\n", ast_channel_name(chan));
-		pbx_builtin_setvar_helper(chan , "CPASTATUS", "NOTSLIN");
-		return;
+static char *handle_cli_cpa_keyword_test(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	RAII_VAR(struct cpa_profile *, profile, NULL, ao2_cleanup);
+	struct cpa_kws *kws;
+	struct timeval start;
+	struct stat st;
+	int16_t *samples;
+	int64_t elapsed = 0;
+	int fd, count, n, i, match;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "cpa keyword test";
+		e->usage =
+			"Usage: cpa keyword test <profile> <file>\n"
+			"       Runs a raw 8kHz signed linear recording through the keyword\n"
+			"       spotter of a profile. Shows every keyword heard and when, the\n"
+			"       closest each keyword came (dB per band, compare keyword_threshold)\n"
+			"       and the time spent per second of audio.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
 	}
 
-	/* Create a new DSP for call progress */
-	if (!(cpadsp = ast_dsp_new())) {
-		ast_log(LOG_WARNING, "CPA: Channel [%s]. Unable to create DSP :(\n", ast_channel_name(chan));
-		pbx_builtin_setvar_helper(chan , "CPASTATUS", "NODETECTOR");
-		return;
+	if (a->argc != e->args + 2) {
+		return CLI_SHOWUSAGE;
 	}
-	//ast_dsp_set_call_progress_zone(cpadsp, progzone);
 
-	/* Set silence threshold to specified value */
-	//ast_debug(1, "CPA setting silence threshold: [%d]\n", silenceThreshold);
-	//ast_dsp_set_threshold(cpadsp, silenceThreshold);
+	if (!(cfg = ao2_global_obj_ref(cpa_globals)) || !(profile = ao2_find(cfg->profiles, a->argv[3], OBJ_SEARCH_KEY))) {
+		ast_cli(a->fd, "No profile '%s'\n", a->argv[3]);
+		return CLI_FAILURE;
+	}
+	if (!profile->numKeywords) {
+		ast_cli(a->fd, "Profile '%s' has no keywords\n", profile->name);
+		return CLI_FAILURE;
+	}
 
-	/* First, if DTMF Wait is greater than 0, wait that many ms for DTMF to determine if there is an attempted phreak attack */
-/*	if (dtmfWait > 0) {
-		ast_debug(1, "CPA: Waiting for DTMF on Channel [%s] for [%d]ms.\n", ast_channel_name(chan), dtmfWait);
-		dtmf = ast_waitfordigit(chan, dtmfWait);
-		if (dtmf) {
-			ast_verb(3, "CPA: Channel [%s] has incoming DTMF, Digit received: [%d]\n", ast_channel_name(chan), dtmf);
-			strcpy(cpaStatus , "FoundDTMF");
-			res = 1;
-		} else {
-			ast_debug(1, "CPA: No DTMF detected on Channel [%s] after [%d]ms\n", ast_channel_name(chan), dtmfWait);
+	if ((fd = open(a->argv[4], O_RDONLY)) < 0) {
+		ast_cli(a->fd, "Unable to open '%s': %s\n", a->argv[4], strerror(errno));
+		return CLI_FAILURE;
+	}
+	if (fstat(fd, &st) || !(samples = ast_malloc(st.st_size + 1))) {
+		close(fd);
+		return CLI_FAILURE;
+	}
+	if (read(fd, samples, st.st_size) != st.st_size) {
+		ast_cli(a->fd, "Unable to read '%s'\n", a->argv[4]);
+		close(fd);
+		ast_free(samples);
+		return CLI_FAILURE;
+	}
+	close(fd);
+	count = st.st_size / sizeof(*samples);
+
+	if (!(kws = ast_calloc(1, sizeof(*kws)))) {
+		ast_free(samples);
+		return CLI_FAILURE;
+	}
+	cpa_kws_reset(kws);
+
+	/* Fed in 20ms frames like a channel would */
+	for (n = 0; n < count; n += CPA_BENCH_FRAME) {
+		start = ast_tvnow();
+		match = cpa_kws_process(kws, profile, samples + n, MIN(CPA_BENCH_FRAME, count - n));
+		elapsed += ast_tvdiff_us(ast_tvnow(), start);
+		if (match >= 0) {
+			float best[CPA_KWS_MAX];
+
+			ast_cli(a->fd, "%7dms  %s\n", (n + CPA_BENCH_FRAME) / DEFAULT_SAMPLES_PER_MS,
+				profile->keywords[match].phrase);
+			/* Keep listening for the next one, without losing the closest distances */
+			memcpy(best, kws->best, sizeof(best));
+			cpa_kws_reset(kws);
+			memcpy(kws->best, best, sizeof(best));
 		}
-	}*/
+	}
+	ast_free(samples);
 
-	/* Now we go into a loop waiting for frames from the channel */
-	while ((res = ast_waitfor(chan, 2 * maxWaitTimeForFrame)) > -1) {
-		/* If we fail to read in a frame, that means they hung up */
-		if (!(f = ast_read(chan))) {
-			ast_verb(3, "CPA: Channel [%s]. Hungup\n", ast_channel_name(chan));
-			ast_debug(1, "Got hangup\n");
-			strcpy(cpaStatus, "Hungup");
-			res = 1;
-			break;
+	ast_cli(a->fd, "\n%-40s %6s %8s\n", "Keyword", "Frames", "Closest");
+	for (i = 0; i < profile->numKeywords; i++) {
+		if (kws->best[i] < CPA_KWS_INF) {
+			ast_cli(a->fd, "%-40s %6d %8.1f\n", profile->keywords[i].phrase, profile->keywords[i].numFrames, kws->best[i]);
+		} else {
+			ast_cli(a->fd, "%-40s %6d %8s\n", profile->keywords[i].phrase, profile->keywords[i].numFrames, "-");
 		}
+	}
+	ast_cli(a->fd, "\n%d template frames, %.1fus per second of audio (%.3f%% of a core)\n", profile->keywordFrames,
+		count ? (double) elapsed * 8000 / count : 0.0, count ? (double) elapsed * 8000 / count / 10000 : 0.0);
+	ast_free(kws);
 
-		ast_debug(1, "CPA checking frametype: [%d].\n", f->frametype);
+	return CLI_SUCCESS;
+}
 
-		if (f->frametype == AST_FRAME_DTMF_BEGIN || f->frametype == AST_FRAME_DTMF_END){
-			ast_verb(3, "CPA: Channel [%s] has incoming DTMF, Digit received: [%d]\n", ast_channel_name(chan), f->subclass.integer);
-			strcpy(cpaStatus , "FoundDTMF");
-			res = 1;	
-			break;
-		}
+static struct ast_cli_entry cli_cpa[] = {
+	AST_CLI_DEFINE(handle_cli_cpa_show_profiles, "Show CPA profiles"),
+	AST_CLI_DEFINE(handle_cli_cpa_show_stats, "Show CPA statistics"),
+	AST_CLI_DEFINE(handle_cli_cpa_show_selection, "Show CPA profile selection per trunk"),
+	AST_CLI_DEFINE(handle_cli_cpa_show_trunks, "Show CPA trunk health"),
+	AST_CLI_DEFINE(handle_cli_cpa_show_sessions, "Show active CPA sessions"),
+	AST_CLI_DEFINE(handle_cli_cpa_state, "Export or import learned CPA state"),
+	AST_CLI_DEFINE(handle_cli_cpa_benchmark, "Benchmark the CPA tone detectors"),
+	AST_CLI_DEFINE(handle_cli_cpa_keyword_test, "Run a recording through a profile's keyword spotter"),
+	AST_CLI_DEFINE(handle_cli_cpa_scan_features, "Replay a CPA feature store through the profiles"),
+	AST_CLI_DEFINE(handle_cli_cpa_replay, "Replay a recorded CPA session"),
+};
 
-		//if (f->frametype == AST_FRAME_VOICE || f->frametype == AST_FRAME_NULL || f->frametype == AST_FRAME_CNG) {
-		if (f->frametype == AST_FRAME_VOICE) {
-			/* If the total time exceeds the analysis time then give up as we are not too sure */
-			if (f->frametype == AST_FRAME_VOICE) {
-				framelength = (ast_codec_samples_count(f) / DEFAULT_SAMPLES_PER_MS);
-				ast_debug(1, "Frametype = AST_FRAME_VOICE. Framelength = [%d]\n", framelength);
+/*! \brief Parse a type=profile category of cpa.conf */
+static struct cpa_profile *load_profile(struct ast_config *cfg, const char *cat)
+{
+	struct cpa_profile *profile;
+	struct ast_variable *var;
+
+	if (!(profile = cpa_profile_alloc(cat))) {
+		return NULL;
+	}
+
+	for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+		if (!strcasecmp(var->name, "type")) {
+			continue;
+		} else if (!strcasecmp(var->name, "silence_threshold")) {
+			profile->silenceThreshold = atoi(var->value);
+		} else if (!strcasecmp(var->name, "ring_threshold")) {
+			profile->threshRing = atoi(var->value);
+		} else if (!strcasecmp(var->name, "talk_threshold")) {
+			profile->threshTalk = atoi(var->value);
+		} else if (!strcasecmp(var->name, "busy_threshold")) {
+			profile->threshBusy = atoi(var->value);
+		} else if (!strcasecmp(var->name, "congestion_threshold")) {
+			profile->threshCongestion = atoi(var->value);
+		} else if (!strcasecmp(var->name, "hangup_threshold")) {
+			profile->threshHangup = atoi(var->value);
+		} else if (!strcasecmp(var->name, "hold_min_time")) {
+			profile->holdMinTime = atoi(var->value);
+		} else if (!strcasecmp(var->name, "hold_human_silence")) {
+			profile->holdHumanSilence = atoi(var->value);
+		} else if (!strcasecmp(var->name, "hold_max_time")) {
+			profile->holdMaxTime = atoi(var->value);
+		} else if (!strcasecmp(var->name, "hold_duty")) {
+			profile->holdDuty = MAX(atoi(var->value), 1);
+		} else if (!strcasecmp(var->name, "engine")) {
+			if (!strcasecmp(var->value, "native")) {
+				profile->engine = CPA_ENGINE_NATIVE;
+			} else if (!strcasecmp(var->value, "dsp")) {
+				profile->engine = CPA_ENGINE_DSP;
 			} else {
-				framelength = 2 * maxWaitTimeForFrame;
-				ast_debug(1, "Frametype != AST_FRAME_VOICE. Framelength = [%d]\n", framelength);
+				ast_log(LOG_WARNING, "%s: Cat:%s. Unknown engine '%s' at line %d of cpa.conf\n",
+					app, cat, var->value, var->lineno);
 			}
+		} else if (!strcasecmp(var->name, "decimate")) {
+			profile->decimate = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "screening")) {
+			profile->screening = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "cadence")) {
+			profile->cadence = ast_true(var->value);
+		} else if (!strcasecmp(var->name, "screen_min_speech")) {
+			profile->screenMinSpeech = atoi(var->value);
+		} else if (!strcasecmp(var->name, "screen_wait_silence")) {
+			profile->screenWaitSilence = atoi(var->value);
+		} else if (!strcasecmp(var->name, "screen_max_variation")) {
+			profile->screenMaxVariation = atoi(var->value);
+		} else if (!strcasecmp(var->name, "probe_tone")) {
+			ast_copy_string(profile->probeTone, var->value, sizeof(profile->probeTone));
+		} else if (!strcasecmp(var->name, "probe_window")) {
+			profile->probeWindow = atoi(var->value);
+		} else if (!strcasecmp(var->name, "probe_human_burst")) {
+			profile->probeHumanBurst = atoi(var->value);
+		} else if (!strcasecmp(var->name, "eog_min_speech")) {
+			profile->eogMinSpeech = atoi(var->value);
+		} else if (!strcasecmp(var->name, "eog_silence")) {
+			profile->eogSilence = atoi(var->value);
+		} else if (!strcasecmp(var->name, "eog_margin")) {
+			profile->eogMargin = 256 * pow(10.0, atof(var->value) / 20.0);
+		} else if (!strcasecmp(var->name, "eog_max_wait")) {
+			profile->eogMaxWait = atoi(var->value);
+		} else if (!strcasecmp(var->name, "keyword_threshold")) {
+			profile->keywordThreshold = atoi(var->value);
+		} else if (!strcasecmp(var->name, "keyword")) {
+			/* phrase,recording */
+			char *phrase = ast_strdupa(var->value);
+			char *file = strrchr(phrase, ',');
 
-			iTotalTime += framelength;
-			if (iTotalTime >= totalAnalysisTime) {
-				ast_verb(3, "CPA: Channel [%s]. Detection Timeout...\n", ast_channel_name(chan));
-				ast_frfree(f);
-				if(cpaStatus == "") {
-					strcpy(cpaStatus , "Timeout");
-				}
-				break;
+			if (!file || ast_strlen_zero(ast_strip(file + 1))) {
+				ast_log(LOG_WARNING, "%s: Cat:%s. keyword takes phrase,recording at line %d of cpa.conf\n",
+					app, cat, var->lineno);
+				continue;
+			}
+			*file++ = '\0';
+			if (profile->numKeywords == CPA_KWS_MAX) {
+				ast_log(LOG_WARNING, "%s: Only %d keywords per profile are supported, ignoring '%s' at line %d of cpa.conf\n",
+					app, CPA_KWS_MAX, phrase, var->lineno);
+				continue;
 			}
+			if (!cpa_keyword_load(&profile->keywords[profile->numKeywords], ast_strip(phrase), ast_strip(file),
+				CPA_KWS_BUDGET - profile->keywordFrames)) {
+				profile->keywordFrames += profile->keywords[profile->numKeywords++].numFrames;
+			}
+		} else if (!strcasecmp(var->name, "zones")) {
+			char *zones = ast_strdupa(var->value);
+			char *zone;
 
-			ast_debug(1, "CPA Checking Call Progress.\n");
-			if (ast_dsp_call_progress(cpadsp, f) > 0){
-				ast_debug(1, "CPA: Wait what? Frame Control came back as NOT SILENCE on channel [%s]\n", ast_channel_name(chan));
-			}
-			
-			ast_debug(1, "CPA pulling tonestate.\n");
-			toneState = ast_dsp_get_tstate(cpadsp);
-			ast_debug(1, "CPA Frame - Frametype: [%d] Subclass: [%d] DSP ToneState: [%d]\n", f->frametype, f->subclass.integer, toneState);
-			
-			if (toneState == lastTone){
-				tcount = ast_dsp_get_tcount(cpadsp);
-				ast_debug(1, "CPA ToneState Repeated - lastTone: [%d] toneState: [%d] tcount: [%d]\n", lastTone, toneState, tcount);
-				switch (toneState) {
-					case DSP_TONE_STATE_RINGING:
-						if (tcount == THRESH_RING) {
-							strcpy(cpaStatus, "Ringing");
-							ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpaStatus);
-							res = 1;
-						}
-						break;
-					case DSP_TONE_STATE_SILENCE:
-						if (tcount > THRESH_SILENCE) {
-							strcpy(cpaStatus, "Silence");
-							ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpaStatus);
-							//res = 1;
-						}
-						break;
-					case DSP_TONE_STATE_BUSY:
-						if (tcount == THRESH_BUSY) {
-							strcpy(cpaStatus, "Busy");
-							ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpaStatus);
-							res = 1;
-						}
-						break;
-					case DSP_TONE_STATE_TALKING:
-						if (tcount == THRESH_TALK) {
-							strcpy(cpaStatus, "Talking");
-							ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpaStatus);
-							res = 1;
-						}
-						break;
-					case DSP_TONE_STATE_SPECIAL3:
-						if (tcount == THRESH_CONGESTION) {
-							strcpy(cpaStatus, "Congestion");
-							ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpaStatus);
-							res = 1;
-						}
-						break;
-					case DSP_TONE_STATE_HUNGUP:
-						if (tcount == THRESH_HANGUP) {
-							strcpy(cpaStatus, "Hungup");
-							ast_debug(1, "CPA Result - Channel: [%s] CPAStatus: [%s]\n", ast_channel_name(chan), cpaStatus);
-							res = 1;
-						}
-						break;
+			profile->numZones = 0;
+			while ((zone = strsep(&zones, ","))) {
+				zone = ast_strip(zone);
+				if (ast_strlen_zero(zone)) {
+					continue;
 				}
-				if(res == 1) {
+				if (profile->numZones == CPA_MAX_ZONES) {
+					ast_log(LOG_WARNING, "%s: Only %d zones per profile are supported, ignoring '%s' at line %d of cpa.conf\n",
+						app, CPA_MAX_ZONES, zone, var->lineno);
 					break;
 				}
-			} else {
-				ast_debug(1, "Stop state %d with duration %d\n", lastTone, tcount);
-				ast_debug(1, "Start state %d\n", toneState);
-				lastTone = toneState;
-				tcount = 1;
+				ast_copy_string(profile->zones[profile->numZones++], zone, sizeof(profile->zones[0]));
 			}
-
-
+		} else {
+			ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of cpa.conf\n",
+				app, cat, var->name, var->lineno);
 		}
-		//ast_debug(1, "dspnoise: [%dms]\n", dspnoise);
-		ast_frfree(f);
-
-	}
-
-	ast_debug(1, "Frame Read For: [%dms], CPA returned: [%s]\n", dspnoise, cpaStatus);
-	
-	if (!res) {
-		/* There was no frame to analyze, something's wrong with the channel!. */
-		ast_verb(3, "CPA: No Frames Collected for Channel [%s], something is wrong with this channel.\n", ast_channel_name(chan));
-		strcpy(cpaStatus , "NoFrames");
 	}
 
-	/* Set the status and cause on the channel */
-	pbx_builtin_setvar_helper(chan , "CPASTATUS" , cpaStatus);
-	ast_verb(3, "CPA: Channel [%s] - Frame Length: [%d] - iTotalTime: [%d] - res: [%d]\n", ast_channel_name(chan), framelength, iTotalTime, res);
+	return profile;
+}
 
-	/* Restore channel read format */
-	if (readFormat && ast_set_read_format(chan, readFormat))
-		ast_log(LOG_WARNING, "CPA: Unable to restore read format on '%s'\n", ast_channel_name(chan));
+/*! \brief Convert a dB figure from cpa.conf to a linear factor */
+static double cpa_db2lin(const char *value)
+{
+	return pow(10.0, atof(value) / 20.0);
+}
 
-	/* Free the DSP used to detect silence */
-	ast_dsp_free(cpadsp);
+/*! \brief Parse a type=impairment category of cpa.conf */
+static struct cpa_impairment *load_impairment(struct ast_config *cfg, const char *cat)
+{
+	struct cpa_impairment *impairment;
+	struct ast_variable *var;
 
-	return;
-}			
+	if (!(impairment = ao2_alloc(sizeof(*impairment), NULL))) {
+		return NULL;
+	}
+	ast_copy_string(impairment->name, cat, sizeof(impairment->name));
 
-void cpa2str(char cpaString[256], int cpa)
-{
-	//char cpaString[256] = "";
-	switch (cpa) {
-		case 0:
-			strcpy(cpaString, "Silence");
-			break;
-		case AST_CONTROL_HANGUP:
-			strcpy(cpaString, "Hangup");
-			break;			
-		case AST_CONTROL_RINGING:
-			strcpy(cpaString, "Ringing");
-			break;
-		case AST_CONTROL_ANSWER:
-			strcpy(cpaString, "Answer");
-			break;
-		case AST_CONTROL_BUSY:
-			strcpy(cpaString, "Busy");
-			break;
-		case AST_CONTROL_CONGESTION:
-			strcpy(cpaString, "Congestion");
-			break;
-		case -1:
-			strcpy(cpaString, "Negative One! Uh Oh!!!");
-			break;
-		default:
-			ast_log(LOG_WARNING, "Unknown CPA: '%d'", cpa);
-			strcpy(cpaString, "Unknown");
+	for (var = ast_variable_browse(cfg, cat); var; var = var->next) {
+		struct cpa_impairment_stage *stage = &impairment->stages[impairment->numStages];
 
+		if (!strcasecmp(var->name, "type")) {
+			continue;
+		} else if (!strcasecmp(var->name, "seed")) {
+			impairment->seed = strtoul(var->value, NULL, 10);
+			continue;
+		} else if (impairment->numStages == CPA_MAX_IMPAIRMENTS) {
+			ast_log(LOG_WARNING, "%s: Cat:%s. Only %d impairments per chain, ignoring %s at line %d of cpa.conf\n",
+				app, cat, CPA_MAX_IMPAIRMENTS, var->name, var->lineno);
+			continue;
 		}
-}
 
-void tone2str(char toneString[256], int tone)
-{
-	//char cpaString[256] = "";
-	switch (tone) {
-		case DSP_TONE_STATE_SILENCE:
-			strcpy(toneString, "Silence");
-			break;
-		case DSP_TONE_STATE_HUNGUP:
-			strcpy(toneString, "Hungup");
-			break;			
-		case DSP_TONE_STATE_RINGING:
-			strcpy(toneString, "Ringing");
-			break;
-		case DSP_TONE_STATE_TALKING:
-			strcpy(toneString, "Talking");
-			break;
-		case DSP_TONE_STATE_BUSY:
-			strcpy(toneString, "Busy");
-			break;
-		case DSP_TONE_STATE_SPECIAL1:
-			strcpy(toneString, "Special1");
-			break;
-		case DSP_TONE_STATE_SPECIAL2:
-			strcpy(toneString, "Special2");
-			break;
-		case DSP_TONE_STATE_SPECIAL3:
-			strcpy(toneString, "Special3");
-			break;						
-		case -1:
-			strcpy(toneString, "Negative One! Uh Oh!!!");
-			break;
-		default:
-			ast_log(LOG_WARNING, "Unknown Tone: '%d'", tone);
-			strcpy(toneString, "Unknown");
+		if (!strcasecmp(var->name, "gain")) {
+			stage->type = CPA_IMPAIR_GAIN;
+			stage->value = 256 * cpa_db2lin(var->value);
+		} else if (!strcasecmp(var->name, "noise")) {
+			stage->type = CPA_IMPAIR_NOISE;
+			stage->value = 32767 * cpa_db2lin(var->value);
+		} else if (!strcasecmp(var->name, "loss")) {
+			/* percent[/burst] */
+			const char *burst = strchr(var->value, '/');
 
+			stage->type = CPA_IMPAIR_LOSS;
+			stage->value = atoi(var->value);
+			stage->burst = burst ? MAX(atoi(burst + 1), 1) : 1;
+		} else if (!strcasecmp(var->name, "clip")) {
+			stage->type = CPA_IMPAIR_CLIP;
+			stage->value = MIN(32767 * cpa_db2lin(var->value), 32767);
+		} else if (!strcasecmp(var->name, "codec") && !strcasecmp(var->value, "ulaw")) {
+			stage->type = CPA_IMPAIR_ULAW;
+		} else if (!strcasecmp(var->name, "codec") && !strcasecmp(var->value, "alaw")) {
+			stage->type = CPA_IMPAIR_ALAW;
+		} else {
+			ast_log(LOG_WARNING, "%s: Cat:%s. Unknown impairment %s = %s at line %d of cpa.conf\n",
+				app, cat, var->name, var->value, var->lineno);
+			continue;
 		}
-}
-
-static int cpa_exec(struct ast_channel *chan, const char *data)
-{
-	callProgress(chan, data);
+		impairment->numStages++;
+	}
 
-	return 0;
+	return impairment;
 }
 
 static int load_config(int reload)
@@ -450,8 +7518,14 @@ static int load_config(int reload)
 	char *cat = NULL;
 	struct ast_variable *var = NULL;
 	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	RAII_VAR(struct cpa_config *, newcfg, NULL, ao2_cleanup);
+	RAII_VAR(struct cpa_config *, oldcfg, NULL, ao2_cleanup);
+	struct cpa_profile *profile;
+	struct cpa_impairment *impairment;
+	struct ao2_iterator i;
 
 	dfltSilenceThreshold = ast_dsp_get_threshold_from_settings(THRESHOLD_SILENCE);
+	cpaEnergyThreshold = ast_dsp_get_threshold_from_settings(THRESHOLD_SILENCE);
 
 	if (!(cfg = ast_config_load("cpa.conf", config_flags))) {
 		ast_log(LOG_ERROR, "Configuration file cpa.conf missing.\n");
@@ -463,6 +7537,11 @@ static int load_config(int reload)
 		return -1;
 	}
 
+	if (!(newcfg = cpa_config_alloc())) {
+		ast_config_destroy(cfg);
+		return -1;
+	}
+
 	cat = ast_category_browse(cfg, NULL);
 
 	while (cat) {
@@ -473,26 +7552,220 @@ static int load_config(int reload)
 					dfltSilenceThreshold = atoi(var->value);
 				} else if (!strcasecmp(var->name, "total_analysis_time")) {
 					dfltTotalAnalysisTime = atoi(var->value);
+				} else if (!strcasecmp(var->name, "shadow_profiles")) {
+					char *names = ast_strdupa(var->value);
+					char *name;
+
+					newcfg->numShadowProfiles = 0;
+					while ((name = strsep(&names, ","))) {
+						name = ast_strip(name);
+						if (ast_strlen_zero(name)) {
+							continue;
+						}
+						if (newcfg->numShadowProfiles == CPA_MAX_SHADOWS) {
+							ast_log(LOG_WARNING, "%s: Only %d shadow profiles are supported, ignoring '%s' at line %d of cpa.conf\n",
+								app, CPA_MAX_SHADOWS, name, var->lineno);
+							break;
+						}
+						ast_copy_string(newcfg->shadowProfiles[newcfg->numShadowProfiles++], name, AST_MAX_CONTEXT);
+					}
+				} else if (!strcasecmp(var->name, "auto_profiles")) {
+					char *names = ast_strdupa(var->value);
+					char *name;
+
+					newcfg->numAutoProfiles = 0;
+					while ((name = strsep(&names, ","))) {
+						name = ast_strip(name);
+						if (ast_strlen_zero(name)) {
+							continue;
+						}
+						if (newcfg->numAutoProfiles == CPA_MAX_AUTO) {
+							ast_log(LOG_WARNING, "%s: Only %d auto profiles are supported, ignoring '%s' at line %d of cpa.conf\n",
+								app, CPA_MAX_AUTO, name, var->lineno);
+							break;
+						}
+						ast_copy_string(newcfg->autoProfiles[newcfg->numAutoProfiles++], name, AST_MAX_CONTEXT);
+					}
+				} else if (!strcasecmp(var->name, "auto_min_accuracy")) {
+					newcfg->autoMinAccuracy = atoi(var->value);
+				} else if (!strcasecmp(var->name, "auto_min_samples")) {
+					newcfg->autoMinSamples = MAX(atoi(var->value), 1);
+				} else if (!strcasecmp(var->name, "auto_explore_percent")) {
+					newcfg->autoExplorePercent = atoi(var->value);
+				} else if (!strcasecmp(var->name, "trunk_failures")) {
+					char *names = ast_strdupa(var->value);
+					char *name;
+					int result;
+
+					newcfg->trunkFailures = 0;
+					while ((name = strsep(&names, ","))) {
+						name = ast_strip(name);
+						for (result = CPA_RESULT_NONE + 1; result < CPA_RESULT_MAX; result++) {
+							if (!strcasecmp(cpa_result_names[result], name)) {
+								newcfg->trunkFailures |= 1 << result;
+								break;
+							}
+						}
+						if (result == CPA_RESULT_MAX && !ast_strlen_zero(name)) {
+							ast_log(LOG_WARNING, "%s: Unknown status '%s' in trunk_failures at line %d of cpa.conf\n",
+								app, name, var->lineno);
+						}
+					}
+				} else if (!strcasecmp(var->name, "trunk_window")) {
+					newcfg->trunkWindow = MAX(atoi(var->value), 1);
+				} else if (!strcasecmp(var->name, "trunk_min_calls")) {
+					newcfg->trunkMinCalls = atoi(var->value);
+					if (newcfg->trunkMinCalls > CPA_TRUNK_HISTORY) {
+						ast_log(LOG_WARNING, "%s: trunk_min_calls is at most %d, not %d at line %d of cpa.conf\n",
+							app, CPA_TRUNK_HISTORY, newcfg->trunkMinCalls, var->lineno);
+						newcfg->trunkMinCalls = CPA_TRUNK_HISTORY;
+					}
+				} else if (!strcasecmp(var->name, "trunk_dominance")) {
+					newcfg->trunkDominance = atoi(var->value);
+				} else if (!strcasecmp(var->name, "shadow_sample_percent")) {
+					newcfg->shadowSamplePercent = atoi(var->value);
+				} else if (!strcasecmp(var->name, "learn_prefix_length")) {
+					newcfg->learnPrefixLength = atoi(var->value);
+				} else if (!strcasecmp(var->name, "learn_min_hits")) {
+					newcfg->learnMinHits = atoi(var->value);
+				} else if (!strcasecmp(var->name, "snapshot_file")) {
+					ast_copy_string(newcfg->snapshotFile, var->value, sizeof(newcfg->snapshotFile));
+				} else if (!strcasecmp(var->name, "metrics_file")) {
+					ast_copy_string(newcfg->metricsFile, var->value, sizeof(newcfg->metricsFile));
+				} else if (!strcasecmp(var->name, "metrics_interval")) {
+					newcfg->metricsInterval = MAX(atoi(var->value), 1);
+				} else if (!strcasecmp(var->name, "metrics_http")) {
+					newcfg->metricsHttp = ast_true(var->value);
+				} else if (!strcasecmp(var->name, "feature_file")) {
+					ast_copy_string(newcfg->featureFile, var->value, sizeof(newcfg->featureFile));
+				} else if (!strcasecmp(var->name, "record_dir")) {
+					ast_copy_string(newcfg->recordDir, var->value, sizeof(newcfg->recordDir));
+				} else if (!strcasecmp(var->name, "record_sample_percent")) {
+					newcfg->recordSamplePercent = atoi(var->value);
+				} else if (!strcasecmp(var->name, "no_media_grace")) {
+					newcfg->noMediaGrace = atoi(var->value);
+				} else if (!strcasecmp(var->name, "max_batch_ms")) {
+					newcfg->maxBatchMs = MAX(atoi(var->value), 0);
+				} else if (!strcasecmp(var->name, "monitor_duty")) {
+					newcfg->monitorDuty = MAX(atoi(var->value), 1);
+				} else if (!strcasecmp(var->name, "monitor_music_time")) {
+					newcfg->monitorMusicTime = atoi(var->value);
+				} else if (!strcasecmp(var->name, "monitor_tone_time")) {
+					newcfg->monitorToneTime = atoi(var->value);
+				} else if (!strcasecmp(var->name, "monitor_hiss_time")) {
+					newcfg->monitorHissTime = atoi(var->value);
 				} else {
 					ast_log(LOG_WARNING, "%s: Cat:%s. Unknown keyword %s at line %d of cpa.conf\n",
 						app, cat, var->name, var->lineno);
 				}
 				var = var->next;
 			}
+		} else if (!strcasecmp(S_OR(ast_variable_retrieve(cfg, cat, "type"), ""), "profile")) {
+			if ((profile = load_profile(cfg, cat))) {
+				ao2_link(newcfg->profiles, profile);
+				ao2_ref(profile, -1);
+			}
+		} else if (!strcasecmp(S_OR(ast_variable_retrieve(cfg, cat, "type"), ""), "impairment")) {
+			if ((impairment = load_impairment(cfg, cat))) {
+				ao2_link(newcfg->impairments, impairment);
+				ao2_ref(impairment, -1);
+			}
 		}
 		cat = ast_category_browse(cfg, cat);
 	}
 
 	ast_config_destroy(cfg);
 
-	ast_verb(3, "CPA defaults: totalAnalysisTime [%d] silenceThreshold [%d]\n",	dfltTotalAnalysisTime, dfltSilenceThreshold);
+	if (!(profile = ao2_find(newcfg->profiles, "default", OBJ_SEARCH_KEY))) {
+		if ((profile = cpa_profile_alloc("default"))) {
+			ao2_link(newcfg->profiles, profile);
+		}
+	}
+	ao2_cleanup(profile);
+
+	/* Keep the shadow statistics of profiles that survive the reload */
+	if ((oldcfg = ao2_global_obj_ref(cpa_globals))) {
+		i = ao2_iterator_init(newcfg->profiles, 0);
+		while ((profile = ao2_iterator_next(&i))) {
+			struct cpa_profile *old = ao2_find(oldcfg->profiles, profile->name, OBJ_SEARCH_KEY);
+
+			if (old) {
+				profile->shadowStats = old->shadowStats;
+				ao2_ref(old, -1);
+			}
+			ao2_ref(profile, -1);
+		}
+		ao2_iterator_destroy(&i);
+	}
+
+	ao2_global_obj_replace_unref(cpa_globals, newcfg);
+
+	ast_verb(3, "CPA defaults: totalAnalysisTime [%d] silenceThreshold [%d] profiles [%d] shadows [%d] at [%d%%]\n",
+		dfltTotalAnalysisTime, dfltSilenceThreshold, ao2_container_count(newcfg->profiles),
+		newcfg->numShadowProfiles, newcfg->shadowSamplePercent);
 
 	return 0;
 }
 
 static int unload_module(void)
 {
-	return ast_unregister_application(app);
+	RAII_VAR(struct cpa_config *, cfg, ao2_global_obj_ref(cpa_globals), ao2_cleanup);
+	int res;
+
+	ast_cli_unregister_multiple(cli_cpa, ARRAY_LEN(cli_cpa));
+	res = ast_unregister_application(app);
+	res |= ast_unregister_application(dial_app);
+	res |= ast_unregister_application(monitor_app);
+	res |= ast_custom_function_unregister(&cpa_disposition_function);
+	res |= ast_manager_unregister("CPADisposition");
+	res |= ast_manager_unregister("CPASessions");
+	res |= ast_custom_function_unregister(&cpa_trunk_status_function);
+	ast_devstate_prov_del("CPA");
+	cpa_metrics_apply(NULL);
+	if (cpaMonitorThread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&cpaMonitorLock);
+		cpaMonitorStop = 1;
+		ast_cond_signal(&cpaMonitorCond);
+		ast_mutex_unlock(&cpaMonitorLock);
+		pthread_join(cpaMonitorThread, NULL);
+		cpaMonitorThread = AST_PTHREADT_NULL;
+	}
+	if (cpaWheelThread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&cpaWheelLock);
+		cpaWheelStop = 1;
+		ast_cond_signal(&cpaWheelCond);
+		ast_mutex_unlock(&cpaWheelLock);
+		pthread_join(cpaWheelThread, NULL);
+		cpaWheelThread = AST_PTHREADT_NULL;
+	}
+	if (cpaFeatureThread != AST_PTHREADT_NULL) {
+		/* Writes what is still queued before it exits */
+		ast_mutex_lock(&cpaFeatureLock);
+		cpaFeatureStop = 1;
+		ast_cond_signal(&cpaFeatureCond);
+		ast_mutex_unlock(&cpaFeatureLock);
+		pthread_join(cpaFeatureThread, NULL);
+		cpaFeatureThread = AST_PTHREADT_NULL;
+	}
+	ast_cond_destroy(&cpaMonitorCond);
+	ast_cond_destroy(&cpaMetricsCond);
+	ast_cond_destroy(&cpaWheelCond);
+	ast_cond_destroy(&cpaFeatureCond);
+
+	if (cfg && !ast_strlen_zero(cfg->snapshotFile)) {
+		cpa_snapshot_export(cfg->snapshotFile);
+	}
+	ao2_global_obj_release(cpa_globals);
+	ao2_cleanup(learned_dests);
+	learned_dests = NULL;
+	ao2_cleanup(cpa_arms);
+	cpa_arms = NULL;
+	ao2_cleanup(cpa_pendings);
+	cpa_pendings = NULL;
+	ao2_cleanup(cpa_trunks);
+	cpa_trunks = NULL;
+
+	return res;
 }
 
 /*!
@@ -507,21 +7780,113 @@ static int unload_module(void)
  */
 static int load_module(void)
 {
-	if (load_config(0) || ast_register_application_xml(app, cpa_exec)) {
+	RAII_VAR(struct cpa_config *, cfg, NULL, ao2_cleanup);
+	int i;
+
+	for (i = 0; i < CPA_MONITOR_SLOTS; i++) {
+		ast_mutex_init(&cpaMonitorSlots[i].lock);
+	}
+	ast_cond_init(&cpaMonitorCond, NULL);
+	cpaMonitorStop = 0;
+	ast_cond_init(&cpaMetricsCond, NULL);
+	cpaMetricsStop = 0;
+	ast_cond_init(&cpaWheelCond, NULL);
+	ast_cond_init(&cpaFeatureCond, NULL);
+	cpaFeatureStop = 0;
+	cpa_kws_tables_init();
+	cpaWheelStop = 0;
+	cpaWheelStart = ast_tvnow();
+	cpaWheelTick = 0;
+
+	if (!(learned_dests = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 1021,
+		cpa_learned_dest_hash, NULL, cpa_learned_dest_cmp))) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	cpa_arms = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61, cpa_arm_hash, NULL, cpa_arm_cmp);
+	cpa_pendings = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 1021, cpa_pending_hash, NULL, cpa_pending_cmp);
+	cpa_trunks = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_MUTEX, 0, 61, cpa_trunk_hash, NULL, cpa_trunk_cmp);
+	if (!cpa_arms || !cpa_pendings || !cpa_trunks) {
+		ao2_cleanup(cpa_arms);
+		ao2_cleanup(cpa_pendings);
+		ao2_cleanup(cpa_trunks);
+		ao2_cleanup(learned_dests);
+		cpa_arms = cpa_pendings = cpa_trunks = NULL;
+		learned_dests = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (load_config(0) || ast_register_application_xml(app, cpa_exec)
+		|| ast_register_application_xml(dial_app, cpadial_exec)
+		|| ast_register_application_xml(monitor_app, cpamonitor_exec)
+		|| ast_pthread_create_background(&cpaWheelThread, NULL, cpa_wheel_run, NULL)
+		|| ast_pthread_create_background(&cpaMonitorThread, NULL, cpa_monitor_run, NULL)) {
+		if (cpaWheelThread != AST_PTHREADT_NULL) {
+			ast_mutex_lock(&cpaWheelLock);
+			cpaWheelStop = 1;
+			ast_cond_signal(&cpaWheelCond);
+			ast_mutex_unlock(&cpaWheelLock);
+			pthread_join(cpaWheelThread, NULL);
+		}
+		cpaWheelThread = AST_PTHREADT_NULL;
+		cpaMonitorThread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&cpaMonitorCond);
+		ast_cond_destroy(&cpaMetricsCond);
+		ast_cond_destroy(&cpaWheelCond);
+		ast_cond_destroy(&cpaFeatureCond);
+		ast_unregister_application(app);
+		ast_unregister_application(dial_app);
+		ast_unregister_application(monitor_app);
+		ao2_global_obj_release(cpa_globals);
+		ao2_cleanup(learned_dests);
+		ao2_cleanup(cpa_arms);
+		ao2_cleanup(cpa_pendings);
+		ao2_cleanup(cpa_trunks);
+		cpa_arms = cpa_pendings = cpa_trunks = NULL;
+		learned_dests = NULL;
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	if (ast_custom_function_register(&cpa_disposition_function)
+		|| ast_manager_register_xml("CPADisposition", EVENT_FLAG_CALL, manager_cpa_disposition)
+		|| ast_manager_register_xml("CPASessions", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_cpa_sessions)
+		|| ast_custom_function_register(&cpa_trunk_status_function)
+		|| ast_devstate_prov_add("CPA", cpa_trunk_devstate)) {
+		ast_log(LOG_ERROR, "CPA: Unable to register the CPA functions, manager actions or device state provider\n");
+		/* Without a configuration unload does not export empty state over the snapshot */
+		ao2_global_obj_release(cpa_globals);
+		unload_module();
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
+	cfg = ao2_global_obj_ref(cpa_globals);
+	cpa_metrics_apply(cfg);
+
+	/* Warm start from the last exported learned state */
+	if (cfg && !ast_strlen_zero(cfg->snapshotFile) && !access(cfg->snapshotFile, R_OK)) {
+		ast_verb(3, "CPA: Merged %d learned destinations from %s\n",
+			cpa_snapshot_import(cfg->snapshotFile), cfg->snapshotFile);
+	}
+
+	ast_cli_register_multiple(cli_cpa, ARRAY_LEN(cli_cpa));
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
 static int reload(void)
 {
+	struct cpa_config *cfg;
+
 	if (load_config(1))
 		return AST_MODULE_LOAD_DECLINE;
+
+	/* metrics_file and metrics_http may have been turned on or off */
+	cfg = ao2_global_obj_ref(cpa_globals);
+	cpa_metrics_apply(cfg);
+	ao2_cleanup(cfg);
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
-AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "DSP Call Progress Application",
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_GLOBAL_SYMBOLS, "DSP Call Progress Application",
 		.support_level = AST_MODULE_SUPPORT_EXTENDED,
 		.load = load_module,
 		.unload = unload_module,
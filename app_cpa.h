@@ -0,0 +1,107 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * Copyright (C) 2015, LeaseHawk, LLC.
+ *
+ * Justin Zimmer (jzimmer@leasehawk.com)
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Call Progress Analysis API for other modules
+ *
+ * Lets a module run call progress analysis on a channel it is already
+ * reading from, e.g. a queue member or follow-me leg that just answered,
+ * without handing the channel to the CPA() application. The analysis runs
+ * in a framehook on the channel's read path and the verdict is delivered
+ * through a callback.
+ *
+ * \code
+ * static void member_verdict(struct ast_channel *chan, const char *status, int ms, void *data)
+ * {
+ *	if (!strcmp(status, "Machine") || !strcmp(status, "Screening")) {
+ *		ast_softhangup_nolock(chan, AST_SOFTHANGUP_EXPLICIT);
+ *	}
+ * }
+ *
+ * handle = ast_cpa_start(member, "mobile", 2000, member_verdict, NULL);
+ * ...
+ * ast_cpa_cancel(handle);
+ * \endcode
+ *
+ * Modules using this API need app_cpa loaded first, declare it with
+ * <depend>app_cpa</depend> in their MODULEINFO.
+ */
+
+#ifndef _ASTERISK_APP_CPA_H
+#define _ASTERISK_APP_CPA_H
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+struct ast_channel;
+
+/*! \brief A running analysis started with ast_cpa_start() */
+struct ast_cpa_handle;
+
+/*!
+ * \brief Called once with the verdict of an analysis
+ *
+ * \param chan The analysed channel
+ * \param status The verdict, the same values CPA() sets CPASTATUS to
+ * \param ms Audio analysed (ms) when the verdict was reached
+ * \param data The data given to ast_cpa_start()
+ *
+ * \note Runs on the thread reading the channel with the channel locked,
+ * so it must not block. Queue a hangup or set a flag for the owner.
+ */
+typedef void (*ast_cpa_verdict_cb)(struct ast_channel *chan, const char *status, int ms, void *data);
+
+/*!
+ * \brief Start call progress analysis on a channel
+ *
+ * \param chan Channel to analyse, usually just answered
+ * \param profile cpa.conf profile, NULL for the default one
+ * \param totalAnalysisTime Most audio (ms) to analyse before Timeout
+ * \param callback Called once with the verdict
+ * \param data Passed to callback
+ *
+ * Only 8kHz signed linear, ulaw and alaw audio is analysed, the channel's
+ * read format is left alone.
+ *
+ * A channel that stops sending frames still gets its verdict: Timeout once
+ * totalAnalysisTime plus the frame allowance CPA() gives has passed on the
+ * wall clock (NoFrames if no audio came at all), or NoMedia after
+ * no_media_grace from cpa.conf without a frame. It is delivered the next
+ * time the channel is read, which a queued null frame triggers.
+ *
+ * \return handle to pass to ast_cpa_cancel(), NULL on failure
+ */
+struct ast_cpa_handle *ast_cpa_start(struct ast_channel *chan, const char *profile, int totalAnalysisTime,
+	ast_cpa_verdict_cb callback, void *data);
+
+/*!
+ * \brief Stop an analysis and release its handle
+ *
+ * Must be called once for every handle ast_cpa_start() returned, whether
+ * the verdict has been delivered or not. The callback is not called after
+ * this returns.
+ */
+void ast_cpa_cancel(struct ast_cpa_handle *handle);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _ASTERISK_APP_CPA_H */